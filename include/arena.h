@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+
+struct arena_block;
+
+/*
+ * A bump allocator for objects that share a short lifetime. Memory is handed
+ * out from fixed size blocks and is all released at once by arena_reset(),
+ * which keeps one block around so that steady state use doesn't allocate.
+ */
+struct arena {
+	struct arena_block* blocks;
+	size_t block_size;
+};
+
+void arena_init(struct arena* self, size_t block_size);
+void arena_destroy(struct arena* self);
+
+/* Returns zeroed memory, aligned for any type */
+void* arena_alloc(struct arena* self, size_t size);
+void arena_reset(struct arena* self);
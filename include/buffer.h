@@ -29,6 +29,7 @@
 struct wl_buffer;
 struct gbm_bo;
 struct gbm_device;
+struct dma_heap;
 struct nvnc_fb;
 
 enum wv_buffer_type {
@@ -69,6 +70,11 @@ struct wv_buffer {
 
 	enum wv_buffer_domain domain;
 
+	/* Timing information for performance samples */
+	uint64_t capture_latency_us;
+	uint64_t fed_at_us;
+	uint64_t feed_seq;
+
 	struct pixman_region16 frame_damage;
 	struct pixman_region16 buffer_damage;
 
@@ -79,6 +85,11 @@ struct wv_buffer {
 	int n_modifiers;
 	uint64_t* modifiers;
 	struct wv_gbm_device* gbm;
+	/* Only set for dma-heap buffers, which are mapped for the CPU without
+	 * GBM and need explicit cache maintenance around CPU reads.
+	 */
+	int cpu_sync_fd;
+	bool is_cpu_access;
 #endif
 
 	/* The following is only applicable to cursors */
@@ -101,11 +112,38 @@ struct wv_buffer_config {
 	uint64_t* modifiers;
 };
 
+struct wv_buffer_prewarm;
+LIST_HEAD(wv_buffer_prewarm_list, wv_buffer_prewarm);
+
+struct wv_buffer_pool_stats {
+	uint64_t acquired;
+	uint64_t misses;
+	uint64_t prewarmed;
+	// Buffers released by neatvnc, and the time that those that were
+	// still being encoded after being replaced were held for
+	uint64_t released;
+	uint64_t backlog_us;
+
+	uint32_t n_buffers;
+	uint32_t n_free;
+};
+
 struct wv_buffer_pool {
 	struct wv_buffer_queue queue;
+	struct wv_buffer_prewarm_list prewarming;
+
+	/* Number of free buffers to keep ready. They are allocated and
+	 * pre-faulted in the background.
+	 */
+	int spare_target;
+
 	struct wv_buffer_config config;
+	enum wv_buffer_domain domain;
 #ifdef ENABLE_SCREENCOPY_DMABUF
 	struct wv_gbm_device* gbm;
+#ifdef HAVE_LINUX_DMA_HEAP
+	struct dma_heap* heap;
+#endif
 #endif
 };
 
@@ -116,6 +154,17 @@ void wv_buffer_damage_rect(struct wv_buffer* self, int x, int y, int width,
 void wv_buffer_damage_whole(struct wv_buffer* self);
 void wv_buffer_damage_clear(struct wv_buffer* self);
 
+/* Replaces the frame damage with the parts that differ from another buffer
+ * with the same layout. Returns -1 if the contents cannot be compared.
+ */
+int wv_buffer_damage_from_diff(struct wv_buffer* self,
+		const struct wv_buffer* other);
+
+/* Called after a buffer has been fed to neatvnc */
+void wv_buffer_record_feed(struct wv_buffer* self);
+/* Called when neatvnc is done with a buffer that was fed to it */
+void wv_buffer_record_release(struct wv_buffer* self);
+
 struct wv_buffer_pool* wv_buffer_pool_create(
 		const struct wv_buffer_config* config);
 void wv_buffer_pool_destroy(struct wv_buffer_pool* pool);
@@ -124,6 +173,26 @@ bool wv_buffer_pool_reconfig(struct wv_buffer_pool* pool,
 struct wv_buffer* wv_buffer_pool_acquire(struct wv_buffer_pool* pool);
 void wv_buffer_pool_release(struct wv_buffer_pool* pool,
 		struct wv_buffer* buffer);
+void wv_buffer_pool_get_stats(struct wv_buffer_pool_stats* stats);
 
 void wv_buffer_registry_damage_all(struct pixman_region16* region,
 		enum wv_buffer_domain domain);
+
+/* Choose a dma-heap by name, e.g. "system" or "linux,cma", to allocate
+ * DMA-BUFs from. By default, CMA is used if it is available and the system
+ * heap is used if there is no render node.
+ */
+void wv_buffer_set_dma_heap(const char* name);
+void wv_buffer_set_lock_memory(bool enable);
+
+/* Brackets CPU reads of a captured buffer. This is a no-op for buffers that
+ * do not need it.
+ */
+void wv_buffer_begin_cpu_access(struct wv_buffer* self);
+void wv_buffer_end_cpu_access(struct wv_buffer* self);
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+struct wv_gbm_device* wv_gbm_device_open(dev_t node);
+void wv_gbm_device_ref(struct wv_gbm_device* dev);
+void wv_gbm_device_unref(struct wv_gbm_device* dev);
+#endif
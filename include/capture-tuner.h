@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "screencopy-interface.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Both copying backends with shm and dmabuf, plus export-dmabuf
+#define CAPTURE_TUNER_MAX_CANDIDATES 5
+
+struct capture_choice {
+	enum screencopy_backend backend;
+	bool linux_dmabuf;
+};
+
+struct capture_tuner_result {
+	struct capture_choice choice;
+	uint32_t n_frames;
+	// Per frame averages
+	uint32_t latency_us;
+	uint32_t cpu_us;
+};
+
+/*
+ * Tries each available capture backend and buffer type in turn for a fixed
+ * number of frames and picks the one with the lowest sum of copy latency and
+ * process CPU time per frame.
+ *
+ * The caller drives it: it configures capturing with the current candidate,
+ * feeds each captured frame's latency in and moves on to the next candidate
+ * when enough frames have arrived or it has given up waiting for them.
+ */
+struct capture_tuner {
+	struct capture_tuner_result results[CAPTURE_TUNER_MAX_CANDIDATES];
+	int n_candidates;
+	int current;
+
+	uint64_t latency_sum_us;
+	uint64_t cpu_start_us;
+};
+
+void capture_tuner_init(struct capture_tuner* self, bool allow_linux_dmabuf,
+		bool allow_zero_copy);
+
+// Returns NULL when all candidates have been measured
+const struct capture_choice* capture_tuner_candidate(
+		const struct capture_tuner* self);
+
+void capture_tuner_begin(struct capture_tuner* self);
+
+// Returns true when the current candidate has been measured for long enough
+bool capture_tuner_add_frame(struct capture_tuner* self, uint64_t latency_us);
+
+// Returns false when there are no more candidates
+bool capture_tuner_next(struct capture_tuner* self);
+
+// Returns -1 if no candidate delivered any frames
+int capture_tuner_best(const struct capture_tuner* self,
+		struct capture_choice* choice);
+
+/*
+ * The choice is cached on disk per compositor identity, which is anything
+ * that distinguishes one compositor setup from another; wayvnc derives it
+ * from the set of advertised globals.
+ */
+int capture_tuner_cache_load(uint64_t identity, struct capture_choice* choice);
+int capture_tuner_cache_store(uint64_t identity,
+		const struct capture_choice* choice);
@@ -35,5 +35,12 @@ void* ctl_client_userdata(struct ctl_client*);
 int ctl_client_run_command(struct ctl_client* self,
 		struct option_parser* parent_options, unsigned flags);
 
+/* Reads newline separated commands from stdin and sends them over a single
+ * connection without waiting for each response. Responses are printed in the
+ * order that the commands were given, and events are printed as they arrive
+ * if event-receive is among the commands.
+ */
+int ctl_client_run_batch(struct ctl_client* self, unsigned flags);
+
 void ctl_client_print_command_list(FILE* stream);
 void ctl_client_print_event_list(FILE* stream);
@@ -31,6 +31,11 @@ enum cmd_type {
 	CMD_OUTPUT_SET,
 	CMD_VERSION,
 	CMD_WAYVNC_EXIT,
+	CMD_MEMORY_STATS,
+	CMD_DAMAGE_MAP,
+	CMD_CAPTURE_INFO,
+	CMD_CAPTURE_SET,
+	CMD_SCHEDULING_INFO,
 	CMD_UNKNOWN,
 };
 #define CMD_LIST_LEN CMD_UNKNOWN
@@ -42,6 +47,9 @@ enum event_type {
 	EVT_DETACHED,
 	EVT_OUTPUT_ADDED,
 	EVT_OUTPUT_REMOVED,
+	EVT_PERFORMANCE_SAMPLE,
+	EVT_CAPTURE_STALLED,
+	EVT_LOAD_SHEDDING,
 	EVT_UNKNOWN,
 };
 #define EVT_LIST_LEN EVT_UNKNOWN
@@ -56,7 +64,7 @@ struct cmd_param_info {
 struct cmd_info {
 	char* name;
 	char* description;
-	struct cmd_param_info params[5];
+	struct cmd_param_info params[10];
 };
 
 enum cmd_type ctl_command_parse_name(const char* name);
@@ -18,11 +18,15 @@
 #pragma once
 
 #include "output.h"
+#include "perf-stats.h"
+#include "capture-tuner.h"
 
+#include <stdint.h>
 #include <sys/socket.h>
 
 struct ctl;
 struct cmd_response;
+struct damage_map;
 
 struct ctl_server_client;
 
@@ -34,6 +38,18 @@ struct ctl_server_client_info {
 	};
 	const char* username;
 	const char* seat;
+
+	uint64_t connected_us;
+	uint64_t idle_us;
+	uint32_t n_pointer_events;
+	uint32_t n_key_events;
+	uint64_t clipboard_bytes;
+
+	uint64_t n_update_requests;
+	double updates_per_second;
+	// From a frame being handed to neatvnc until the client asks for more
+	uint32_t update_latency_avg_us;
+	uint32_t update_latency_p99_us;
 };
 
 struct ctl_server_output {
@@ -45,6 +61,50 @@ struct ctl_server_output {
 	char power[8];
 };
 
+struct ctl_server_perf_sample {
+	uint32_t interval_ms;
+	double fps;
+	double damage;
+	struct wv_perf_percentiles capture_latency;
+	struct wv_perf_percentiles fb_hold_time;
+	uint32_t n_buffers;
+	uint32_t n_free_buffers;
+	uint64_t buffer_misses;
+	uint32_t loop_stalls;
+	uint32_t capture_stalls;
+	int n_clients;
+};
+
+struct ctl_server_capture_result {
+	const char* backend;
+	const char* buffer_type;
+	uint32_t n_frames;
+	uint32_t latency_us;
+	uint32_t cpu_us;
+};
+
+// Negative values are left unchanged
+struct ctl_server_capture_params {
+	int max_fps;
+	int cursor_max_fps;
+	int spare_buffers;
+	int render_cursor;
+	int gpu;
+};
+
+struct ctl_server_capture_info {
+	// NULL if nothing is being captured
+	const char* backend;
+	const char* buffer_type;
+	// One of "default", "tuning", "cached" or "measured"
+	const char* selection;
+	uint64_t compositor_identity;
+	int n_results;
+	struct ctl_server_capture_result results[CAPTURE_TUNER_MAX_CANDIDATES];
+	struct ctl_server_capture_params params;
+	uint32_t n_stalls;
+};
+
 struct ctl_server_actions {
 	void* userdata;
 	struct cmd_response* (*on_attach)(struct ctl*, const char* display);
@@ -67,11 +127,29 @@ struct ctl_server_actions {
 	// Receiver will free(outputs) when done.
 	int (*get_output_list)(struct ctl*,
 			struct ctl_server_output** outputs);
+
+	// Return NULL if damage map accumulation is not enabled
+	const struct damage_map* (*get_damage_map)(struct ctl*);
+
+	void (*get_capture_info)(struct ctl*,
+			struct ctl_server_capture_info* info);
+	struct cmd_response* (*on_capture_set)(struct ctl*,
+			const struct ctl_server_capture_params* params,
+			bool reset);
+
+	// Called when the shortest interval requested for performance samples
+	// changes. Zero means that nobody wants them.
+	void (*on_sample_interval)(struct ctl*, uint32_t interval_ms);
 };
 
+#define CTL_SERVER_DEFAULT_MAX_MESSAGE_SIZE 1048576 // 1 MiB
+
 struct ctl* ctl_server_new(const char* socket_path,
 		const struct ctl_server_actions* actions);
 void ctl_server_destroy(struct ctl*);
+
+// Applies to clients that connect after this is called
+void ctl_server_set_max_message_size(struct ctl*, size_t size);
 void* ctl_server_userdata(struct ctl*);
 
 struct cmd_response* cmd_ok(void);
@@ -92,3 +170,13 @@ void ctl_server_event_detached(struct ctl*);
 
 void ctl_server_event_output_added(struct ctl*, const char* name);
 void ctl_server_event_output_removed(struct ctl*, const char* name);
+
+void ctl_server_event_performance_sample(struct ctl*,
+		const struct ctl_server_perf_sample* sample);
+
+void ctl_server_event_capture_stalled(struct ctl*, uint32_t n_stalls,
+		uint32_t retry_delay_ms);
+
+// A negative client id is left out
+void ctl_server_event_load_shedding(struct ctl*, const char* action,
+		double load, int max_fps, int client_id);
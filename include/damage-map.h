@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct pixman_region16;
+
+/*
+ * A coarse grid of tiles counting how often each tile has been damaged. The
+ * counts decay exponentially with the given time constant, so the map shows
+ * where damage has been happening recently.
+ *
+ * Decay is applied lazily: instead of scaling every tile on every frame, new
+ * damage is added with a weight that grows over time, and the tiles are
+ * rescaled only when the weight gets large.
+ */
+struct damage_map {
+	int tile_size;
+	int columns, rows;
+	double time_constant;
+
+	uint64_t epoch;
+	double* tiles;
+
+	// Used to count each tile at most once per frame
+	uint32_t frame;
+	uint32_t* tile_frames;
+};
+
+int damage_map_init(struct damage_map* self, int tile_size,
+		double time_constant);
+void damage_map_destroy(struct damage_map* self);
+
+int damage_map_resize(struct damage_map* self, int width, int height);
+void damage_map_add(struct damage_map* self,
+		const struct pixman_region16* region);
+
+// Write the decayed damage counts at the current time into an array of
+// columns * rows values, in row-major order
+void damage_map_snapshot(const struct damage_map* self, double* values);
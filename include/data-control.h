@@ -17,13 +17,18 @@
 #pragma once
 
 #include <neatvnc.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 #include "wlr-data-control-unstable-v1.h"
 
 #include "sys/queue.h"
 
+#define DATA_CONTROL_DEFAULT_MAX_SIZE 33554432 // 32 MiB
+
 struct receive_context;
 struct send_context;
+struct aml_timer;
 
 LIST_HEAD(receive_context_list, receive_context);
 LIST_HEAD(send_context_list, send_context);
@@ -39,13 +44,27 @@ struct data_control {
 	struct zwlr_data_control_source_v1* primary_selection;
 	struct zwlr_data_control_offer_v1* offer;
 	bool is_own_offer;
+	bool enable_primary_selection;
+	/* The primary selection changes continuously while text is being
+	 * selected, so it is only transferred once it has settled.
+	 */
+	struct zwlr_data_control_offer_v1* pending_primary_offer;
+	struct aml_timer* primary_timer;
+	struct receive_context* primary_receive;
 	const char* mime_type;
 	/* x-wayvnc-client-(8 hexadecimal digits) + \0 */
 	char custom_mime_type_name[32];
 	char* cb_data;
 	size_t cb_len;
+	size_t max_receive_size;
+	/* Identifies the clipboard content that VNC clients were last given,
+	 * so that re-asserted selections are not sent again.
+	 */
+	uint64_t client_cb_hash;
+	size_t client_cb_len;
 };
 
-void data_control_init(struct data_control* self, struct nvnc* server, struct wl_seat* seat);
+void data_control_init(struct data_control* self, struct nvnc* server,
+		struct wl_seat* seat, bool enable_primary_selection);
 void data_control_destroy(struct data_control* self);
 void data_control_to_clipboard(struct data_control* self, const char* text, size_t len);
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "screencopy-interface.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A capture backend that needs no compositor. Frames are produced from an aml
+ * timer according to a script, so that tests and benchmarks can control the
+ * timing, damage and failures that the rest of the pipeline sees.
+ *
+ * Delivered buffers are returned either via the release function of their
+ * nvnc_fb, like with the real backends, or via fake_screencopy_release().
+ */
+
+struct fake_screencopy_step {
+	enum screencopy_result result;
+	// Time from when capturing is started until the frame is delivered
+	uint32_t delay_us;
+	// An empty rectangle means that the whole frame is damaged
+	int x, y, width, height;
+};
+
+struct fake_screencopy_config {
+	int width, height;
+	// Any 32 bit DRM format
+	uint32_t format;
+
+	const struct fake_screencopy_step* script;
+	size_t script_len;
+
+	// Without this, no more frames are produced once the end of the script
+	// is reached, as if the compositor had stopped responding.
+	bool repeat;
+};
+
+struct fake_screencopy_stats {
+	uint32_t n_started;
+	uint32_t n_delivered;
+	uint32_t n_failed;
+	uint32_t n_buffers;
+	uint32_t n_free;
+};
+
+extern struct screencopy_impl fake_screencopy_impl;
+
+struct screencopy* fake_screencopy_create(
+		const struct fake_screencopy_config* config);
+void fake_screencopy_release(struct screencopy* self,
+		struct wv_buffer* buffer);
+void fake_screencopy_get_stats(const struct screencopy* self,
+		struct fake_screencopy_stats* stats);
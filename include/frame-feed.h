@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <wayland-client.h>
+
+struct wv_buffer;
+struct damage_map;
+struct nvnc_fb;
+struct pixman_region16;
+
+typedef void (*frame_feed_fn)(struct nvnc_fb* fb,
+		struct pixman_region16* damage, void* userdata);
+
+/*
+ * Takes a captured frame from its buffer to the display: the damage is brought
+ * into the orientation of the output, unless the capture backend already did
+ * that, clipped to the buffer and added to the damage map before the frame is
+ * handed on.
+ */
+struct frame_feed {
+	enum wl_output_transform output_transform;
+	// The capture backend delivers frames in the output's orientation
+	bool is_transformed;
+	// Optional
+	struct damage_map* damage_map;
+
+	// Normally passes the frame on to nvnc_display_feed_buffer()
+	frame_feed_fn feed;
+	void* userdata;
+};
+
+void frame_feed_process(struct frame_feed* self, struct wv_buffer* buffer);
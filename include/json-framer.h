@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <jansson.h>
+
+/*
+ * Splits a byte stream into complete top level JSON objects or arrays. The
+ * framer tracks nesting and string state as bytes arrive, so each byte is
+ * scanned once, and only complete values are handed to jansson.
+ *
+ * The buffer grows as needed, up to max_size.
+ */
+struct json_framer {
+	char* buffer;
+	size_t size;
+	size_t max_size;
+
+	size_t head; // Start of the value being framed
+	size_t tail; // End of received data
+	size_t scan; // Bytes up to here have been scanned
+
+	int depth;
+	bool in_string;
+	bool escaped;
+};
+
+void json_framer_init(struct json_framer* self, size_t initial_size,
+		size_t max_size);
+void json_framer_destroy(struct json_framer* self);
+
+/*
+ * Returns where received data should be written, and how much space there is.
+ * Returns NULL with errno set to EMSGSIZE if a single value would exceed
+ * max_size, or ENOMEM.
+ */
+char* json_framer_write_ptr(struct json_framer* self, size_t* space);
+void json_framer_commit(struct json_framer* self, size_t len);
+
+/*
+ * Returns the next complete value, or NULL with errno set to EAGAIN if more
+ * data is needed, or EINVAL if the stream is not valid JSON. In the latter
+ * case, err is filled in if given.
+ */
+json_t* json_framer_next(struct json_framer* self, json_error_t* err);
+
+/* Number of bytes received but not yet returned as values */
+size_t json_framer_pending(const struct json_framer* self);
+
+/* Number of bytes allocated for the buffer */
+size_t json_framer_capacity(const struct json_framer* self);
@@ -66,5 +66,8 @@ struct jsonipc_response* jsonipc_error_response_new(struct jsonipc_error* err,
 void jsonipc_response_destroy(struct jsonipc_response*);
 json_t* jsonipc_response_pack(struct jsonipc_response*, json_error_t* err);
 
+/* Free a string returned by json_dumps() */
+void jsonipc_free_string(char* str);
+
 json_t* jprintf(const char* fmt, ...);
 json_t* jvprintf(const char* fmt, va_list ap);
@@ -39,6 +39,9 @@ struct keyboard {
 	struct table_entry* lookup_table;
 
 	struct intset key_state;
+
+	/* Keymap and lookup table size, for memory accounting */
+	size_t mem_size;
 };
 
 int keyboard_init(struct keyboard* self, const struct xkb_rule_names* rule_names);
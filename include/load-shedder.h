@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define LOAD_SHEDDER_MIN_RATE 5
+#define ENCODE_BACKLOG_HISTORY 64
+
+enum load_action {
+	LOAD_ACTION_NONE = 0,
+	LOAD_ACTION_LOWER_RATE,
+	LOAD_ACTION_CLOSE_ADMISSION,
+	LOAD_ACTION_SHED_CLIENT,
+	LOAD_ACTION_OPEN_ADMISSION,
+	LOAD_ACTION_RAISE_RATE,
+};
+
+// Totals over one measurement window
+struct load_window {
+	uint32_t n_frames;
+	uint64_t process_us;
+	// Frames released by the display and how long the backlogged ones
+	// were held for
+	uint32_t n_released;
+	uint64_t backlog_us;
+};
+
+/*
+ * Neatvnc holds a frame until a newer one replaces it, so the time a frame is
+ * held says nothing about the encoders by itself. A frame that is still held
+ * after it has been replaced is still being encoded, though, which means that
+ * the encoders are not keeping up with the frame rate.
+ */
+struct encode_backlog {
+	uint64_t feed_times[ENCODE_BACKLOG_HISTORY];
+	uint64_t n_fed;
+};
+
+/*
+ * Compares the average time spent on each frame, on the main loop and by
+ * encoders that have fallen behind, with the frame period at the current rate
+ * limit. When that budget has been exceeded for a number of
+ * consecutive windows, the next action in the following sequence is taken:
+ * lower the rate limit until it reaches LOAD_SHEDDER_MIN_RATE, stop admitting
+ * new clients, then shed clients one at a time. When the load has been low
+ * for long enough, the steps are undone in reverse order.
+ */
+struct load_shedder {
+	int configured_rate;
+	int rate;
+	bool is_admission_closed;
+	int n_overloaded;
+	int n_healthy;
+	// Cost per frame relative to the frame period, from the last window
+	double load;
+};
+
+void load_shedder_init(struct load_shedder* self, int rate);
+
+// Call when the configured rate limit changes
+void load_shedder_set_rate(struct load_shedder* self, int rate);
+
+enum load_action load_shedder_update(struct load_shedder* self,
+		const struct load_window* window);
+
+const char* load_action_name(enum load_action action);
+
+// Returns a sequence number to pass to encode_backlog_release()
+uint64_t encode_backlog_feed(struct encode_backlog* self, uint64_t now);
+
+// Returns how long the frame was held if it was released late, otherwise 0
+uint64_t encode_backlog_release(const struct encode_backlog* self,
+		uint64_t seq, uint64_t fed_at, uint64_t now);
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <neatvnc.h>
+
+extern int wv__log_level;
+
+static inline bool wv_log_is_enabled(enum nvnc_log_level level)
+{
+	return (int)level <= wv__log_level;
+}
+
+/*
+ * These behave like nvnc_log() and nvnc_trace(), except that the arguments
+ * are not evaluated unless the level is enabled. Use them when formatting
+ * the arguments is expensive, e.g. when they involve json_dumps().
+ */
+#define wv_log(lvl, fmt, ...) do { \
+	if (wv_log_is_enabled(lvl)) \
+		nvnc_log(lvl, fmt, ## __VA_ARGS__); \
+} while (0)
+
+#define wv_trace(fmt, ...) do { \
+	if (wv_log_is_enabled(NVNC_LOG_TRACE)) \
+		nvnc_trace(fmt, ## __VA_ARGS__); \
+} while (0)
+
+void wv_log_set_level(enum nvnc_log_level level);
+
+/*
+ * The async sink moves writing of log messages onto a separate thread so that
+ * a slow or blocked stderr never stalls the main loop. Messages are passed
+ * through a fixed-size lock-free ring; if the ring is full, the message is
+ * dropped and counted. Panic messages are always written synchronously.
+ */
+int wv_log_async_start(void);
+void wv_log_async_stop(void);
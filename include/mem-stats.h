@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define X_MEM_CATEGORY_LIST \
+	X(SHM_BUFFERS, "shm-buffers") \
+	X(DMABUF_BUFFERS, "dmabuf-buffers") \
+	X(CURSOR_BUFFERS, "cursor-buffers") \
+	X(CLIPBOARD, "clipboard") \
+	X(CTL, "ctl") \
+	X(KEYMAPS, "keymaps") \
+	X(JSON, "json") \
+
+enum wv_mem_category {
+#define X(id, name) WV_MEM_##id,
+	X_MEM_CATEGORY_LIST
+#undef X
+	WV_MEM_CATEGORY_COUNT,
+};
+
+struct wv_mem_usage {
+	size_t bytes;
+	size_t objects;
+};
+
+/*
+ * Live counters of memory held by each subsystem. These only account for
+ * what wayvnc allocates itself; memory that is internal to libraries or held
+ * by the compositor on our behalf is not included.
+ */
+void wv_mem_alloc(enum wv_mem_category category, size_t size);
+void wv_mem_free(enum wv_mem_category category, size_t size);
+void wv_mem_resize(enum wv_mem_category category, size_t old_size,
+		size_t new_size);
+
+void wv_mem_get_usage(enum wv_mem_category category,
+		struct wv_mem_usage* usage);
+void wv_mem_get_total(struct wv_mem_usage* usage);
+const char* wv_mem_category_name(enum wv_mem_category category);
+
+/* Must be called before any JSON objects are created */
+void wv_mem_track_json(void);
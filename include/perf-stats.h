@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+enum wv_perf_latency {
+	WV_PERF_CAPTURE_LATENCY,
+	WV_PERF_FB_HOLD_TIME,
+	WV_PERF_LATENCY_COUNT,
+};
+
+struct wv_perf_percentiles {
+	uint32_t n;
+	uint32_t p50;
+	uint32_t p90;
+	uint32_t p99;
+	uint32_t max;
+};
+
+/*
+ * Latency samples in microseconds, collected over one sampling window. Only a
+ * bounded number of samples is kept per window; any beyond that still count
+ * towards n and max, but not towards the percentiles.
+ *
+ * These must only be used from the main thread.
+ */
+void wv_perf_add_latency(enum wv_perf_latency which, uint64_t us);
+void wv_perf_get_percentiles(enum wv_perf_latency which,
+		struct wv_perf_percentiles* result);
+void wv_perf_reset(void);
+
+// Sorts the samples in place
+uint32_t wv_perf_percentile(uint32_t* samples, uint32_t n,
+		uint32_t percentile);
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct realtime_config {
+	// SCHED_RR priority, 1 to 99
+	int priority;
+	// CPU list such as "2,4-5", or NULL to leave the affinity as it is
+	const char* cpus;
+};
+
+struct realtime_status {
+	const char* policy;
+	int priority;
+	int nice;
+	char cpus[256];
+	bool memory_locked;
+	size_t locked_bytes;
+};
+
+/*
+ * This must be called before any threads are started so that they inherit
+ * the scheduling policy and CPU affinity of the main thread. If a real-time
+ * policy is not permitted, a raised nice level is requested instead.
+ *
+ * Returns -1 only if the configuration is invalid.
+ */
+int realtime_enable(const struct realtime_config* config);
+
+// Locks everything that has been mapped so far into memory
+void realtime_lock_memory(void);
+
+void realtime_get_status(struct realtime_status* status);
@@ -35,6 +35,13 @@ enum screencopy_capabilitites {
 	SCREENCOPY_CAP_TRANSFORM = 1 << 1,
 };
 
+enum screencopy_backend {
+	SCREENCOPY_BACKEND_EXT_IMAGE_COPY_CAPTURE,
+	SCREENCOPY_BACKEND_WLR_SCREENCOPY,
+	SCREENCOPY_BACKEND_EXPORT_DMABUF,
+	SCREENCOPY_BACKEND_COUNT,
+};
+
 typedef void (*screencopy_done_fn)(enum screencopy_result,
 		struct wv_buffer* buffer, void* userdata);
 
@@ -52,11 +59,13 @@ struct screencopy {
 
 	double rate_limit;
 	bool enable_linux_dmabuf;
+	int n_spare_buffers;
 
 	screencopy_done_fn on_done;
 	void (*cursor_enter)(void* userdata);
 	void (*cursor_leave)(void* userdata);
 	void (*cursor_hotspot)(int x, int y, void* userdata);
+	void (*cursor_position)(int x, int y, void* userdata);
 
 	double (*rate_format)(const void* userdata, enum wv_buffer_type type,
 			enum wv_buffer_domain domain, uint32_t format,
@@ -67,8 +76,21 @@ struct screencopy {
 
 struct screencopy* screencopy_create(struct wl_output* output,
 		bool render_cursor);
+struct screencopy* screencopy_create_zero_copy(struct wl_output* output,
+		bool render_cursor);
 struct screencopy* screencopy_create_cursor(struct wl_output* output,
 		struct wl_seat* seat);
+
+// Returns NULL if the compositor does not support the given backend
+struct screencopy* screencopy_create_with_backend(
+		enum screencopy_backend backend, struct wl_output* output,
+		bool render_cursor);
+bool screencopy_backend_is_available(enum screencopy_backend backend);
+enum screencopy_backend screencopy_get_backend(const struct screencopy* self);
+const char* screencopy_backend_name(enum screencopy_backend backend);
+// Returns -1 if the name is not known
+int screencopy_backend_from_name(const char* name);
+
 void screencopy_destroy(struct screencopy* self);
 
 int screencopy_start(struct screencopy* self, bool immediate);
@@ -25,4 +25,3 @@ extern const char* wayvnc_version;
 
 const char* default_ctl_socket_path();
 
-void advance_read_buffer(char (*buffer)[], size_t* current_len, size_t advance_by);
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include <stddef.h>
+
+#include "arena.h"
+#include "mem-stats.h"
+
+struct arena_block {
+	struct arena_block* next;
+	size_t size;
+	size_t used;
+	alignas(max_align_t) char data[];
+};
+
+void arena_init(struct arena* self, size_t block_size)
+{
+	self->blocks = NULL;
+	self->block_size = block_size;
+}
+
+static void arena_block_free(struct arena_block* block)
+{
+	wv_mem_free(WV_MEM_CTL, sizeof(*block) + block->size);
+	free(block);
+}
+
+void arena_destroy(struct arena* self)
+{
+	while (self->blocks) {
+		struct arena_block* block = self->blocks;
+		self->blocks = block->next;
+		arena_block_free(block);
+	}
+}
+
+static struct arena_block* arena_block_new(size_t size)
+{
+	struct arena_block* block = malloc(sizeof(*block) + size);
+	if (!block)
+		return NULL;
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	wv_mem_alloc(WV_MEM_CTL, sizeof(*block) + size);
+	return block;
+}
+
+void* arena_alloc(struct arena* self, size_t size)
+{
+	const size_t align = alignof(max_align_t);
+	size = (size + align - 1) & ~(align - 1);
+
+	struct arena_block* block = self->blocks;
+	if (!block || block->size - block->used < size) {
+		size_t block_size = size > self->block_size ?
+			size : self->block_size;
+		block = arena_block_new(block_size);
+		if (!block)
+			return NULL;
+
+		block->next = self->blocks;
+		self->blocks = block;
+	}
+
+	void* ptr = block->data + block->used;
+	block->used += size;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void arena_reset(struct arena* self)
+{
+	struct arena_block* keep = NULL;
+
+	while (self->blocks) {
+		struct arena_block* block = self->blocks;
+		self->blocks = block->next;
+
+		// Oversized blocks are only kept for as long as they're needed
+		if (!keep && block->size == self->block_size) {
+			keep = block;
+			continue;
+		}
+		arena_block_free(block);
+	}
+
+	if (keep) {
+		keep->used = 0;
+		keep->next = NULL;
+	}
+	self->blocks = keep;
+}
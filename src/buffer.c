@@ -18,14 +18,17 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <assert.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/param.h>
 #include <libdrm/drm_fourcc.h>
 #include <wayland-client.h>
 #include <pixman.h>
 #include <string.h>
 #include <neatvnc.h>
+#include <aml.h>
 
 #include "linux-dmabuf-unstable-v1.h"
 #include "shm.h"
@@ -35,6 +38,10 @@
 #include "config.h"
 #include "util.h"
 #include "strlcpy.h"
+#include "mem-stats.h"
+#include "perf-stats.h"
+#include "time-util.h"
+#include "load-shedder.h"
 
 #ifdef ENABLE_SCREENCOPY_DMABUF
 #include <gbm.h>
@@ -43,13 +50,18 @@
 #include <xf86drm.h>
 
 #ifdef HAVE_LINUX_DMA_HEAP
+#include "dma-heap.h"
 #include <linux/dma-buf.h>
-#include <linux/dma-heap.h>
 
-#define LINUX_CMA_PATH "/dev/dma_heap/linux,cma"
+#define DMA_HEAP_PIXEL_ALIGN 16
+#define DMA_HEAP_STRIDE_ALIGN 64
+#define DMA_HEAP_BATCH_SIZE 3
 #endif // HAVE_LINUX_DMA_HEAP
 #endif // ENABLE_SCREENCOPY_DMABUF
 
+// Granularity of damage found by comparing buffers
+#define DIFF_TILE_SIZE 32
+
 extern struct wl_shm* wl_shm;
 extern struct zwp_linux_dmabuf_v1* zwp_linux_dmabuf;
 
@@ -57,6 +69,26 @@ LIST_HEAD(wv_buffer_list, wv_buffer);
 
 static struct wv_buffer_list buffer_registry;
 
+static struct wv_buffer_pool_stats pool_stats;
+static struct encode_backlog encode_backlog;
+
+struct wv_buffer_prewarm {
+	LIST_ENTRY(wv_buffer_prewarm) link;
+	struct wv_buffer_pool* pool;
+	struct wv_buffer_config config;
+	void* pixels;
+	int fd;
+};
+
+#if defined(ENABLE_SCREENCOPY_DMABUF) && defined(HAVE_LINUX_DMA_HEAP)
+static const char* dma_heap_name = NULL;
+#endif
+
+static bool lock_memory = false;
+
+static struct wv_buffer* wv_buffer_pool_create_buffer(
+		struct wv_buffer_pool* pool);
+
 static bool modifiers_match(const uint64_t* a, int a_len, const uint64_t* b,
 		int b_len)
 {
@@ -114,30 +146,61 @@ enum wv_buffer_type wv_buffer_get_available_types(void)
 	return type;
 }
 
-struct wv_buffer* wv_buffer_create_shm(const struct wv_buffer_config* config)
+static int wv_buffer_alloc_shm(size_t size, void** pixels, bool prefault)
+{
+	int fd = shm_alloc_fd(size);
+	if (fd < 0)
+		return -1;
+
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (prefault)
+		flags |= MAP_POPULATE;
+#endif
+
+	void* addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	/* MAP_POPULATE only read-faults shared mappings, so the pages still
+	 * have to be faulted for writing before the compositor copies into
+	 * them.
+	 */
+#ifdef MADV_POPULATE_WRITE
+	if (prefault)
+		madvise(addr, size, MADV_POPULATE_WRITE);
+#endif
+
+	/* Buffers are allocated after the initial mlockall(), so they have to
+	 * be locked individually. Running out of lockable memory is not fatal.
+	 */
+	if (lock_memory && mlock(addr, size) < 0)
+		nvnc_log(NVNC_LOG_DEBUG, "Failed to lock buffer memory: %m");
+
+	*pixels = addr;
+	return fd;
+}
+
+// Takes ownership of the mapping, but not of the fd
+static struct wv_buffer* wv_buffer_wrap_shm(
+		const struct wv_buffer_config* config, int fd, void* pixels)
 {
 	assert(wl_shm);
 	enum wl_shm_format wl_fmt = fourcc_to_wl_shm(config->format);
 
 	struct wv_buffer* self = calloc(1, sizeof(*self));
 	if (!self)
-		return NULL;
+		goto failure;
 
 	self->type = WV_BUFFER_SHM;
 	self->width = config->width;
 	self->height = config->height;
 	self->stride = config->stride;
 	self->format = config->format;
-
 	self->size = config->height * config->stride;
-	int fd = shm_alloc_fd(self->size);
-	if (fd < 0)
-		goto failure;
-
-	self->pixels = mmap(NULL, self->size, PROT_READ | PROT_WRITE,
-			MAP_SHARED, fd, 0);
-	if (!self->pixels)
-		goto mmap_failure;
+	self->pixels = pixels;
 
 	struct wl_shm_pool* pool = wl_shm_create_pool(wl_shm, fd, self->size);
 	if (!pool)
@@ -164,54 +227,41 @@ struct wv_buffer* wv_buffer_create_shm(const struct wv_buffer_config* config)
 			config->height);
 
 	LIST_INSERT_HEAD(&buffer_registry, self, registry_link);
+	pool_stats.n_buffers++;
 
-	close(fd);
 	return self;
 
 nvnc_fb_failure:
 	wl_buffer_destroy(self->wl_buffer);
 shm_failure:
 pool_failure:
-mmap_failure:
-	close(fd);
-failure:
 	free(self);
+failure:
+	munmap(pixels, (size_t)config->height * config->stride);
 	return NULL;
 }
 
-#ifdef ENABLE_SCREENCOPY_DMABUF
-#ifdef HAVE_LINUX_DMA_HEAP
-static bool have_linux_cma(void)
-{
-	return access(LINUX_CMA_PATH, R_OK | W_OK) == 0;
-}
-
-static int linux_cma_alloc(size_t size)
+struct wv_buffer* wv_buffer_create_shm(const struct wv_buffer_config* config)
 {
-	int fd = open(LINUX_CMA_PATH, O_RDWR | O_CLOEXEC, 0);
-	if (fd < 0) {
-		nvnc_log(NVNC_LOG_ERROR, "Failed to open CMA device: %m");
-		return -1;
-	}
-
-	struct dma_heap_allocation_data data = {
-		.len = size,
-		.fd_flags = O_CLOEXEC | O_RDWR,
-	};
+	void* pixels;
+	int fd = wv_buffer_alloc_shm((size_t)config->height * config->stride,
+			&pixels, false);
+	if (fd < 0)
+		return NULL;
 
-	int r = ioctl(fd, DMA_HEAP_IOCTL_ALLOC, &data);
-	if (r < 0) {
-		nvnc_log(NVNC_LOG_ERROR, "Failed to allocate CMA buffer: %m");
-		return -1;
-	}
+	struct wv_buffer* self = wv_buffer_wrap_shm(config, fd, pixels);
 	close(fd);
-
-        return data.fd;
+	return self;
 }
 
-// Some devices (mostly ARM SBCs) need CMA for hardware encoders.
-static struct gbm_bo* create_cma_gbm_bo(int width, int height, uint32_t fourcc,
-		struct wv_gbm_device* gbm)
+#ifdef ENABLE_SCREENCOPY_DMABUF
+#ifdef HAVE_LINUX_DMA_HEAP
+/* TODO: Get alignment through feedback mechanism.
+ * Buffer sizes are aligned on both axes by 16 and we'll do the same in the
+ * encoder, but this requirement should come from the encoder. Strides are
+ * also kept cache line aligned for the benefit of hardware encoders.
+ */
+static int dma_heap_stride(int width, uint32_t fourcc)
 {
 	int bpp = pixel_size_from_fourcc(fourcc);
 	if (!bpp) {
@@ -219,13 +269,25 @@ static struct gbm_bo* create_cma_gbm_bo(int width, int height, uint32_t fourcc,
 				fourcc);
 	}
 
-	/* TODO: Get alignment through feedback mechanism.
-	 * Buffer sizes are aligned on both axes by 16 and we'll do the same
-	 * in the encoder, but this requirement should come from the encoder.
-	 */
-	int stride = bpp * ALIGN_UP(width, 16);
+	return ALIGN_UP(bpp * ALIGN_UP(width, DMA_HEAP_PIXEL_ALIGN),
+			DMA_HEAP_STRIDE_ALIGN);
+}
 
-	int fd = linux_cma_alloc(stride * ALIGN_UP(height, 16));
+static size_t dma_heap_size(int stride, int height)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	return ALIGN_UP((size_t)stride * ALIGN_UP(height, DMA_HEAP_PIXEL_ALIGN),
+			page_size);
+}
+
+// Some devices (mostly ARM SBCs) need CMA for hardware encoders.
+static struct gbm_bo* create_dma_heap_gbm_bo(int width, int height,
+		uint32_t fourcc, struct dma_heap* heap,
+		struct wv_gbm_device* gbm)
+{
+	int stride = dma_heap_stride(width, fourcc);
+
+	int fd = dma_heap_alloc(heap, dma_heap_size(stride, height));
 	if (fd < 0) {
 		return NULL;
 	}
@@ -244,23 +306,107 @@ static struct gbm_bo* create_cma_gbm_bo(int width, int height, uint32_t fourcc,
 
 	struct gbm_bo* bo = gbm_bo_import(gbm->dev, GBM_BO_IMPORT_FD_MODIFIER,
 			&d, 0);
+	close(fd);
 	if (!bo) {
 		nvnc_log(NVNC_LOG_DEBUG, "Failed to import dmabuf: %m");
-		close(fd);
 		return NULL;
 	}
 
 	return bo;
 }
+
+/* Without a GBM device, the buffer is handed to the compositor as it is and
+ * mapped for the CPU encoders.
+ */
+static struct wv_buffer* wv_buffer_create_dma_heap(
+		const struct wv_buffer_config* config, struct dma_heap* heap)
+{
+	assert(zwp_linux_dmabuf);
+
+	struct wv_buffer* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->type = WV_BUFFER_DMABUF;
+	self->width = config->width;
+	self->height = config->height;
+	self->format = config->format;
+	self->node = config->node;
+	self->n_modifiers = config->n_modifiers;
+
+	if (self->n_modifiers > 0) {
+		self->modifiers = malloc(config->n_modifiers * 8);
+		assert(self->modifiers);
+		memcpy(self->modifiers, config->modifiers, self->n_modifiers * 8);
+	}
+
+	self->stride = dma_heap_stride(config->width, config->format);
+	self->size = dma_heap_size(self->stride, config->height);
+
+	int fd = dma_heap_alloc(heap, self->size);
+	if (fd < 0)
+		goto alloc_failure;
+
+	self->pixels = mmap(NULL, self->size, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (self->pixels == MAP_FAILED)
+		goto mmap_failure;
+
+	struct zwp_linux_buffer_params_v1* params;
+	params = zwp_linux_dmabuf_v1_create_params(zwp_linux_dmabuf);
+	if (!params)
+		goto params_failure;
+
+	uint64_t mod = DRM_FORMAT_MOD_LINEAR;
+	zwp_linux_buffer_params_v1_add(params, fd, 0, 0, self->stride,
+			mod >> 32, mod & 0xffffffff);
+	self->wl_buffer = zwp_linux_buffer_params_v1_create_immed(params,
+			config->width, config->height, config->format,
+			/* flags */ 0);
+	zwp_linux_buffer_params_v1_destroy(params);
+	if (!self->wl_buffer)
+		goto buffer_failure;
+
+	int bpp = pixel_size_from_fourcc(config->format);
+	self->nvnc_fb = nvnc_fb_from_buffer(self->pixels, config->width,
+			config->height, config->format, self->stride / bpp);
+	if (!self->nvnc_fb)
+		goto nvnc_fb_failure;
+
+	nvnc_set_userdata(self->nvnc_fb, self, NULL);
+
+	pixman_region_init(&self->frame_damage);
+	pixman_region_init_rect(&self->buffer_damage, 0, 0, config->width,
+			config->height);
+
+	LIST_INSERT_HEAD(&buffer_registry, self, registry_link);
+	pool_stats.n_buffers++;
+
+	// Kept for DMA_BUF_IOCTL_SYNC
+	self->cpu_sync_fd = fd;
+	return self;
+
+nvnc_fb_failure:
+	wl_buffer_destroy(self->wl_buffer);
+buffer_failure:
+params_failure:
+	munmap(self->pixels, self->size);
+mmap_failure:
+	close(fd);
+alloc_failure:
+	free(self->modifiers);
+	free(self);
+	return NULL;
+}
 #endif // HAVE_LINUX_DMA_HEAP
 
 #ifdef ENABLE_SCREENCOPY_DMABUF
-static void wv_gbm_device_ref(struct wv_gbm_device* dev)
+void wv_gbm_device_ref(struct wv_gbm_device* dev)
 {
 	++dev->ref;
 }
 
-static void wv_gbm_device_unref(struct wv_gbm_device* dev)
+void wv_gbm_device_unref(struct wv_gbm_device* dev)
 {
 	if (!dev || --dev->ref != 0)
 		return;
@@ -277,10 +423,20 @@ static void wv_gbm_device_unref(struct wv_gbm_device* dev)
 
 static struct wv_buffer* wv_buffer_create_dmabuf(
 		const struct wv_buffer_config* config,
-		struct wv_gbm_device* gbm)
+		struct wv_buffer_pool* pool)
 {
 	assert(zwp_linux_dmabuf);
 
+	struct wv_gbm_device* gbm = pool->gbm;
+
+#ifdef HAVE_LINUX_DMA_HEAP
+	if (pool->heap && !gbm)
+		return wv_buffer_create_dma_heap(config, pool->heap);
+#endif
+
+	if (!gbm)
+		return NULL;
+
 	struct wv_buffer* self = calloc(1, sizeof(*self));
 	if (!self)
 		return NULL;
@@ -299,15 +455,15 @@ static struct wv_buffer* wv_buffer_create_dmabuf(
 	}
 
 #ifdef HAVE_LINUX_DMA_HEAP
-	self->bo = have_linux_cma() ?
-		create_cma_gbm_bo(config->width, config->height,
-				config->format, gbm) :
+	self->bo = pool->heap ?
+		create_dma_heap_gbm_bo(config->width, config->height,
+				config->format, pool->heap, gbm) :
 		gbm_bo_create_with_modifiers2(gbm->dev, config->width,
 				config->height, config->format,
 				config->modifiers, config->n_modifiers,
 				GBM_BO_USE_RENDERING);
 #else
-	self->bo = gbm_bo_create_with_modifiers2(gbm, config->width,
+	self->bo = gbm_bo_create_with_modifiers2(gbm->dev, config->width,
 			config->height, config->format, config->modifiers,
 			config->n_modifiers, GBM_BO_USE_RENDERING);
 #endif
@@ -330,6 +486,7 @@ static struct wv_buffer* wv_buffer_create_dmabuf(
 	for (int i = 0; i < n_planes; ++i) {
 		uint32_t offset = gbm_bo_get_offset(self->bo, i);
 		uint32_t stride = gbm_bo_get_stride_for_plane(self->bo, i);
+		self->size += (size_t)stride * config->height;
 		fds[i] = gbm_bo_get_fd_for_plane(self->bo, i);
 		if (fds[i] < 0)
 			goto fd_failure;
@@ -364,6 +521,7 @@ static struct wv_buffer* wv_buffer_create_dmabuf(
 	wv_gbm_device_ref(gbm);
 
 	LIST_INSERT_HEAD(&buffer_registry, self, registry_link);
+	pool_stats.n_buffers++;
 
 	return self;
 
@@ -383,12 +541,8 @@ bo_failure:
 }
 #endif
 
-#ifdef ENABLE_SCREENCOPY_DMABUF
 static struct wv_buffer* wv_buffer_create(const struct wv_buffer_config* config,
-		struct wv_gbm_device* gbm)
-#else
-static struct wv_buffer* wv_buffer_create(const struct wv_buffer_config* config)
-#endif
+		struct wv_buffer_pool* pool)
 {
 	nvnc_trace("wv_buffer_create: %dx%d, stride: %d, format: %"PRIu32,
 			config->width, config->height, config->stride,
@@ -399,7 +553,7 @@ static struct wv_buffer* wv_buffer_create(const struct wv_buffer_config* config)
 		return wv_buffer_create_shm(config);
 #ifdef ENABLE_SCREENCOPY_DMABUF
 	case WV_BUFFER_DMABUF:
-		return wv_buffer_create_dmabuf(config, gbm);
+		return wv_buffer_create_dmabuf(config, pool);
 #endif
 	case WV_BUFFER_UNSPEC:;
 	}
@@ -422,17 +576,39 @@ static void wv_buffer_destroy_dmabuf(struct wv_buffer* self)
 	nvnc_fb_unref(self->nvnc_fb);
 	wl_buffer_destroy(self->wl_buffer);
 	free(self->modifiers);
-	gbm_bo_destroy(self->bo);
+	if (self->bo) {
+		gbm_bo_destroy(self->bo);
+	} else {
+		wv_buffer_end_cpu_access(self);
+		munmap(self->pixels, self->size);
+		close(self->cpu_sync_fd);
+	}
 	wv_gbm_device_unref(self->gbm);
 	free(self);
 }
 #endif
 
+static enum wv_mem_category wv_buffer_mem_category(const struct wv_buffer* self)
+{
+	if (self->domain == WV_BUFFER_DOMAIN_CURSOR)
+		return WV_MEM_CURSOR_BUFFERS;
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	if (self->type == WV_BUFFER_DMABUF)
+		return WV_MEM_DMABUF_BUFFERS;
+#endif
+
+	return WV_MEM_SHM_BUFFERS;
+}
+
 static void wv_buffer_destroy(struct wv_buffer* self)
 {
+	wv_mem_free(wv_buffer_mem_category(self), self->size);
+
 	pixman_region_fini(&self->buffer_damage);
 	pixman_region_fini(&self->frame_damage);
 	LIST_REMOVE(self, registry_link);
+	pool_stats.n_buffers--;
 
 	switch (self->type) {
 	case WV_BUFFER_SHM:
@@ -466,6 +642,53 @@ void wv_buffer_damage_clear(struct wv_buffer* self)
 	pixman_region_clear(&self->frame_damage);
 }
 
+static bool wv_buffer_tile_differs(const struct wv_buffer* a,
+		const struct wv_buffer* b, int x, int y, int width, int height,
+		int pixel_size)
+{
+	size_t offset = (size_t)y * a->stride + (size_t)x * pixel_size;
+	for (int row = 0; row < height; ++row) {
+		if (memcmp((const uint8_t*)a->pixels + offset,
+					(const uint8_t*)b->pixels + offset,
+					(size_t)width * pixel_size) != 0)
+			return true;
+		offset += a->stride;
+	}
+	return false;
+}
+
+int wv_buffer_damage_from_diff(struct wv_buffer* self,
+		const struct wv_buffer* other)
+{
+	if (!self->pixels || !other->pixels ||
+			self->width != other->width ||
+			self->height != other->height ||
+			self->stride != other->stride ||
+			self->format != other->format ||
+			self->y_inverted != other->y_inverted)
+		return -1;
+
+	int pixel_size = pixel_size_from_fourcc(self->format);
+	if (pixel_size <= 0)
+		return -1;
+
+	pixman_region_clear(&self->frame_damage);
+
+	for (int y = 0; y < self->height; y += DIFF_TILE_SIZE) {
+		int height = MIN(DIFF_TILE_SIZE, self->height - y);
+		for (int x = 0; x < self->width; x += DIFF_TILE_SIZE) {
+			int width = MIN(DIFF_TILE_SIZE, self->width - x);
+			if (wv_buffer_tile_differs(self, other, x, y, width,
+						height, pixel_size))
+				pixman_region_union_rect(&self->frame_damage,
+						&self->frame_damage, x, y,
+						width, height);
+		}
+	}
+
+	return 0;
+}
+
 struct wv_buffer_pool* wv_buffer_pool_create(
 		const struct wv_buffer_config* config)
 {
@@ -474,6 +697,7 @@ struct wv_buffer_pool* wv_buffer_pool_create(
 		return NULL;
 
 	TAILQ_INIT(&self->queue);
+	LIST_INIT(&self->prewarming);
 
 	if (config)
 		wv_buffer_pool_reconfig(self, config);
@@ -486,16 +710,27 @@ static void wv_buffer_pool_clear(struct wv_buffer_pool* pool)
 	while (!TAILQ_EMPTY(&pool->queue)) {
 		struct wv_buffer* buffer = TAILQ_FIRST(&pool->queue);
 		TAILQ_REMOVE(&pool->queue, buffer, link);
+		pool_stats.n_free--;
 		wv_buffer_destroy(buffer);
 	}
 }
 
 void wv_buffer_pool_destroy(struct wv_buffer_pool* pool)
 {
+	// Buffers that are still being prepared are dropped when done
+	while (!LIST_EMPTY(&pool->prewarming)) {
+		struct wv_buffer_prewarm* prewarm = LIST_FIRST(&pool->prewarming);
+		LIST_REMOVE(prewarm, link);
+		prewarm->pool = NULL;
+	}
+
 	wv_buffer_pool_clear(pool);
 	free(pool->config.modifiers);
 #ifdef ENABLE_SCREENCOPY_DMABUF
 	wv_gbm_device_unref(pool->gbm);
+#ifdef HAVE_LINUX_DMA_HEAP
+	dma_heap_close(pool->heap);
+#endif
 #endif
 	free(pool);
 }
@@ -535,43 +770,48 @@ static int find_render_node(char *node, size_t maxlen) {
 	return r;
 }
 
-static void open_render_node(struct wv_buffer_pool* pool)
+struct wv_gbm_device* wv_gbm_device_open(dev_t node)
 {
 	char path[256];
-	if (pool->config.node) {
-		if (render_node_from_dev_t(path, sizeof(path),
-					pool->config.node) < 0) {
+	if (node) {
+		if (render_node_from_dev_t(path, sizeof(path), node) < 0) {
 			nvnc_log(NVNC_LOG_ERROR, "Could not find render node from dev_t");
-			return;
+			return NULL;
 		}
 	} else if (find_render_node(path, sizeof(path)) < 0) {
 		nvnc_log(NVNC_LOG_ERROR, "Could not find a render node");
-		return;
+		return NULL;
 	}
 
 	nvnc_log(NVNC_LOG_DEBUG, "Using render node: %s", path);
 
-	pool->gbm = calloc(1, sizeof(*pool->gbm));
-	assert(pool->gbm);
+	struct wv_gbm_device* gbm = calloc(1, sizeof(*gbm));
+	assert(gbm);
 
-	pool->gbm->ref = 1;
+	gbm->ref = 1;
 
-	pool->gbm->fd = open(path, O_RDWR);
-	if (pool->gbm->fd < 0) {
+	gbm->fd = open(path, O_RDWR);
+	if (gbm->fd < 0) {
 		nvnc_log(NVNC_LOG_ERROR, "Failed to open render node %s: %m",
 				path);
-		free(pool->gbm);
-		pool->gbm = NULL;
-		return;
+		free(gbm);
+		return NULL;
 	}
 
-	pool->gbm->dev = gbm_create_device(pool->gbm->fd);
-	if (!pool->gbm->dev) {
+	gbm->dev = gbm_create_device(gbm->fd);
+	if (!gbm->dev) {
 		nvnc_log(NVNC_LOG_ERROR, "Failed to create a GBM device");
-		close(pool->gbm->fd);
-		free(pool->gbm);
-		pool->gbm = NULL;
+		close(gbm->fd);
+		free(gbm);
+		return NULL;
 	}
+
+	return gbm;
+}
+
+static void open_render_node(struct wv_buffer_pool* pool)
+{
+	pool->gbm = wv_gbm_device_open(pool->config.node);
 }
 
 bool reconfig_render_node(struct wv_buffer_pool* pool,
@@ -595,6 +835,64 @@ bool reconfig_render_node(struct wv_buffer_pool* pool,
 
 	return !!pool->gbm;
 }
+
+#ifdef HAVE_LINUX_DMA_HEAP
+static bool config_allows_linear(const struct wv_buffer_config* config)
+{
+	if (config->n_modifiers == 0)
+		return true;
+
+	for (int i = 0; i < config->n_modifiers; ++i)
+		if (config->modifiers[i] == DRM_FORMAT_MOD_LINEAR)
+			return true;
+
+	return false;
+}
+
+static const char* choose_dma_heap(const struct wv_buffer_pool* pool)
+{
+	if (dma_heap_name)
+		return dma_heap_name;
+
+	if (dma_heap_is_available(DMA_HEAP_CMA))
+		return DMA_HEAP_CMA;
+
+	// No GPU, so this is the only way to get DMA-BUFs
+	if (!pool->gbm && dma_heap_is_available(DMA_HEAP_SYSTEM))
+		return DMA_HEAP_SYSTEM;
+
+	return NULL;
+}
+
+static void reconfig_dma_heap(struct wv_buffer_pool* pool,
+		const struct wv_buffer_config* config)
+{
+	if (config->type != WV_BUFFER_DMABUF || !config_allows_linear(config)) {
+		dma_heap_close(pool->heap);
+		pool->heap = NULL;
+		return;
+	}
+
+	// The heap fd is kept open for the lifetime of the pool
+	if (pool->heap)
+		return;
+
+	const char* name = choose_dma_heap(pool);
+	if (name)
+		pool->heap = dma_heap_open(name);
+}
+
+static void wv_buffer_pool_prefill(struct wv_buffer_pool* pool)
+{
+	for (int i = 0; i < DMA_HEAP_BATCH_SIZE; ++i) {
+		struct wv_buffer* buffer = wv_buffer_pool_create_buffer(pool);
+		if (!buffer)
+			break;
+		TAILQ_INSERT_TAIL(&pool->queue, buffer, link);
+		pool_stats.n_free++;
+	}
+}
+#endif // HAVE_LINUX_DMA_HEAP
 #endif // ENABLE_SCREENCOPY_DMABUF
 
 bool wv_buffer_pool_reconfig(struct wv_buffer_pool* pool,
@@ -614,7 +912,18 @@ bool wv_buffer_pool_reconfig(struct wv_buffer_pool* pool,
 	copy_buffer_config(&pool->config, config);
 
 #ifdef ENABLE_SCREENCOPY_DMABUF
-	return reconfig_render_node(pool, config, old_node);
+	bool ok = reconfig_render_node(pool, config, old_node);
+#ifdef HAVE_LINUX_DMA_HEAP
+	reconfig_dma_heap(pool, config);
+
+	// Allocate heap buffers up front rather than one at a time while
+	// capturing
+	if (pool->heap) {
+		wv_buffer_pool_prefill(pool);
+		return true;
+	}
+#endif
+	return ok;
 #else
 	return true;
 #endif
@@ -649,35 +958,224 @@ static bool wv_buffer_pool_match_buffer(struct wv_buffer_pool* pool,
 	return false;
 }
 
+void wv_buffer_record_feed(struct wv_buffer* self)
+{
+	self->feed_seq = encode_backlog_feed(&encode_backlog, self->fed_at_us);
+}
+
+void wv_buffer_record_release(struct wv_buffer* self)
+{
+	if (!self->fed_at_us)
+		return;
+
+	uint64_t now = gettime_us();
+	wv_perf_add_latency(WV_PERF_FB_HOLD_TIME, now - self->fed_at_us);
+	pool_stats.released++;
+	pool_stats.backlog_us += encode_backlog_release(&encode_backlog,
+			self->feed_seq, self->fed_at_us, now);
+	self->fed_at_us = 0;
+	self->feed_seq = 0;
+}
+
+#if defined(ENABLE_SCREENCOPY_DMABUF) && defined(HAVE_LINUX_DMA_HEAP)
+static void dma_buf_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync = {
+		.flags = flags | DMA_BUF_SYNC_READ,
+	};
+	while (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) < 0 &&
+			(errno == EINTR || errno == EAGAIN));
+}
+#endif
+
+void wv_buffer_begin_cpu_access(struct wv_buffer* self)
+{
+#if defined(ENABLE_SCREENCOPY_DMABUF) && defined(HAVE_LINUX_DMA_HEAP)
+	if (self->type != WV_BUFFER_DMABUF || self->bo || self->is_cpu_access)
+		return;
+
+	dma_buf_sync(self->cpu_sync_fd, DMA_BUF_SYNC_START);
+	self->is_cpu_access = true;
+#endif
+}
+
+void wv_buffer_end_cpu_access(struct wv_buffer* self)
+{
+#if defined(ENABLE_SCREENCOPY_DMABUF) && defined(HAVE_LINUX_DMA_HEAP)
+	if (self->type != WV_BUFFER_DMABUF || self->bo || !self->is_cpu_access)
+		return;
+
+	dma_buf_sync(self->cpu_sync_fd, DMA_BUF_SYNC_END);
+	self->is_cpu_access = false;
+#endif
+}
+
 void wv_buffer_pool__on_release(struct nvnc_fb* fb, void* context)
 {
 	struct wv_buffer* buffer = nvnc_get_userdata(fb);
 	struct wv_buffer_pool* pool = context;
 
+	// The compositor may write to it again from here on
+	wv_buffer_end_cpu_access(buffer);
+	wv_buffer_record_release(buffer);
 	wv_buffer_pool_release(pool, buffer);
 }
 
+static void wv_buffer_pool_setup_buffer(struct wv_buffer_pool* pool,
+		struct wv_buffer* buffer)
+{
+	buffer->domain = pool->domain;
+	wv_mem_alloc(wv_buffer_mem_category(buffer), buffer->size);
+
+	nvnc_fb_set_release_fn(buffer->nvnc_fb, wv_buffer_pool__on_release,
+			pool);
+}
+
+static struct wv_buffer* wv_buffer_pool_create_buffer(
+		struct wv_buffer_pool* pool)
+{
+	struct wv_buffer* buffer = wv_buffer_create(&pool->config, pool);
+	if (buffer)
+		wv_buffer_pool_setup_buffer(pool, buffer);
+	return buffer;
+}
+
+static void prewarm_work(void* obj)
+{
+	struct wv_buffer_prewarm* prewarm = aml_get_userdata(obj);
+
+	// DMA-BUFs are allocated on the main thread via GBM
+	if (prewarm->config.type != WV_BUFFER_SHM)
+		return;
+
+	prewarm->fd = wv_buffer_alloc_shm((size_t)prewarm->config.height *
+			prewarm->config.stride, &prewarm->pixels, true);
+}
+
+static void prewarm_done(void* obj)
+{
+	struct wv_buffer_prewarm* prewarm = aml_get_userdata(obj);
+	struct wv_buffer_pool* pool = prewarm->pool;
+	if (!pool)
+		return;
+
+	LIST_REMOVE(prewarm, link);
+	prewarm->pool = NULL;
+
+	// The pool has been reconfigured in the meantime
+	if (!buffer_configs_match(&pool->config, &prewarm->config))
+		return;
+
+	struct wv_buffer* buffer;
+	if (prewarm->config.type == WV_BUFFER_SHM) {
+		if (prewarm->fd < 0)
+			return;
+
+		buffer = wv_buffer_wrap_shm(&pool->config, prewarm->fd,
+				prewarm->pixels);
+		prewarm->pixels = NULL;
+		if (!buffer)
+			return;
+
+		wv_buffer_pool_setup_buffer(pool, buffer);
+	} else {
+		buffer = wv_buffer_pool_create_buffer(pool);
+		if (!buffer)
+			return;
+	}
+
+	pool_stats.prewarmed++;
+	TAILQ_INSERT_TAIL(&pool->queue, buffer, link);
+	pool_stats.n_free++;
+}
+
+static void prewarm_free(void* userdata)
+{
+	struct wv_buffer_prewarm* prewarm = userdata;
+
+	if (prewarm->pixels)
+		munmap(prewarm->pixels, (size_t)prewarm->config.height *
+				prewarm->config.stride);
+	if (prewarm->fd >= 0)
+		close(prewarm->fd);
+
+	free(prewarm->config.modifiers);
+	free(prewarm);
+}
+
+static int wv_buffer_pool_count_spares(struct wv_buffer_pool* pool)
+{
+	int n = 0;
+
+	struct wv_buffer* buffer;
+	TAILQ_FOREACH(buffer, &pool->queue, link)
+		++n;
+
+	struct wv_buffer_prewarm* prewarm;
+	LIST_FOREACH(prewarm, &pool->prewarming, link)
+		++n;
+
+	return n;
+}
+
+static void wv_buffer_pool_prewarm(struct wv_buffer_pool* pool)
+{
+	if (pool->config.type == WV_BUFFER_UNSPEC)
+		return;
+
+	int n = pool->spare_target - wv_buffer_pool_count_spares(pool);
+	if (n <= 0)
+		return;
+
+	if (aml_require_workers(aml_get_default(), 1) < 0)
+		return;
+
+	for (int i = 0; i < n; ++i) {
+		struct wv_buffer_prewarm* prewarm = calloc(1, sizeof(*prewarm));
+		if (!prewarm)
+			return;
+
+		prewarm->fd = -1;
+		copy_buffer_config(&prewarm->config, &pool->config);
+
+		struct aml_work* work = aml_work_new(prewarm_work, prewarm_done,
+				prewarm, prewarm_free);
+		if (!work) {
+			prewarm_free(prewarm);
+			return;
+		}
+
+		prewarm->pool = pool;
+		LIST_INSERT_HEAD(&pool->prewarming, prewarm, link);
+
+		aml_start(aml_get_default(), work);
+		aml_unref(work);
+	}
+}
+
 struct wv_buffer* wv_buffer_pool_acquire(struct wv_buffer_pool* pool)
 {
+	pool_stats.acquired++;
+
 	struct wv_buffer* buffer = TAILQ_FIRST(&pool->queue);
 	if (buffer) {
 		assert(wv_buffer_pool_match_buffer(pool, buffer));
 		TAILQ_REMOVE(&pool->queue, buffer, link);
-		return buffer;
+		pool_stats.n_free--;
+	} else {
+		pool_stats.misses++;
+		buffer = wv_buffer_pool_create_buffer(pool);
 	}
 
-#ifdef ENABLE_SCREENCOPY_DMABUF
-	buffer = wv_buffer_create(&pool->config, pool->gbm);
-#else
-	buffer = wv_buffer_create(&pool->config);
-#endif
-	if (buffer)
-		nvnc_fb_set_release_fn(buffer->nvnc_fb,
-				wv_buffer_pool__on_release, pool);
-
+	wv_buffer_pool_prewarm(pool);
 	return buffer;
 }
 
+void wv_buffer_pool_get_stats(struct wv_buffer_pool_stats* stats)
+{
+	*stats = pool_stats;
+}
+
 void wv_buffer_pool_release(struct wv_buffer_pool* pool,
 		struct wv_buffer* buffer)
 {
@@ -685,11 +1183,27 @@ void wv_buffer_pool_release(struct wv_buffer_pool* pool,
 
 	if (wv_buffer_pool_match_buffer(pool, buffer)) {
 		TAILQ_INSERT_TAIL(&pool->queue, buffer, link);
+		pool_stats.n_free++;
 	} else {
 		wv_buffer_destroy(buffer);
 	}
 }
 
+void wv_buffer_set_lock_memory(bool enable)
+{
+	lock_memory = enable;
+}
+
+void wv_buffer_set_dma_heap(const char* name)
+{
+#if defined(ENABLE_SCREENCOPY_DMABUF) && defined(HAVE_LINUX_DMA_HEAP)
+	dma_heap_name = name;
+#else
+	if (name)
+		nvnc_log(NVNC_LOG_WARNING, "dma-heap support was not compiled in");
+#endif
+}
+
 void wv_buffer_registry_damage_all(struct pixman_region16* region,
 		enum wv_buffer_domain domain)
 {
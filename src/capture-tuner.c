@@ -0,0 +1,271 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <neatvnc.h>
+
+#include "capture-tuner.h"
+#include "time-util.h"
+#include "config.h"
+
+#define FRAMES_PER_CANDIDATE 30
+#define CACHE_LINE_MAX 128
+
+static uint64_t get_cpu_time_us(void)
+{
+	struct timespec ts = { 0 };
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return timespec_to_us(&ts);
+}
+
+static void add_candidate(struct capture_tuner* self,
+		enum screencopy_backend backend, bool linux_dmabuf)
+{
+	if (!screencopy_backend_is_available(backend))
+		return;
+
+	if (self->n_candidates >= CAPTURE_TUNER_MAX_CANDIDATES) {
+		nvnc_log(NVNC_LOG_WARNING, "Capture tuning: skipping %s/%s",
+				screencopy_backend_name(backend),
+				linux_dmabuf ? "dmabuf" : "shm");
+		return;
+	}
+
+	struct capture_tuner_result* result =
+		&self->results[self->n_candidates++];
+	result->choice.backend = backend;
+	result->choice.linux_dmabuf = linux_dmabuf;
+}
+
+void capture_tuner_init(struct capture_tuner* self, bool allow_linux_dmabuf,
+		bool allow_zero_copy)
+{
+	memset(self, 0, sizeof(*self));
+
+	add_candidate(self, SCREENCOPY_BACKEND_EXT_IMAGE_COPY_CAPTURE, false);
+	add_candidate(self, SCREENCOPY_BACKEND_WLR_SCREENCOPY, false);
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	if (allow_linux_dmabuf) {
+		add_candidate(self, SCREENCOPY_BACKEND_EXT_IMAGE_COPY_CAPTURE,
+				true);
+		add_candidate(self, SCREENCOPY_BACKEND_WLR_SCREENCOPY, true);
+	}
+
+	if (allow_zero_copy)
+		add_candidate(self, SCREENCOPY_BACKEND_EXPORT_DMABUF,
+				allow_linux_dmabuf);
+#else
+	(void)allow_linux_dmabuf;
+	(void)allow_zero_copy;
+#endif
+}
+
+const struct capture_choice* capture_tuner_candidate(
+		const struct capture_tuner* self)
+{
+	if (self->current >= self->n_candidates)
+		return NULL;
+	return &self->results[self->current].choice;
+}
+
+void capture_tuner_begin(struct capture_tuner* self)
+{
+	self->latency_sum_us = 0;
+	self->cpu_start_us = get_cpu_time_us();
+}
+
+bool capture_tuner_add_frame(struct capture_tuner* self, uint64_t latency_us)
+{
+	if (self->current >= self->n_candidates)
+		return false;
+
+	struct capture_tuner_result* result = &self->results[self->current];
+	result->n_frames++;
+	self->latency_sum_us += latency_us;
+
+	return result->n_frames >= FRAMES_PER_CANDIDATE;
+}
+
+bool capture_tuner_next(struct capture_tuner* self)
+{
+	if (self->current >= self->n_candidates)
+		return false;
+
+	struct capture_tuner_result* result = &self->results[self->current];
+	if (result->n_frames > 0) {
+		uint64_t cpu_us = get_cpu_time_us() - self->cpu_start_us;
+		result->latency_us = self->latency_sum_us / result->n_frames;
+		result->cpu_us = cpu_us / result->n_frames;
+	}
+
+	nvnc_log(NVNC_LOG_DEBUG, "Capture tuning: %s/%s: %"PRIu32" frames, %"PRIu32" µs latency, %"PRIu32" µs CPU",
+			screencopy_backend_name(result->choice.backend),
+			result->choice.linux_dmabuf ? "dmabuf" : "shm",
+			result->n_frames, result->latency_us, result->cpu_us);
+
+	return ++self->current < self->n_candidates;
+}
+
+int capture_tuner_best(const struct capture_tuner* self,
+		struct capture_choice* choice)
+{
+	const struct capture_tuner_result* best = NULL;
+	uint64_t best_cost = UINT64_MAX;
+
+	for (int i = 0; i < self->n_candidates; ++i) {
+		const struct capture_tuner_result* result = &self->results[i];
+		if (result->n_frames == 0)
+			continue;
+
+		uint64_t cost = (uint64_t)result->latency_us + result->cpu_us;
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = result;
+		}
+	}
+
+	if (!best)
+		return -1;
+
+	*choice = best->choice;
+	return 0;
+}
+
+static int get_cache_path(char* path, size_t size, bool create_dir)
+{
+	const char* xdg_cache_home = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	char dir[256];
+
+	if (xdg_cache_home)
+		snprintf(dir, sizeof(dir), "%s", xdg_cache_home);
+	else if (home)
+		snprintf(dir, sizeof(dir), "%s/.cache", home);
+	else
+		return -1;
+
+	if (create_dir)
+		mkdir(dir, 0700);
+
+	size_t len = strlen(dir);
+	snprintf(dir + len, sizeof(dir) - len, "/wayvnc");
+
+	if (create_dir && mkdir(dir, 0700) < 0 && errno != EEXIST)
+		return -1;
+
+	snprintf(path, size, "%s/capture-tuning", dir);
+	return 0;
+}
+
+static int parse_cache_line(const char* line, uint64_t* identity,
+		struct capture_choice* choice)
+{
+	char backend[64];
+	char buffer_type[16];
+	if (sscanf(line, "%" SCNx64 " %63s %15s", identity, backend,
+				buffer_type) != 3)
+		return -1;
+
+	int backend_id = screencopy_backend_from_name(backend);
+	if (backend_id < 0)
+		return -1;
+
+	choice->backend = backend_id;
+	choice->linux_dmabuf = strcmp(buffer_type, "dmabuf") == 0;
+	return 0;
+}
+
+int capture_tuner_cache_load(uint64_t identity, struct capture_choice* choice)
+{
+	char path[256];
+	if (get_cache_path(path, sizeof(path), false) < 0)
+		return -1;
+
+	FILE* stream = fopen(path, "r");
+	if (!stream)
+		return -1;
+
+	int rc = -1;
+	char line[CACHE_LINE_MAX];
+	while (fgets(line, sizeof(line), stream)) {
+		uint64_t line_identity;
+		struct capture_choice line_choice;
+		if (parse_cache_line(line, &line_identity, &line_choice) < 0)
+			continue;
+
+		if (line_identity == identity &&
+				screencopy_backend_is_available(
+					line_choice.backend)) {
+			*choice = line_choice;
+			rc = 0;
+			break;
+		}
+	}
+
+	fclose(stream);
+	return rc;
+}
+
+int capture_tuner_cache_store(uint64_t identity,
+		const struct capture_choice* choice)
+{
+	char path[256];
+	if (get_cache_path(path, sizeof(path), true) < 0)
+		return -1;
+
+	char tmp_path[272];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, getpid());
+
+	FILE* out = fopen(tmp_path, "w");
+	if (!out)
+		return -1;
+
+	// Keep the entries for other compositors
+	FILE* in = fopen(path, "r");
+	if (in) {
+		char line[CACHE_LINE_MAX];
+		while (fgets(line, sizeof(line), in)) {
+			uint64_t line_identity;
+			struct capture_choice line_choice;
+			if (parse_cache_line(line, &line_identity,
+						&line_choice) < 0)
+				continue;
+			if (line_identity != identity)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+
+	fprintf(out, "%016" PRIx64 " %s %s\n", identity,
+			screencopy_backend_name(choice->backend),
+			choice->linux_dmabuf ? "dmabuf" : "shm");
+
+	if (fclose(out) != 0 || rename(tmp_path, path) < 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
@@ -27,6 +27,7 @@
 #include <assert.h>
 #include <jansson.h>
 #include <sys/param.h>
+#include <ctype.h>
 
 #include "json-ipc.h"
 #include "ctl-client.h"
@@ -35,6 +36,11 @@
 #include "util.h"
 #include "option-parser.h"
 #include "table-printer.h"
+#include "sys/queue.h"
+#include "json-framer.h"
+
+#define INITIAL_READ_BUFFER_SIZE 1024
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
 
 #define LOG(level, fmt, ...) \
 	fprintf(stderr, level ": %s: %d: " fmt "\n", __FILE__, __LINE__, \
@@ -68,8 +74,7 @@ struct ctl_client {
 	struct sockaddr_un addr;
 	unsigned flags;
 
-	char read_buffer[1024];
-	size_t read_len;
+	struct json_framer framer;
 
 	bool wait_for_events;
 
@@ -89,6 +94,8 @@ struct ctl_client* ctl_client_new(const char* socket_path, void* userdata)
 	struct ctl_client* new = calloc(1, sizeof(*new));
 	new->userdata = userdata;
 	new->fd = -1;
+	json_framer_init(&new->framer, INITIAL_READ_BUFFER_SIZE,
+			MAX_MESSAGE_SIZE);
 
 	if (strlen(socket_path) >= sizeof(new->addr.sun_path)) {
 		errno = ENAMETOOLONG;
@@ -143,6 +150,11 @@ static int try_connect(struct ctl_client* self, int timeout)
 	if (self->fd != -1)
 		close(self->fd);
 
+	// Anything left over from a previous connection is meaningless now
+	json_framer_destroy(&self->framer);
+	json_framer_init(&self->framer, INITIAL_READ_BUFFER_SIZE,
+			MAX_MESSAGE_SIZE);
+
 	self->fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (self->fd < 0) {
 		ERROR("Failed to create unix socket: %m");
@@ -183,6 +195,7 @@ static int ctl_client_connect(struct ctl_client* self, int timeout)
 void ctl_client_destroy(struct ctl_client* self)
 {
 	close(self->fd);
+	json_framer_destroy(&self->framer);
 	free(self);
 }
 
@@ -221,32 +234,48 @@ out:
 
 static json_t* json_from_buffer(struct ctl_client* self)
 {
-	if (self->read_len == 0) {
-		DEBUG("Read buffer is empty");
-		errno = EAGAIN;
-		return NULL;
-	}
-
 	json_error_t err;
-	json_t* root = json_loadb(self->read_buffer, self->read_len, JSON_DISABLE_EOF_CHECK, &err);
-	if (root) {
-		advance_read_buffer(&self->read_buffer, &self->read_len,
-				err.position);
-	} else if (json_error_code(&err) == json_error_premature_end_of_input) {
-		if (self->read_len == sizeof(self->read_buffer)) {
-			ERROR("Response message is too long");
-			errno = EMSGSIZE;
-		} else {
+	json_t* root = json_framer_next(&self->framer, &err);
+	if (!root) {
+		if (errno == EAGAIN) {
 			DEBUG("Awaiting more data");
-			errno = EAGAIN;
+		} else {
+			ERROR("Json parsing failed: %s", err.text);
+			errno = EINVAL;
 		}
-	} else {
-		ERROR("Json parsing failed: %s", err.text);
-		errno = EINVAL;
 	}
 	return root;
 }
 
+static ssize_t ctl_client_recv(struct ctl_client* self)
+{
+	size_t remainder = 0;
+	char* readptr = json_framer_write_ptr(&self->framer, &remainder);
+	if (!readptr) {
+		if (errno == EMSGSIZE)
+			ERROR("Response message is too long");
+		else
+			ERROR("Failed to grow read buffer: %m");
+		return -1;
+	}
+
+	ssize_t n = recv(self->fd, readptr, remainder, 0);
+	if (n == -1) {
+		ERROR("Read failed: %m");
+		return -1;
+	} else if (n == 0) {
+		ERROR("Disconnected");
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	DEBUG("Read %zd bytes", n);
+	DEBUG("<< %.*s", (int)n, readptr);
+
+	json_framer_commit(&self->framer, n);
+	return n;
+}
+
 static json_t* read_one_object(struct ctl_client* self, int timeout_ms)
 {
 	json_t* root = json_from_buffer(self);
@@ -273,23 +302,8 @@ static json_t* read_one_object(struct ctl_client* self, int timeout_ms)
 			break;
 		}
 
-		char* readptr = self->read_buffer + self->read_len;
-		size_t remainder = sizeof(self->read_buffer) - self->read_len;
-
-		n = recv(self->fd, readptr, remainder, 0);
-		if (n == -1) {
-			ERROR("Read failed: %m");
-			break;
-		} else if (n == 0) {
-			ERROR("Disconnected");
-			errno = ECONNRESET;
+		if (ctl_client_recv(self) < 0)
 			break;
-		}
-
-		DEBUG("Read %d bytes", n);
-		DEBUG("<< %.*s", n, readptr);
-
-		self->read_len += n;
 
 		root = json_from_buffer(self);
 		if (!root && errno != EAGAIN)
@@ -356,15 +370,37 @@ static void pretty_client_list(json_t* data)
 		char* id = NULL;
 		char* address = NULL;
 		char* username = NULL;
-
-		json_unpack(value, "{s:s, s?s, s?s}", "id", &id, "address",
-				&address, "username", &username);
+		json_int_t connected = -1;
+		json_int_t idle = -1;
+		double updates_per_second = -1;
+		json_int_t latency_avg = 0, latency_p99 = 0;
+
+		json_unpack(value, "{s:s, s?s, s?s, s?I, s?I, s?f, s?I, s?I}",
+				"id", &id,
+				"address", &address, "username", &username,
+				"connected_seconds", &connected,
+				"idle_seconds", &idle,
+				"updates_per_second", &updates_per_second,
+				"update_latency_avg_us", &latency_avg,
+				"update_latency_p99_us", &latency_p99);
 		printf("  %s: ", id);
 
 		if (username)
 			printf("%s@", username);
 
-		printf("%s\n", address ? address : "<unknown>");
+		printf("%s", address ? address : "<unknown>");
+
+		if (connected >= 0)
+			printf(" (connected %" JSON_INTEGER_FORMAT "s, idle %"
+					JSON_INTEGER_FORMAT "s)", connected,
+					idle);
+
+		if (updates_per_second >= 0)
+			printf(", %.1f updates/s, latency avg %.1f ms, p99 %.1f ms",
+					updates_per_second, latency_avg / 1e3,
+					latency_p99 / 1e3);
+
+		printf("\n");
 	}
 }
 
@@ -390,6 +426,146 @@ static void pretty_output_list(json_t* data)
 	}
 }
 
+static void pretty_memory_stats(json_t* data)
+{
+	json_int_t bytes = 0;
+	json_int_t objects = 0;
+	json_t* categories = NULL;
+
+	json_unpack(data, "{s:{s:I, s:I}, s:o}", "total", "bytes", &bytes,
+			"objects", &objects, "categories", &categories);
+	printf("Total: %" JSON_INTEGER_FORMAT " bytes in %" JSON_INTEGER_FORMAT
+			" objects\n", bytes, objects);
+
+	const char* key;
+	json_t* value;
+	json_object_foreach(categories, key, value) {
+		bytes = objects = 0;
+		json_unpack(value, "{s:I, s:I}", "bytes", &bytes,
+				"objects", &objects);
+		printf("  %s: %" JSON_INTEGER_FORMAT " bytes in %"
+				JSON_INTEGER_FORMAT " objects\n", key, bytes,
+				objects);
+	}
+
+	json_int_t acquired = 0, misses = 0, prewarmed = 0;
+	if (json_unpack(data, "{s:{s:I, s:I, s:I}}", "buffer_pool",
+				"acquired", &acquired, "misses", &misses,
+				"prewarmed", &prewarmed) == 0)
+		printf("Buffer pool: %" JSON_INTEGER_FORMAT " acquired, %"
+				JSON_INTEGER_FORMAT " misses, %"
+				JSON_INTEGER_FORMAT " pre-warmed\n", acquired,
+				misses, prewarmed);
+}
+
+static void pretty_scheduling_info(json_t* data)
+{
+	const char* policy = "unknown";
+	const char* cpus = "";
+	int priority = 0, nice = 0, memory_locked = 0;
+	json_int_t locked_bytes = 0;
+
+	json_unpack(data, "{s:s, s:i, s:i, s:s, s:b, s:I}",
+			"policy", &policy,
+			"priority", &priority,
+			"nice", &nice,
+			"cpus", &cpus,
+			"memory_locked", &memory_locked,
+			"locked_bytes", &locked_bytes);
+	printf("Policy: %s (priority %d, nice %d)\n", policy, priority, nice);
+	printf("CPUs: %s\n", cpus);
+	printf("Locked memory: %" JSON_INTEGER_FORMAT " bytes%s\n",
+			locked_bytes, memory_locked ? "" : " (not requested)");
+}
+
+static void pretty_damage_map(json_t* data)
+{
+	static const char shades[] = " .:-=+*#%@";
+	int columns = 0;
+	int rows = 0;
+	json_t* tiles = NULL;
+
+	if (json_unpack(data, "{s:i, s:i, s:o}", "columns", &columns,
+				"rows", &rows, "tiles", &tiles) == -1)
+		return;
+
+	json_int_t max = 0;
+	size_t i;
+	json_t* value;
+	json_array_foreach(tiles, i, value)
+		if (json_integer_value(value) > max)
+			max = json_integer_value(value);
+
+	for (int y = 0; y < rows; ++y) {
+		for (int x = 0; x < columns; ++x) {
+			json_int_t v = json_integer_value(
+					json_array_get(tiles, y * columns + x));
+			int shade = max ? v * (sizeof(shades) - 2) / max : 0;
+			putchar(shades[shade]);
+		}
+		putchar('\n');
+	}
+	printf("Peak: %" JSON_INTEGER_FORMAT "\n", max);
+}
+
+static void pretty_capture_info(json_t* data)
+{
+	const char* backend = NULL;
+	const char* buffer_type = NULL;
+	const char* selection = "";
+	const char* identity = "";
+	json_t* measurements = NULL;
+
+	json_unpack(data, "{s?s, s?s, s:s, s:s, s:o}", "backend", &backend,
+			"buffer_type", &buffer_type, "selection", &selection,
+			"compositor_identity", &identity,
+			"measurements", &measurements);
+
+	if (backend)
+		printf("Backend: %s (%s), %s\n", backend, buffer_type,
+				selection);
+	else
+		printf("Backend: none, %s\n", selection);
+	printf("Compositor: %s\n", identity);
+
+	int max_fps = 0, cursor_max_fps = 0, spare_buffers = 0;
+	int render_cursor = false, gpu = false;
+	if (json_unpack(data, "{s:i, s:i, s:i, s:b, s:b}",
+				"max_fps", &max_fps,
+				"cursor_max_fps", &cursor_max_fps,
+				"spare_buffers", &spare_buffers,
+				"render_cursor", &render_cursor,
+				"gpu", &gpu) == 0)
+		printf("Max FPS: %d, cursor max FPS: %d, spare buffers: %d, render cursor: %s, GPU: %s\n",
+				max_fps, cursor_max_fps, spare_buffers,
+				render_cursor ? "yes" : "no",
+				gpu ? "yes" : "no");
+
+	json_int_t stalls = 0;
+	if (json_unpack(data, "{s:I}", "stalls", &stalls) == 0 && stalls > 0)
+		printf("Stalls: %" JSON_INTEGER_FORMAT "\n", stalls);
+
+	if (json_array_size(measurements) == 0)
+		return;
+
+	printf("Measurements:\n");
+	size_t i;
+	json_t* value;
+	json_array_foreach(measurements, i, value) {
+		json_int_t frames = 0, latency_us = 0, cpu_us = 0;
+		json_unpack(value, "{s:s, s:s, s:I, s:I, s:I}",
+				"backend", &backend,
+				"buffer_type", &buffer_type,
+				"frames", &frames,
+				"latency_us", &latency_us,
+				"cpu_us", &cpu_us);
+		printf("  %s/%s: %" JSON_INTEGER_FORMAT " frames, %"
+				JSON_INTEGER_FORMAT " µs latency, %"
+				JSON_INTEGER_FORMAT " µs CPU\n", backend,
+				buffer_type, frames, latency_us, cpu_us);
+	}
+}
+
 static void pretty_print(json_t* data,
 		struct jsonipc_request* request)
 {
@@ -404,12 +580,25 @@ static void pretty_print(json_t* data,
 	case CMD_OUTPUT_LIST:
 		pretty_output_list(data);
 		break;
+	case CMD_MEMORY_STATS:
+		pretty_memory_stats(data);
+		break;
+	case CMD_SCHEDULING_INFO:
+		pretty_scheduling_info(data);
+		break;
+	case CMD_DAMAGE_MAP:
+		pretty_damage_map(data);
+		break;
+	case CMD_CAPTURE_INFO:
+		pretty_capture_info(data);
+		break;
 	case CMD_ATTACH:
 	case CMD_DETACH:
 	case CMD_CLIENT_DISCONNECT:
 	case CMD_OUTPUT_SET:
 	case CMD_OUTPUT_CYCLE:
 	case CMD_WAYVNC_EXIT:
+	case CMD_CAPTURE_SET:
 		printf("Ok\n");
 		break;
 	case CMD_EVENT_RECEIVE:
@@ -515,7 +704,7 @@ static void print_for_human(json_t* data, int level)
 				continue;
 
 			print_indent(level);
-			printf("%s: ", key);
+			printf(json_is_object(value) ? "%s:\n" : "%s: ", key);
 			print_for_human(value, level + 1);
 		}
 		break;
@@ -588,12 +777,17 @@ static ssize_t ctl_client_send_request(struct ctl_client* self,
 		return -1;
 	}
 
-	char buffer[512];
-	int len = json_dumpb(packed, buffer, sizeof(buffer), JSON_COMPACT);
+	char* buffer = json_dumps(packed, JSON_COMPACT);
 	json_decref(packed);
-	DEBUG(">> %.*s", len, buffer);
+	if (!buffer) {
+		ERROR("Could not encode json");
+		return -1;
+	}
+	DEBUG(">> %s", buffer);
 
-	return send(self->fd, buffer, len, MSG_NOSIGNAL);
+	ssize_t rc = send(self->fd, buffer, strlen(buffer), MSG_NOSIGNAL);
+	free(buffer);
+	return rc;
 }
 
 static struct jsonipc_response* ctl_client_run_single_command(struct ctl_client* self,
@@ -905,3 +1099,338 @@ parse_failure:
 	ctl_client_destroy_cmd_parser(&cmd_options);
 	return result;
 }
+
+#define BATCH_MAX_ARGS 64
+
+struct batch_entry {
+	enum cmd_type cmd;
+	struct jsonipc_request* request;
+	struct jsonipc_response* response;
+	TAILQ_ENTRY(batch_entry) link;
+};
+
+TAILQ_HEAD(batch_queue, batch_entry);
+
+struct batch {
+	struct ctl_client* client;
+	struct batch_queue pending;
+	char* line_buffer;
+	size_t line_len;
+	size_t line_size;
+	bool input_done;
+	bool receiving_events;
+	int result;
+};
+
+static void batch_entry_destroy(struct batch_entry* entry)
+{
+	jsonipc_request_destroy(entry->request);
+	if (entry->response)
+		jsonipc_response_destroy(entry->response);
+	free(entry);
+}
+
+/* Splits a line into arguments in place. Single and double quotes group
+ * words together, and anything after an unquoted '#' is ignored.
+ */
+static int batch_split_line(char* line, char** argv, int max_args)
+{
+	int argc = 0;
+	char* in = line;
+
+	while (*in) {
+		while (isspace((unsigned char)*in))
+			in++;
+		if (*in == '\0' || *in == '#')
+			break;
+		if (argc == max_args)
+			return -1;
+
+		char* out = in;
+		argv[argc++] = out;
+
+		char quote = 0;
+		while (*in && (quote || !isspace((unsigned char)*in))) {
+			if (quote && *in == quote) {
+				quote = 0;
+				in++;
+			} else if (!quote && (*in == '"' || *in == '\'')) {
+				quote = *in++;
+			} else {
+				*out++ = *in++;
+			}
+		}
+		if (quote)
+			return -1;
+
+		if (*in)
+			in++;
+		*out = '\0';
+	}
+
+	return argc;
+}
+
+static int batch_send_line(struct batch* self, char* line)
+{
+	struct ctl_client* client = self->client;
+
+	char* argv[BATCH_MAX_ARGS];
+	int argc = batch_split_line(line, argv, BATCH_MAX_ARGS);
+	if (argc < 0) {
+		ERROR("Malformed command line");
+		return -1;
+	}
+	if (argc == 0)
+		return 0;
+
+	enum cmd_type cmd = ctl_command_parse_name(argv[0]);
+	if (cmd == CMD_UNKNOWN || cmd == CMD_HELP) {
+		ERROR("No such command \"%s\"", argv[0]);
+		return -1;
+	}
+
+	struct option_parser cmd_options = { };
+	if (ctl_client_init_cmd_parser(&cmd_options, cmd) != 0)
+		return -1;
+
+	int rc = -1;
+	if (option_parser_parse(&cmd_options, argc,
+				(const char* const*)argv) != 0)
+		goto out;
+
+	if (option_parser_get_value(&cmd_options, "help") ||
+			(cmd == CMD_EVENT_RECEIVE &&
+			 option_parser_get_value(&cmd_options, "show"))) {
+		ERROR("Help is not available in batch mode");
+		goto out;
+	}
+
+	struct jsonipc_request* request = ctl_client_parse_args(client, &cmd,
+			&cmd_options);
+	if (!request)
+		goto out;
+
+	// Allocated up front so that no response is left without an entry
+	struct batch_entry* entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		ERROR("Out of memory");
+		jsonipc_request_destroy(request);
+		goto out;
+	}
+
+	if (ctl_client_send_request(client, request) < 0) {
+		ERROR("Failed to send request: %m");
+		jsonipc_request_destroy(request);
+		free(entry);
+		goto out;
+	}
+
+	entry->cmd = cmd;
+	entry->request = request;
+	TAILQ_INSERT_TAIL(&self->pending, entry, link);
+	rc = 0;
+
+out:
+	ctl_client_destroy_cmd_parser(&cmd_options);
+	return rc;
+}
+
+static void batch_process_lines(struct batch* self)
+{
+	char* line = self->line_buffer;
+	char* end = self->line_buffer + self->line_len;
+
+	char* newline;
+	while ((newline = memchr(line, '\n', end - line))) {
+		*newline = '\0';
+		if (batch_send_line(self, line) < 0)
+			self->result = 1;
+		line = newline + 1;
+	}
+
+	self->line_len = end - line;
+	memmove(self->line_buffer, line, self->line_len);
+}
+
+static int batch_read_input(struct batch* self)
+{
+	if (self->line_size - self->line_len < 256) {
+		size_t size = self->line_size ? self->line_size * 2 : 4096;
+		char* buffer = realloc(self->line_buffer, size);
+		if (!buffer) {
+			ERROR("Out of memory");
+			return -1;
+		}
+		self->line_buffer = buffer;
+		self->line_size = size;
+	}
+
+	// Leave room for a terminator after a trailing unterminated line
+	ssize_t n = read(STDIN_FILENO, self->line_buffer + self->line_len,
+			self->line_size - self->line_len - 1);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		ERROR("Failed to read from stdin: %m");
+		return -1;
+	}
+
+	if (n == 0) {
+		if (self->line_len > 0) {
+			self->line_buffer[self->line_len++] = '\n';
+			batch_process_lines(self);
+		}
+		self->input_done = true;
+		return 0;
+	}
+
+	self->line_len += n;
+	batch_process_lines(self);
+	return 0;
+}
+
+static void batch_flush_responses(struct batch* self)
+{
+	struct batch_entry* entry;
+	while ((entry = TAILQ_FIRST(&self->pending)) && entry->response) {
+		TAILQ_REMOVE(&self->pending, entry, link);
+
+		int code = ctl_client_print_response(self->client,
+				entry->request, entry->response);
+		if (code != 0)
+			self->result = 1;
+		else if (entry->cmd == CMD_EVENT_RECEIVE) {
+			self->receiving_events = true;
+			send_startup_event(self->client);
+		}
+
+		fflush(stdout);
+		batch_entry_destroy(entry);
+	}
+}
+
+static int batch_handle_response(struct batch* self, json_t* root)
+{
+	struct jsonipc_error err = JSONIPC_ERR_INIT;
+	struct jsonipc_response* response = jsonipc_response_parse_new(root,
+			&err);
+	jsonipc_error_cleanup(&err);
+	if (!response) {
+		ERROR("Could not parse response");
+		return -1;
+	}
+
+	struct batch_entry* entry;
+	TAILQ_FOREACH(entry, &self->pending, link)
+		if (!entry->response && response->id &&
+				json_equal(entry->request->id, response->id))
+			break;
+
+	if (!entry) {
+		// Errors that can't be attributed to a request are fatal
+		print_error(response, "<unknown>");
+		jsonipc_response_destroy(response);
+		return -1;
+	}
+
+	entry->response = response;
+	batch_flush_responses(self);
+	return 0;
+}
+
+static int batch_handle_incoming(struct batch* self)
+{
+	if (ctl_client_recv(self->client) < 0)
+		return -1;
+
+	json_t* root;
+	while ((root = json_from_buffer(self->client))) {
+		int rc = 0;
+		if (json_object_get(root, "method")) {
+			struct jsonipc_error err = JSONIPC_ERR_INIT;
+			struct jsonipc_request* event =
+				jsonipc_event_parse_new(root, &err);
+			jsonipc_error_cleanup(&err);
+			if (event) {
+				print_event(event, self->client->flags);
+				jsonipc_request_destroy(event);
+			}
+		} else {
+			rc = batch_handle_response(self, root);
+		}
+		json_decref(root);
+		if (rc < 0)
+			return -1;
+	}
+
+	return errno == EAGAIN ? 0 : -1;
+}
+
+static bool batch_is_done(const struct batch* self)
+{
+	return self->input_done && TAILQ_EMPTY(&self->pending) &&
+		!self->receiving_events;
+}
+
+int ctl_client_run_batch(struct ctl_client* self, unsigned flags)
+{
+	self->flags = flags;
+
+	int timeout = (flags & CTL_CLIENT_SOCKET_WAIT) ? -1 : 0;
+	if (ctl_client_connect(self, timeout) != 0)
+		return 1;
+
+	struct batch batch = {
+		.client = self,
+	};
+	TAILQ_INIT(&batch.pending);
+
+	self->wait_for_events = true;
+	setup_signals(self);
+
+	while (self->wait_for_events && !batch_is_done(&batch)) {
+		struct pollfd fds[2] = {
+			{ .fd = self->fd, .events = POLLIN },
+			{ .fd = batch.input_done ? -1 : STDIN_FILENO,
+				.events = POLLIN },
+		};
+
+		int n = poll(fds, 2, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ERROR("Error waiting for input: %m");
+			batch.result = 1;
+			break;
+		}
+
+		if (fds[0].revents) {
+			if (batch_handle_incoming(&batch) < 0) {
+				if (errno == ECONNRESET && batch.receiving_events)
+					send_shutdown_event(self);
+				if (!TAILQ_EMPTY(&batch.pending) ||
+						errno != ECONNRESET)
+					batch.result = 1;
+				break;
+			}
+		}
+
+		if (fds[1].revents && batch_read_input(&batch) < 0) {
+			batch.result = 1;
+			break;
+		}
+	}
+
+	if (!TAILQ_EMPTY(&batch.pending))
+		ERROR("Some commands did not receive a response");
+
+	while (!TAILQ_EMPTY(&batch.pending)) {
+		struct batch_entry* entry = TAILQ_FIRST(&batch.pending);
+		TAILQ_REMOVE(&batch.pending, entry, link);
+		batch_entry_destroy(entry);
+	}
+	free(batch.line_buffer);
+
+	return batch.result;
+}
@@ -52,8 +52,18 @@ struct cmd_info ctl_command_list[] = {
 	},
 	[CMD_EVENT_RECEIVE] = { "event-receive",
 		"Register to begin receiving asynchronous events from wayvnc",
-		// TODO: Event type filtering?
-		{{}}
+		{
+			{ "events",
+				"Comma separated list of events to receive (default: all)",
+				"<event-name,...>" },
+			{ "rate-limit",
+				"Maximum number of events per second, per event type",
+				"<event-name:rate,...>" },
+			{ "sample-interval",
+				"Milliseconds between performance-sample events (default: 1000)",
+				"<integer>" },
+			{},
+		}
 	},
 	[CMD_CLIENT_LIST] = { "client-list",
 		"Return a list of all currently connected VNC sessions",
@@ -89,6 +99,46 @@ struct cmd_info ctl_command_list[] = {
 		"Disconnect all clients and shut down wayvnc",
 		{{}},
 	},
+	[CMD_MEMORY_STATS] = { "memory-stats",
+		"Report memory held by each subsystem of the wayvnc process",
+		{{}},
+	},
+	[CMD_DAMAGE_MAP] = { "damage-map",
+		"Return the accumulated damage heat map (requires --damage-map)",
+		{{}},
+	},
+	[CMD_SCHEDULING_INFO] = { "scheduling-info",
+		"Report the scheduling policy, CPU affinity and locked memory of wayvnc",
+		{{}},
+	},
+	[CMD_CAPTURE_INFO] = { "capture-info",
+		"Report the capture backend, buffer type and parameters in use",
+		{{}},
+	},
+	[CMD_CAPTURE_SET] = { "capture-set",
+		"Change capture parameters without restarting wayvnc",
+		{
+			{ "max-fps",
+				"Limit frame capture rate",
+				"<integer>" },
+			{ "cursor-max-fps",
+				"Limit cursor capture rate",
+				"<integer>" },
+			{ "spare-buffers",
+				"Number of spare buffers to keep in the capture pool",
+				"<integer>" },
+			{ "render-cursor",
+				"Render the cursor into captured frames",
+				"<true|false>" },
+			{ "gpu",
+				"Capture into GPU buffers",
+				"<true|false>" },
+			{ "reset",
+				"Return to the values given at startup before applying any others",
+				NULL },
+			{},
+		}
+	},
 };
 
 #define CLIENT_EVENT_PARAMS(including) \
@@ -142,6 +192,51 @@ struct cmd_info ctl_event_list[] = {
 			{}
 		}
 	},
+	[EVT_PERFORMANCE_SAMPLE] = {"performance-sample",
+		"Sent periodically with performance counters for the last sampling window. Only sent when requested explicitly with --events or --sample-interval.",
+		{
+			{ "interval", "Length of the sampling window in milliseconds",
+				"<integer>" },
+			{ "fps", "Frames captured per second", "<number>" },
+			{ "damage", "Average fraction of the output damaged per frame",
+				"<number>" },
+			{ "capture-latency", "Time from capture request to completion in microseconds",
+				"{n, p50, p90, p99, max}" },
+			{ "fb-hold-time", "Time from handing a frame to neatvnc until it releases the buffer in microseconds",
+				"{n, p50, p90, p99, max}" },
+			{ "buffer-pool", "Capture buffers allocated, free and acquired without a spare",
+				"{buffers, free, misses}" },
+			{ "loop-stalls", "Main loop iterations that took too long to dispatch",
+				"<integer>" },
+			{ "capture-stalls", "Capture sessions that stopped delivering frames and were re-established",
+				"<integer>" },
+			{ "clients", "Number of connected VNC clients", "<integer>" },
+			{}
+		}
+	},
+	[EVT_CAPTURE_STALLED] = {"capture-stalled",
+		"Sent when the compositor stops delivering frames and the capture session is re-established",
+		{
+			{ "stalls", "Number of stalls since wayvnc started",
+				"<integer>" },
+			{ "retry-delay", "Milliseconds until capturing is restarted",
+				"<integer>" },
+			{}
+		}
+	},
+	[EVT_LOAD_SHEDDING] = {"load-shedding",
+		"Sent when wayvnc changes its behaviour because of overload, or because the client limit was reached",
+		{
+			{ "action", "rate-lowered, rate-raised, admission-closed, admission-opened, client-refused or client-disconnected",
+				"<string>" },
+			{ "load", "Time spent per frame relative to the frame period",
+				"<number>" },
+			{ "max-fps", "Capture rate limit now in effect", "<integer>" },
+			{ "client-id", "The client that was refused or disconnected, if any",
+				"<integer>" },
+			{}
+		}
+	},
 };
 
 enum cmd_type ctl_command_parse_name(const char* name)
@@ -19,10 +19,13 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <math.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/param.h>
 #include <netdb.h>
 #include <neatvnc.h>
 #include <aml.h>
@@ -36,6 +39,22 @@
 #include "json-ipc.h"
 #include "util.h"
 #include "strlcpy.h"
+#include "log.h"
+#include "mem-stats.h"
+#include "buffer.h"
+#include "damage-map.h"
+#include "time-util.h"
+#include "json-framer.h"
+#include "arena.h"
+#include "realtime.h"
+
+#define INITIAL_READ_BUFFER_SIZE 512
+#define WRITE_BUFFER_KEEP_SIZE 65536
+#define REQUEST_ARENA_BLOCK_SIZE 4096
+#define DEFAULT_SAMPLE_INTERVAL_MS 1000
+#define MIN_SAMPLE_INTERVAL_MS 50
+#define MAX_CAPTURE_FPS 1000
+#define MAX_SPARE_BUFFERS 8
 
 #define FAILED_TO(action) \
 	nvnc_log(NVNC_LOG_ERROR, "Failed to " action ": %m");
@@ -71,9 +90,23 @@ struct cmd_disconnect_client {
 	char id[64];
 };
 
+struct cmd_event_receive {
+	struct cmd cmd;
+	uint32_t event_mask;
+	uint32_t min_interval_ms[EVT_LIST_LEN];
+	uint32_t sample_interval_ms;
+};
+
+struct cmd_capture_set {
+	struct cmd cmd;
+	struct ctl_server_capture_params params;
+	bool reset;
+};
+
 struct cmd_response {
 	int code;
 	json_t* data;
+	bool in_arena;
 };
 
 struct ctl_client {
@@ -81,14 +114,19 @@ struct ctl_client {
 	struct wl_list link;
 	struct ctl* server;
 	struct aml_handler* handler;
-	char read_buffer[512];
-	size_t read_len;
+	struct json_framer framer;
+	size_t read_capacity;
 	json_t* response_queue;
 	char* write_buffer;
+	size_t write_capacity;
 	char* write_ptr;
 	size_t write_len;
 	bool drop_after_next_send;
 	bool accept_events;
+	uint32_t event_mask;
+	uint32_t event_min_interval_ms[EVT_LIST_LEN];
+	uint64_t event_last_sent_ms[EVT_LIST_LEN];
+	uint32_t sample_interval_ms;
 };
 
 struct ctl {
@@ -97,11 +135,32 @@ struct ctl {
 	int fd;
 	struct aml_handler* handler;
 	struct wl_list clients;
+	uint32_t sample_interval_ms;
+	size_t max_message_size;
+	struct arena request_arena;
 };
 
+/* Commands and responses only live until the response has been queued, so
+ * while a request is being handled they are taken from the server's request
+ * arena, which is then reset in one go.
+ */
+static struct arena* request_arena = NULL;
+
+static void* request_alloc(size_t size)
+{
+	assert(request_arena);
+	return arena_alloc(request_arena, size);
+}
+
 static struct cmd_response* cmd_response_new(int code, json_t* data)
 {
-	struct cmd_response* new = calloc(1, sizeof(struct cmd_response));
+	struct cmd_response* new = NULL;
+	if (request_arena)
+		new = arena_alloc(request_arena, sizeof(*new));
+	if (new)
+		new->in_arena = true;
+	else
+		new = calloc(1, sizeof(*new));
 	new->code = code;
 	new->data = data;
 	return new;
@@ -110,7 +169,8 @@ static struct cmd_response* cmd_response_new(int code, json_t* data)
 static void cmd_response_destroy(struct cmd_response* self)
 {
 	json_decref(self->data);
-	free(self);
+	if (!self->in_arena)
+		free(self);
 }
 
 static struct cmd_attach* cmd_attach_new(json_t* args,
@@ -121,7 +181,7 @@ static struct cmd_attach* cmd_attach_new(json_t* args,
 		jsonipc_error_printf(err, EINVAL, "Missing display name");
 		return NULL;
 	}
-	struct cmd_attach* cmd = calloc(1, sizeof(*cmd));
+	struct cmd_attach* cmd = request_alloc(sizeof(*cmd));
 	strlcpy(cmd->display, display, sizeof(cmd->display));
 	return cmd;
 }
@@ -143,7 +203,7 @@ static struct cmd_help* cmd_help_new(json_t* args,
 				"expecting exacly one of \"command\" or \"event\"");
 		return NULL;
 	}
-	struct cmd_help* cmd = calloc(1, sizeof(*cmd));
+	struct cmd_help* cmd = request_alloc(sizeof(*cmd));
 	if (command) {
 		strlcpy(cmd->id, command, sizeof(cmd->id));
 		cmd->id_is_command = true;
@@ -162,7 +222,7 @@ static struct cmd_set_output* cmd_set_output_new(json_t* args,
 		jsonipc_error_printf(err, EINVAL, "Missing output name");
 		return NULL;
 	}
-	struct cmd_set_output* cmd = calloc(1, sizeof(*cmd));
+	struct cmd_set_output* cmd = request_alloc(sizeof(*cmd));
 	strlcpy(cmd->target, target, sizeof(cmd->target));
 	return cmd;
 }
@@ -175,11 +235,324 @@ static struct cmd_disconnect_client* cmd_disconnect_client_new(json_t* args,
 		jsonipc_error_printf(err, EINVAL, "Missing client id");
 		return NULL;
 	}
-	struct cmd_disconnect_client* cmd = calloc(1, sizeof(*cmd));
+	struct cmd_disconnect_client* cmd = request_alloc(sizeof(*cmd));
 	strlcpy(cmd->id, id, sizeof(cmd->id));
 	return cmd;
 }
 
+static int parse_event_name(const char* name, size_t len,
+		enum event_type* type, struct jsonipc_error* err)
+{
+	char buf[64];
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	memcpy(buf, name, len);
+	buf[len] = '\0';
+
+	*type = ctl_event_parse_name(buf);
+	if (*type == EVT_UNKNOWN) {
+		jsonipc_error_printf(err, EINVAL, "Unknown event \"%s\"", buf);
+		return -1;
+	}
+	return 0;
+}
+
+static int parse_event_rate(double rate, const char* name,
+		uint32_t* interval_ms, struct jsonipc_error* err)
+{
+	if (!(rate > 0)) {
+		jsonipc_error_printf(err, EINVAL,
+				"Invalid rate limit for \"%s\"", name);
+		return -1;
+	}
+	*interval_ms = round(1000.0 / rate);
+	return 0;
+}
+
+// Accepts either an array of event names or a comma separated string.
+static int parse_event_filter(json_t* events, uint32_t* mask,
+		struct jsonipc_error* err)
+{
+	enum event_type type;
+	*mask = 0;
+
+	if (json_is_array(events)) {
+		size_t i;
+		json_t* item;
+		json_array_foreach(events, i, item) {
+			const char* name = json_string_value(item);
+			if (!name) {
+				jsonipc_error_printf(err, EINVAL,
+						"Event names must be strings");
+				return -1;
+			}
+			if (parse_event_name(name, strlen(name), &type, err) < 0)
+				return -1;
+			*mask |= 1u << type;
+		}
+		return 0;
+	}
+
+	const char* list = json_string_value(events);
+	if (!list) {
+		jsonipc_error_printf(err, EINVAL,
+				"\"events\" must be a list of event names");
+		return -1;
+	}
+
+	while (*list) {
+		size_t len = strcspn(list, ",");
+		if (len > 0) {
+			if (parse_event_name(list, len, &type, err) < 0)
+				return -1;
+			*mask |= 1u << type;
+		}
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+	return 0;
+}
+
+// Accepts either an object mapping event names to events per second or a
+// string on the form "name:rate,name:rate".
+static int parse_event_rate_limits(json_t* limits, uint32_t* intervals,
+		struct jsonipc_error* err)
+{
+	enum event_type type;
+
+	if (json_is_object(limits)) {
+		const char* name;
+		json_t* value;
+		json_object_foreach(limits, name, value) {
+			if (parse_event_name(name, strlen(name), &type, err) < 0)
+				return -1;
+			if (!json_is_number(value)) {
+				jsonipc_error_printf(err, EINVAL,
+						"Invalid rate limit for \"%s\"",
+						name);
+				return -1;
+			}
+			if (parse_event_rate(json_number_value(value), name,
+						&intervals[type], err) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	const char* list = json_string_value(limits);
+	if (!list) {
+		jsonipc_error_printf(err, EINVAL,
+				"\"rate-limit\" must map event names to rates");
+		return -1;
+	}
+
+	while (*list) {
+		size_t len = strcspn(list, ",");
+		const char* sep = memchr(list, ':', len);
+		if (!sep) {
+			jsonipc_error_printf(err, EINVAL,
+					"Expected <event-name>:<rate>");
+			return -1;
+		}
+		if (parse_event_name(list, sep - list, &type, err) < 0)
+			return -1;
+
+		char* end = NULL;
+		double rate = strtod(sep + 1, &end);
+		if (end != list + len) {
+			jsonipc_error_printf(err, EINVAL,
+					"Expected <event-name>:<rate>");
+			return -1;
+		}
+		if (parse_event_rate(rate, ctl_event_list[type].name,
+					&intervals[type], err) < 0)
+			return -1;
+
+		list += len;
+		if (*list == ',')
+			list++;
+	}
+	return 0;
+}
+
+// Parameters arrive as strings from wayvncctl, but as native JSON values
+// from other clients, so both are accepted.
+static bool parse_integer_param(json_t* value, long long* result)
+{
+	if (json_is_integer(value)) {
+		*result = json_integer_value(value);
+		return true;
+	}
+
+	const char* str = json_string_value(value);
+	if (!str || !*str)
+		return false;
+
+	char* end = NULL;
+	*result = strtoll(str, &end, 10);
+	return *end == '\0';
+}
+
+static bool parse_bool_param(json_t* value, bool* result)
+{
+	if (json_is_boolean(value)) {
+		*result = json_is_true(value);
+		return true;
+	}
+
+	const char* str = json_string_value(value);
+	if (!str)
+		return false;
+
+	if (strcmp(str, "true") == 0 || strcmp(str, "on") == 0 ||
+			strcmp(str, "1") == 0) {
+		*result = true;
+		return true;
+	}
+	if (strcmp(str, "false") == 0 || strcmp(str, "off") == 0 ||
+			strcmp(str, "0") == 0) {
+		*result = false;
+		return true;
+	}
+	return false;
+}
+
+static struct cmd_event_receive* cmd_event_receive_new(json_t* args,
+		struct jsonipc_error* err)
+{
+	json_t* events = NULL;
+	json_t* limits = NULL;
+	json_t* interval = NULL;
+	if (args && json_unpack(args, "{s?o, s?o, s?o}",
+				"events", &events,
+				"rate-limit", &limits,
+				"sample-interval", &interval) == -1) {
+		jsonipc_error_printf(err, EINVAL,
+				"expecting \"events\", \"rate-limit\" or \"sample-interval\" (optional)");
+		return NULL;
+	}
+
+	struct cmd_event_receive* cmd = request_alloc(sizeof(*cmd));
+	cmd->event_mask = ~0u;
+
+	if (events && parse_event_filter(events, &cmd->event_mask, err) < 0)
+		return NULL;
+
+	if (interval) {
+		long long value = 0;
+		if (!parse_integer_param(interval, &value) ||
+				value < MIN_SAMPLE_INTERVAL_MS ||
+				value > UINT32_MAX) {
+			jsonipc_error_printf(err, EINVAL,
+					"\"sample-interval\" must be at least %d ms",
+					MIN_SAMPLE_INTERVAL_MS);
+			return NULL;
+		}
+		cmd->sample_interval_ms = value;
+	} else if (!events) {
+		// Performance samples are never part of the default set
+		cmd->event_mask &= ~(1u << EVT_PERFORMANCE_SAMPLE);
+	}
+
+	if (!(cmd->event_mask & (1u << EVT_PERFORMANCE_SAMPLE)))
+		cmd->sample_interval_ms = 0;
+	else if (!cmd->sample_interval_ms)
+		cmd->sample_interval_ms = DEFAULT_SAMPLE_INTERVAL_MS;
+
+	if (limits && parse_event_rate_limits(limits, cmd->min_interval_ms,
+				err) < 0)
+		return NULL;
+
+	return cmd;
+}
+
+static int parse_capture_int(json_t* value, const char* name, int min,
+		int max, int* result, struct jsonipc_error* err)
+{
+	if (!value)
+		return 0;
+
+	long long parsed = 0;
+	if (!parse_integer_param(value, &parsed) || parsed < min ||
+			parsed > max) {
+		jsonipc_error_printf(err, EINVAL,
+				"\"%s\" must be an integer from %d to %d",
+				name, min, max);
+		return -1;
+	}
+	*result = parsed;
+	return 0;
+}
+
+static int parse_capture_bool(json_t* value, const char* name, int* result,
+		struct jsonipc_error* err)
+{
+	if (!value)
+		return 0;
+
+	bool parsed;
+	if (!parse_bool_param(value, &parsed)) {
+		jsonipc_error_printf(err, EINVAL,
+				"\"%s\" must be true or false", name);
+		return -1;
+	}
+	*result = parsed;
+	return 0;
+}
+
+static struct cmd_capture_set* cmd_capture_set_new(json_t* args,
+		struct jsonipc_error* err)
+{
+	json_t* max_fps = NULL;
+	json_t* cursor_max_fps = NULL;
+	json_t* spare_buffers = NULL;
+	json_t* render_cursor = NULL;
+	json_t* gpu = NULL;
+	json_t* reset = NULL;
+	if (args && json_unpack(args, "{s?o, s?o, s?o, s?o, s?o, s?o}",
+				"max-fps", &max_fps,
+				"cursor-max-fps", &cursor_max_fps,
+				"spare-buffers", &spare_buffers,
+				"render-cursor", &render_cursor,
+				"gpu", &gpu,
+				"reset", &reset) == -1) {
+		jsonipc_error_printf(err, EINVAL, "Invalid capture parameters");
+		return NULL;
+	}
+
+	struct cmd_capture_set* cmd = request_alloc(sizeof(*cmd));
+	cmd->params = (struct ctl_server_capture_params){
+		.max_fps = -1,
+		.cursor_max_fps = -1,
+		.spare_buffers = -1,
+		.render_cursor = -1,
+		.gpu = -1,
+	};
+
+	if (parse_capture_int(max_fps, "max-fps", 1, MAX_CAPTURE_FPS,
+				&cmd->params.max_fps, err) < 0 ||
+			parse_capture_int(cursor_max_fps, "cursor-max-fps", 1,
+				MAX_CAPTURE_FPS, &cmd->params.cursor_max_fps,
+				err) < 0 ||
+			parse_capture_int(spare_buffers, "spare-buffers", 0,
+				MAX_SPARE_BUFFERS, &cmd->params.spare_buffers,
+				err) < 0 ||
+			parse_capture_bool(render_cursor, "render-cursor",
+				&cmd->params.render_cursor, err) < 0 ||
+			parse_capture_bool(gpu, "gpu", &cmd->params.gpu,
+				err) < 0)
+		return NULL;
+
+	if (reset && !parse_bool_param(reset, &cmd->reset)) {
+		jsonipc_error_printf(err, EINVAL,
+				"\"reset\" must be true or false");
+		return NULL;
+	}
+
+	return cmd;
+}
+
 static json_t* list_allowed(struct cmd_info (*list)[], size_t len)
 {
 	json_t* allowed = json_array();
@@ -218,14 +591,23 @@ static struct cmd* parse_command(struct jsonipc_request* ipc,
 	case CMD_CLIENT_DISCONNECT:
 		cmd = (struct cmd*)cmd_disconnect_client_new(ipc->params, err);
 		break;
+	case CMD_EVENT_RECEIVE:
+		cmd = (struct cmd*)cmd_event_receive_new(ipc->params, err);
+		break;
+	case CMD_CAPTURE_SET:
+		cmd = (struct cmd*)cmd_capture_set_new(ipc->params, err);
+		break;
 	case CMD_DETACH:
 	case CMD_VERSION:
-	case CMD_EVENT_RECEIVE:
 	case CMD_CLIENT_LIST:
 	case CMD_OUTPUT_LIST:
 	case CMD_OUTPUT_CYCLE:
 	case CMD_WAYVNC_EXIT:
-		cmd = calloc(1, sizeof(*cmd));
+	case CMD_MEMORY_STATS:
+	case CMD_DAMAGE_MAP:
+	case CMD_CAPTURE_INFO:
+	case CMD_SCHEDULING_INFO:
+		cmd = request_alloc(sizeof(*cmd));
 		break;
 	case CMD_UNKNOWN:
 		jsonipc_error_set_new(err, ENOENT,
@@ -241,15 +623,45 @@ static struct cmd* parse_command(struct jsonipc_request* ipc,
 	return cmd;
 }
 
+static void ctl_server_update_sample_interval(struct ctl* self)
+{
+	uint32_t interval = 0;
+	struct ctl_client* client;
+	wl_list_for_each(client, &self->clients, link) {
+		uint32_t ci = client->sample_interval_ms;
+		if (ci && (!interval || ci < interval))
+			interval = ci;
+	}
+
+	if (interval == self->sample_interval_ms)
+		return;
+
+	nvnc_log(NVNC_LOG_DEBUG, "Performance sample interval is now %"PRIu32" ms",
+			interval);
+	self->sample_interval_ms = interval;
+	if (self->actions.on_sample_interval)
+		self->actions.on_sample_interval(self, interval);
+}
+
 static void client_destroy(struct ctl_client* self)
 {
 	nvnc_trace("Destroying client %p", self);
 	aml_stop(aml_get_default(), self->handler);
 	aml_unref(self->handler);
 	close(self->fd);
+	json_framer_destroy(&self->framer);
+	if (self->read_capacity)
+		wv_mem_free(WV_MEM_CTL, self->read_capacity);
 	json_array_clear(self->response_queue);
 	json_decref(self->response_queue);
+	if (self->write_buffer) {
+		wv_mem_free(WV_MEM_CTL, self->write_capacity);
+		free(self->write_buffer);
+	}
 	wl_list_remove(&self->link);
+	if (self->sample_interval_ms)
+		ctl_server_update_sample_interval(self->server);
+	wv_mem_free(WV_MEM_CTL, sizeof(*self));
 	free(self);
 }
 
@@ -271,13 +683,29 @@ static void set_internal_error(struct cmd_response** err, int code,
 // -1: Fatal error.  Check 'err' for details, or if 'err' is null, terminate the connection.
 static ssize_t client_read(struct ctl_client* self, struct cmd_response** err)
 {
-	size_t bufferspace = sizeof(self->read_buffer) - self->read_len;
-	if (bufferspace == 0) {
-		set_internal_error(err, EIO, "Buffer overflow");
+	size_t bufferspace = 0;
+	char* buffer = json_framer_write_ptr(&self->framer, &bufferspace);
+
+	// The read buffer grows with the largest message seen so far
+	size_t capacity = json_framer_capacity(&self->framer);
+	if (capacity != self->read_capacity) {
+		if (self->read_capacity)
+			wv_mem_resize(WV_MEM_CTL, self->read_capacity, capacity);
+		else
+			wv_mem_alloc(WV_MEM_CTL, capacity);
+		self->read_capacity = capacity;
+	}
+
+	if (!buffer) {
+		if (errno == EMSGSIZE)
+			set_internal_error(err, EMSGSIZE,
+					"Message exceeds %zu bytes",
+					self->server->max_message_size);
+		else
+			set_internal_error(err, EIO, "Buffer overflow");
 		return -1;
 	}
-	ssize_t n = recv(self->fd, self->read_buffer + self->read_len, bufferspace,
-			MSG_DONTWAIT);
+	ssize_t n = recv(self->fd, buffer, bufferspace, MSG_DONTWAIT);
 	if (n == -1) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			nvnc_trace("recv: EAGAIN");
@@ -290,23 +718,23 @@ static ssize_t client_read(struct ctl_client* self, struct cmd_response** err)
 		errno = ENOTCONN;
 		return -1;
 	}
-	self->read_len += n;
-	nvnc_trace("Read %d bytes, total is now %d", n, self->read_len);
+	json_framer_commit(&self->framer, n);
+	nvnc_trace("Read %zd bytes, total is now %zu", n,
+			json_framer_pending(&self->framer));
 	return n;
 }
 
 static json_t* client_next_object(struct ctl_client* self, struct cmd_response** ierr)
 {
-	if (self->read_len == 0)
-		return NULL;
-
 	json_error_t err;
-	json_t* root = json_loadb(self->read_buffer, self->read_len,
-			JSON_DISABLE_EOF_CHECK, &err);
+	json_t* root = json_framer_next(&self->framer, &err);
 	if (root) {
-		nvnc_log(NVNC_LOG_DEBUG, "<< %.*s", err.position, self->read_buffer);
-		advance_read_buffer(&self->read_buffer, &self->read_len, err.position);
-	} else if (json_error_code(&err) == json_error_premature_end_of_input) {
+		if (wv_log_is_enabled(NVNC_LOG_DEBUG)) {
+			char* str = json_dumps(root, JSON_COMPACT);
+			nvnc_log(NVNC_LOG_DEBUG, "<< %s", str);
+			jsonipc_free_string(str);
+		}
+	} else if (errno == EAGAIN) {
 		nvnc_trace("Awaiting more data");
 	} else {
 		set_internal_error(ierr, EINVAL, err.text);
@@ -420,6 +848,25 @@ static struct cmd_response* generate_vnc_client_list(struct ctl* self)
 			json_object_set_new(packed, "seat",
 					json_string(info.seat));
 
+		json_object_set_new(packed, "connected_seconds",
+				json_integer(info.connected_us / 1000000));
+		json_object_set_new(packed, "idle_seconds",
+				json_integer(info.idle_us / 1000000));
+		json_object_set_new(packed, "pointer_events",
+				json_integer(info.n_pointer_events));
+		json_object_set_new(packed, "key_events",
+				json_integer(info.n_key_events));
+		json_object_set_new(packed, "clipboard_bytes",
+				json_integer(info.clipboard_bytes));
+		json_object_set_new(packed, "update_requests",
+				json_integer(info.n_update_requests));
+		json_object_set_new(packed, "updates_per_second",
+				json_real(info.updates_per_second));
+		json_object_set_new(packed, "update_latency_avg_us",
+				json_integer(info.update_latency_avg_us));
+		json_object_set_new(packed, "update_latency_p99_us",
+				json_integer(info.update_latency_p99_us));
+
 		json_array_append_new(response->data, packed);
 	}
 
@@ -446,6 +893,126 @@ static struct cmd_response* generate_output_list(struct ctl* self)
 	return response;
 }
 
+static json_t* pack_mem_usage(const struct wv_mem_usage* usage)
+{
+	return json_pack("{s:I, s:I}",
+			"bytes", (json_int_t)usage->bytes,
+			"objects", (json_int_t)usage->objects);
+}
+
+static struct cmd_response* generate_memory_stats(void)
+{
+	json_t* categories = json_object();
+	for (int i = 0; i < WV_MEM_CATEGORY_COUNT; ++i) {
+		struct wv_mem_usage usage;
+		wv_mem_get_usage(i, &usage);
+		json_object_set_new(categories, wv_mem_category_name(i),
+				pack_mem_usage(&usage));
+	}
+
+	struct wv_mem_usage total;
+	wv_mem_get_total(&total);
+
+	struct wv_buffer_pool_stats pool_stats;
+	wv_buffer_pool_get_stats(&pool_stats);
+
+	struct cmd_response* response = cmd_ok();
+	response->data = json_pack("{s:o, s:o, s:{s:I, s:I, s:I}}",
+			"total", pack_mem_usage(&total),
+			"categories", categories,
+			"buffer_pool",
+				"acquired", (json_int_t)pool_stats.acquired,
+				"misses", (json_int_t)pool_stats.misses,
+				"prewarmed", (json_int_t)pool_stats.prewarmed);
+	return response;
+}
+
+static struct cmd_response* generate_scheduling_info(void)
+{
+	struct realtime_status status;
+	realtime_get_status(&status);
+
+	struct cmd_response* response = cmd_ok();
+	response->data = json_pack("{s:s, s:i, s:i, s:s, s:b, s:I}",
+			"policy", status.policy,
+			"priority", status.priority,
+			"nice", status.nice,
+			"cpus", status.cpus,
+			"memory_locked", status.memory_locked,
+			"locked_bytes", (json_int_t)status.locked_bytes);
+	return response;
+}
+
+static struct cmd_response* generate_damage_map(struct ctl* self)
+{
+	const struct damage_map* map = self->actions.get_damage_map(self);
+	if (!map)
+		return cmd_failed("Damage map is not enabled");
+
+	size_t n_tiles = (size_t)map->columns * map->rows;
+	double* values = calloc(n_tiles + 1, sizeof(*values));
+	if (!values)
+		return cmd_failed("Out of memory");
+
+	damage_map_snapshot(map, values);
+
+	json_t* tiles = json_array();
+	for (size_t i = 0; i < n_tiles; ++i)
+		json_array_append_new(tiles, json_integer(lround(values[i])));
+	free(values);
+
+	struct cmd_response* response = cmd_ok();
+	response->data = json_pack("{s:i, s:i, s:i, s:f, s:o}",
+			"tile_size", map->tile_size,
+			"columns", map->columns,
+			"rows", map->rows,
+			"time_constant", map->time_constant,
+			"tiles", tiles);
+	return response;
+}
+
+static struct cmd_response* generate_capture_info(struct ctl* self)
+{
+	struct ctl_server_capture_info info = {};
+	self->actions.get_capture_info(self, &info);
+
+	char identity[17];
+	snprintf(identity, sizeof(identity), "%016" PRIx64,
+			info.compositor_identity);
+
+	json_t* results = json_array();
+	for (int i = 0; i < info.n_results; ++i) {
+		const struct ctl_server_capture_result* result =
+			&info.results[i];
+		json_array_append_new(results, json_pack(
+					"{s:s, s:s, s:I, s:I, s:I}",
+				"backend", result->backend,
+				"buffer_type", result->buffer_type,
+				"frames", (json_int_t)result->n_frames,
+				"latency_us", (json_int_t)result->latency_us,
+				"cpu_us", (json_int_t)result->cpu_us));
+	}
+
+	struct cmd_response* response = cmd_ok();
+	response->data = json_pack("{s:s, s:s, s:o, s:i, s:i, s:i, s:b, s:b, s:I}",
+			"selection", info.selection,
+			"compositor_identity", identity,
+			"measurements", results,
+			"max_fps", info.params.max_fps,
+			"cursor_max_fps", info.params.cursor_max_fps,
+			"spare_buffers", info.params.spare_buffers,
+			"render_cursor", info.params.render_cursor,
+			"gpu", info.params.gpu,
+			"stalls", (json_int_t)info.n_stalls);
+	if (info.backend) {
+		json_object_set_new(response->data, "backend",
+				json_string(info.backend));
+		json_object_set_new(response->data, "buffer_type",
+				json_string(info.buffer_type));
+	}
+	return response;
+}
+
 static struct cmd_response* ctl_server_dispatch_cmd(struct ctl* self,
 		struct ctl_client* client, struct cmd* cmd)
 {
@@ -484,10 +1051,19 @@ static struct cmd_response* ctl_server_dispatch_cmd(struct ctl* self,
 	case CMD_VERSION:
 		response = generate_version_object();
 		break;
-	case CMD_EVENT_RECEIVE:
+	case CMD_EVENT_RECEIVE: {
+		struct cmd_event_receive* c = (struct cmd_event_receive*)cmd;
 		client->accept_events = true;
+		client->event_mask = c->event_mask;
+		memcpy(client->event_min_interval_ms, c->min_interval_ms,
+				sizeof(client->event_min_interval_ms));
+		memset(client->event_last_sent_ms, 0,
+				sizeof(client->event_last_sent_ms));
+		client->sample_interval_ms = c->sample_interval_ms;
+		ctl_server_update_sample_interval(self);
 		response = cmd_ok();
 		break;
+		}
 	case CMD_CLIENT_LIST:
 		response = generate_vnc_client_list(self);
 		break;
@@ -497,6 +1073,24 @@ static struct cmd_response* ctl_server_dispatch_cmd(struct ctl* self,
 	case CMD_OUTPUT_CYCLE:
 		response = self->actions.on_output_cycle(self, OUTPUT_CYCLE_FORWARD);
 		break;
+	case CMD_MEMORY_STATS:
+		response = generate_memory_stats();
+		break;
+	case CMD_SCHEDULING_INFO:
+		response = generate_scheduling_info();
+		break;
+	case CMD_DAMAGE_MAP:
+		response = generate_damage_map(self);
+		break;
+	case CMD_CAPTURE_INFO:
+		response = generate_capture_info(self);
+		break;
+	case CMD_CAPTURE_SET: {
+		struct cmd_capture_set* c = (struct cmd_capture_set*)cmd;
+		response = self->actions.on_capture_set(self, &c->params,
+				c->reset);
+		break;
+		}
 	case CMD_UNKNOWN:
 		break;
 	}
@@ -561,12 +1155,11 @@ static int client_enqueue__response(struct ctl_client* self,
 {
 	nvnc_log(NVNC_LOG_INFO, "Enqueueing response: %s (%d)",
 			response->code == 0 ? "OK" : "FAILED", response->code);
-	char* str = NULL;
-	if (response->data)
-		str = json_dumps(response->data, 0);
-	nvnc_log(NVNC_LOG_DEBUG, "Response data: %s", str);
-	if(str)
-		free(str);
+	if (response->data && wv_log_is_enabled(NVNC_LOG_DEBUG)) {
+		char* str = json_dumps(response->data, 0);
+		nvnc_log(NVNC_LOG_DEBUG, "Response data: %s", str);
+		jsonipc_free_string(str);
+	}
 	struct jsonipc_response* resp =
 		jsonipc_response_new(response->code, response->data, id);
 	cmd_response_destroy(response);
@@ -589,19 +1182,50 @@ static int client_enqueue_internal_error(struct ctl_client* self,
 	return result;
 }
 
+static void client_release_write_buffer(struct ctl_client* self)
+{
+	wv_mem_free(WV_MEM_CTL, self->write_capacity);
+	free(self->write_buffer);
+	self->write_buffer = NULL;
+	self->write_capacity = 0;
+}
+
+// Serialises into a buffer that is reused between messages
+static int client_serialise(struct ctl_client* self, json_t* item)
+{
+	size_t len = json_dumpb(item, self->write_buffer,
+			self->write_capacity, JSON_COMPACT);
+	if (len == 0)
+		return -1;
+
+	if (len > self->write_capacity) {
+		char* buffer = realloc(self->write_buffer, len);
+		if (!buffer)
+			return -1;
+		if (self->write_capacity)
+			wv_mem_resize(WV_MEM_CTL, self->write_capacity, len);
+		else
+			wv_mem_alloc(WV_MEM_CTL, len);
+		self->write_buffer = buffer;
+		self->write_capacity = len;
+		json_dumpb(item, buffer, len, JSON_COMPACT);
+	}
+
+	self->write_ptr = self->write_buffer;
+	self->write_len = len;
+	return 0;
+}
+
 static void send_ready(struct ctl_client* client)
 {
-	if (client->write_buffer) {
+	if (client->write_ptr) {
 		nvnc_trace("Continuing partial write (%d left)", client->write_len);
 	} else if (json_array_size(client->response_queue) > 0){
 		nvnc_trace("Sending new queued message");
 		json_t* item = json_array_get(client->response_queue, 0);
-		client->write_len = json_dumpb(item, NULL, 0, JSON_COMPACT);
-		client->write_buffer = calloc(1, client->write_len);
-		client->write_ptr = client->write_buffer;
-		json_dumpb(item, client->write_buffer, client->write_len,
-				JSON_COMPACT);
-		nvnc_log(NVNC_LOG_DEBUG, ">> %.*s", client->write_len, client->write_buffer);
+		if (client_serialise(client, item) == 0)
+			wv_log(NVNC_LOG_DEBUG, ">> %.*s", (int)client->write_len,
+					client->write_buffer);
 		json_array_remove(client->response_queue, 0);
 	} else {
 		nvnc_trace("Nothing to send");
@@ -625,9 +1249,9 @@ static void send_ready(struct ctl_client* client)
 send_eagain:
 	if (client->write_len == 0) {
 		nvnc_trace("Write buffer empty!");
-		free(client->write_buffer);
-		client->write_buffer = NULL;
 		client->write_ptr = NULL;
+		if (client->write_capacity > WRITE_BUFFER_KEEP_SIZE)
+			client_release_write_buffer(client);
 		if (client->drop_after_next_send) {
 			nvnc_log(NVNC_LOG_WARNING, "Intentional disconnect");
 			client_destroy(client);
@@ -657,6 +1281,8 @@ static void recv_ready(struct ctl_client* client)
 		break;
 	}
 
+	request_arena = &server->request_arena;
+
 	json_t* root;
 	while (true) {
 		root = client_next_object(client, &details);
@@ -689,15 +1315,18 @@ static void recv_ready(struct ctl_client* client)
 			goto no_response;
 		client_enqueue_response(client, response, request->id);
 no_response:
-		free(cmd);
 cmdparse_failed:
 		jsonipc_request_destroy(request);
 request_parse_failed:
 		jsonipc_error_cleanup(&jipc_err);
 		json_decref(root);
+		arena_reset(&server->request_arena);
 	}
 	if (details)
 		client_enqueue_internal_error(client, details);
+
+	arena_reset(&server->request_arena);
+	request_arena = NULL;
 }
 
 static void on_ready(void* obj)
@@ -725,6 +1354,8 @@ static void on_connection(void* obj)
 
 	client->server = server;
 	client->response_queue = json_array();
+	json_framer_init(&client->framer, INITIAL_READ_BUFFER_SIZE,
+			server->max_message_size);
 
 	client->fd = accept(server->fd, NULL, 0);
 	if (client->fd < 0) {
@@ -744,6 +1375,7 @@ static void on_connection(void* obj)
 	}
 
 	wl_list_insert(&server->clients, &client->link);
+	wv_mem_alloc(WV_MEM_CTL, sizeof(*client));
 	nvnc_log(NVNC_LOG_INFO, "New control socket client connected: %p", client);
 	return;
 
@@ -880,6 +1512,8 @@ struct ctl* ctl_server_new(const char* socket_path,
 {
 	struct ctl* ctl = calloc(1, sizeof(*ctl));
 	memcpy(&ctl->actions, actions, sizeof(*actions));
+	ctl->max_message_size = CTL_SERVER_DEFAULT_MAX_MESSAGE_SIZE;
+	arena_init(&ctl->request_arena, REQUEST_ARENA_BLOCK_SIZE);
 	if (ctl_server_init(ctl, socket_path) != 0) {
 		free(ctl);
 		return NULL;
@@ -887,9 +1521,15 @@ struct ctl* ctl_server_new(const char* socket_path,
 	return ctl;
 }
 
+void ctl_server_set_max_message_size(struct ctl* self, size_t size)
+{
+	self->max_message_size = size;
+}
+
 void ctl_server_destroy(struct ctl* self)
 {
 	ctl_server_stop(self);
+	arena_destroy(&self->request_arena);
 	free(self);
 }
 
@@ -933,13 +1573,55 @@ json_t* pack_connection_event_params(
 			"connection_count", new_connection_count);
 }
 
+static bool client_wants_event(const struct ctl_client* self,
+		enum event_type evt_type, uint64_t now)
+{
+	if (!self->accept_events || !(self->event_mask & (1u << evt_type)))
+		return false;
+
+	uint32_t interval = self->event_min_interval_ms[evt_type];
+	uint32_t slack = 0;
+
+	// Samples are taken at the shortest interval of all clients, so those
+	// that asked for a longer one only get every n-th sample. Half a
+	// period of slack keeps ticker jitter from skipping a whole one.
+	if (evt_type == EVT_PERFORMANCE_SAMPLE && self->sample_interval_ms) {
+		interval = MAX(interval, self->sample_interval_ms);
+		slack = self->server->sample_interval_ms / 2;
+	}
+
+	return interval == 0 || self->event_last_sent_ms[evt_type] == 0 ||
+		now - self->event_last_sent_ms[evt_type] + slack >= interval;
+}
+
 int ctl_server_enqueue_event(struct ctl* self, enum event_type evt_type,
 		json_t* params)
 {
 	const char* event_name = ctl_event_list[evt_type].name;
-	char* param_str = json_dumps(params, JSON_COMPACT);
-	nvnc_log(NVNC_LOG_DEBUG, "Enqueueing %s event: %s", event_name, param_str);
-	free(param_str);
+	uint64_t now = gettime_ms();
+
+	// Filter before the event gets serialised so that unwanted events
+	// cost nothing beyond this loop.
+	bool wanted = false;
+	struct ctl_client* client;
+	wl_list_for_each(client, &self->clients, link)
+		if (client_wants_event(client, evt_type, now)) {
+			wanted = true;
+			break;
+		}
+
+	if (!wanted) {
+		nvnc_trace("No control client wants %s event", event_name);
+		json_decref(params);
+		return 0;
+	}
+
+	if (wv_log_is_enabled(NVNC_LOG_DEBUG)) {
+		char* param_str = json_dumps(params, JSON_COMPACT);
+		nvnc_log(NVNC_LOG_DEBUG, "Enqueueing %s event: %s", event_name,
+				param_str);
+		jsonipc_free_string(param_str);
+	}
 	struct jsonipc_request* event = jsonipc_event_new(event_name, params);
 	json_decref(params);
 	json_error_t err;
@@ -951,14 +1633,14 @@ int ctl_server_enqueue_event(struct ctl* self, enum event_type evt_type,
 	}
 
 	int enqueued = 0;
-	struct ctl_client* client;
 	wl_list_for_each(client, &self->clients, link) {
-		if (!client->accept_events) {
+		if (!client_wants_event(client, evt_type, now)) {
 			nvnc_trace("Skipping event send to control client %p", client);
 			continue;
 		}
 		if (client_enqueue(client, packed_event, false) == 0) {
 			nvnc_trace("Enqueued event for control client %p", client);
+			client->event_last_sent_ms[evt_type] = now;
 			enqueued++;
 		} else {
 			nvnc_trace("Failed to enqueue event for control client %p", client);
@@ -1018,3 +1700,56 @@ void ctl_server_event_output_removed(struct ctl* self, const char* name)
 	ctl_server_enqueue_event(self, EVT_OUTPUT_REMOVED,
 			json_pack("{s:s}", "name", name));
 }
+
+static json_t* pack_percentiles(const struct wv_perf_percentiles* p)
+{
+	return json_pack("{s:I, s:I, s:I, s:I, s:I}",
+			"n", (json_int_t)p->n,
+			"p50", (json_int_t)p->p50,
+			"p90", (json_int_t)p->p90,
+			"p99", (json_int_t)p->p99,
+			"max", (json_int_t)p->max);
+}
+
+void ctl_server_event_performance_sample(struct ctl* self,
+		const struct ctl_server_perf_sample* sample)
+{
+	ctl_server_enqueue_event(self, EVT_PERFORMANCE_SAMPLE,
+			json_pack("{s:I, s:f, s:f, s:o, s:o, s:{s:I, s:I, s:I}, s:I, s:I, s:i}",
+				"interval", (json_int_t)sample->interval_ms,
+				"fps", sample->fps,
+				"damage", sample->damage,
+				"capture-latency",
+				pack_percentiles(&sample->capture_latency),
+				"fb-hold-time",
+				pack_percentiles(&sample->fb_hold_time),
+				"buffer-pool",
+					"buffers", (json_int_t)sample->n_buffers,
+					"free", (json_int_t)sample->n_free_buffers,
+					"misses", (json_int_t)sample->buffer_misses,
+				"loop-stalls", (json_int_t)sample->loop_stalls,
+				"capture-stalls", (json_int_t)sample->capture_stalls,
+				"clients", sample->n_clients));
+}
+
+void ctl_server_event_capture_stalled(struct ctl* self, uint32_t n_stalls,
+		uint32_t retry_delay_ms)
+{
+	ctl_server_enqueue_event(self, EVT_CAPTURE_STALLED,
+			json_pack("{s:I, s:I}",
+				"stalls", (json_int_t)n_stalls,
+				"retry-delay", (json_int_t)retry_delay_ms));
+}
+
+void ctl_server_event_load_shedding(struct ctl* self, const char* action,
+		double load, int max_fps, int client_id)
+{
+	json_t* params = json_pack("{s:s, s:f, s:i}",
+			"action", action,
+			"load", load,
+			"max-fps", max_fps);
+	if (client_id >= 0)
+		json_object_set_new(params, "client-id",
+				json_integer(client_id));
+	ctl_server_enqueue_event(self, EVT_LOAD_SHEDDING, params);
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+#include <pixman.h>
+#include <sys/param.h>
+
+#include "damage-map.h"
+#include "time-util.h"
+
+// Rescale the tiles when the weight of new damage exceeds this
+#define MAX_WEIGHT 1.0e6
+
+int damage_map_init(struct damage_map* self, int tile_size,
+		double time_constant)
+{
+	if (tile_size <= 0 || time_constant <= 0)
+		return -1;
+
+	self->tile_size = tile_size;
+	self->time_constant = time_constant;
+	self->columns = 0;
+	self->rows = 0;
+	self->tiles = NULL;
+	self->frame = 0;
+	self->tile_frames = NULL;
+	self->epoch = gettime_us();
+	return 0;
+}
+
+void damage_map_destroy(struct damage_map* self)
+{
+	free(self->tile_frames);
+	free(self->tiles);
+	self->tile_frames = NULL;
+	self->tiles = NULL;
+}
+
+int damage_map_resize(struct damage_map* self, int width, int height)
+{
+	int columns = (width + self->tile_size - 1) / self->tile_size;
+	int rows = (height + self->tile_size - 1) / self->tile_size;
+
+	if (columns == self->columns && rows == self->rows)
+		return 0;
+
+	size_t n_tiles = (size_t)columns * rows;
+	double* tiles = calloc(n_tiles, sizeof(*tiles));
+	uint32_t* tile_frames = calloc(n_tiles, sizeof(*tile_frames));
+	if (!tiles || !tile_frames) {
+		free(tile_frames);
+		free(tiles);
+		return -1;
+	}
+
+	damage_map_destroy(self);
+	self->tiles = tiles;
+	self->tile_frames = tile_frames;
+	self->frame = 0;
+	self->columns = columns;
+	self->rows = rows;
+	self->epoch = gettime_us();
+	return 0;
+}
+
+static double damage_map_weight(const struct damage_map* self, uint64_t now)
+{
+	double dt = (now - self->epoch) * 1.0e-6;
+	return exp(dt / self->time_constant);
+}
+
+static void damage_map_rescale(struct damage_map* self, uint64_t now)
+{
+	double factor = 1.0 / damage_map_weight(self, now);
+	size_t n_tiles = (size_t)self->columns * self->rows;
+
+	for (size_t i = 0; i < n_tiles; ++i)
+		self->tiles[i] *= factor;
+
+	self->epoch = now;
+}
+
+void damage_map_add(struct damage_map* self,
+		const struct pixman_region16* region)
+{
+	if (!self->tiles)
+		return;
+
+	uint64_t now = gettime_us();
+	double weight = damage_map_weight(self, now);
+	if (weight > MAX_WEIGHT) {
+		damage_map_rescale(self, now);
+		weight = 1.0;
+	}
+
+	uint32_t frame = ++self->frame;
+
+	int n_rects = 0;
+	const struct pixman_box16* rects =
+		pixman_region_rectangles(region, &n_rects);
+
+	for (int i = 0; i < n_rects; ++i) {
+		int x1 = MAX(rects[i].x1, 0) / self->tile_size;
+		int y1 = MAX(rects[i].y1, 0) / self->tile_size;
+		int x2 = MIN((rects[i].x2 + self->tile_size - 1) /
+				self->tile_size, self->columns);
+		int y2 = MIN((rects[i].y2 + self->tile_size - 1) /
+				self->tile_size, self->rows);
+
+		for (int y = y1; y < y2; ++y) {
+			size_t row = (size_t)y * self->columns;
+			for (int x = x1; x < x2; ++x) {
+				if (self->tile_frames[row + x] == frame)
+					continue;
+				self->tile_frames[row + x] = frame;
+				self->tiles[row + x] += weight;
+			}
+		}
+	}
+}
+
+void damage_map_snapshot(const struct damage_map* self, double* values)
+{
+	double factor = 1.0 / damage_map_weight(self, gettime_us());
+	size_t n_tiles = (size_t)self->columns * self->rows;
+
+	for (size_t i = 0; i < n_tiles; ++i)
+		values[i] = self->tiles[i] * factor;
+}
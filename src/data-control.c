@@ -27,17 +27,26 @@
 #include <neatvnc.h>
 
 #include "data-control.h"
+#include "mem-stats.h"
+
+#define PRIMARY_SELECTION_DEBOUNCE_US 250000
+#define RECEIVE_INITIAL_CAPACITY (64 * 1024)
+#define RECEIVE_PIPE_SIZE (1024 * 1024)
+// Bytes read per dispatch before yielding to the main loop
+#define RECEIVE_BUDGET (4 * 1024 * 1024)
 
 static const char custom_mime_type_data[] = "wayvnc";
 
 struct receive_context {
+	struct data_control* data_control;
 	struct nvnc* server;
 	struct aml_handler* handler;
 	LIST_ENTRY(receive_context) link;
 	int fd;
-	FILE* mem_fp;
-	size_t mem_size;
 	char* mem_data;
+	size_t mem_size;
+	size_t mem_capacity;
+	size_t max_size;
 };
 
 struct send_context {
@@ -49,14 +58,33 @@ struct send_context {
 	size_t index;
 };
 
+static uint64_t content_hash(const char* data, size_t len)
+{
+	// FNV-1a
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ (uint8_t)data[i]) * UINT64_C(0x100000001b3);
+	return hash;
+}
+
+static bool is_known_to_clients(struct data_control* self, const char* data,
+		size_t len, uint64_t* hash_out)
+{
+	uint64_t hash = content_hash(data, len);
+	*hash_out = hash;
+	return self->client_cb_len == len && self->client_cb_hash == hash;
+}
+
 static void destroy_receive_context(struct receive_context* ctx)
 {
 	aml_stop(aml_get_default(), ctx->handler);
 	aml_unref(ctx->handler);
 
-	if (ctx->mem_fp)
-		fclose(ctx->mem_fp);
+	if (ctx->data_control->primary_receive == ctx)
+		ctx->data_control->primary_receive = NULL;
+
 	free(ctx->mem_data);
+	wv_mem_free(WV_MEM_CLIPBOARD, ctx->mem_capacity);
 	close(ctx->fd);
 	LIST_REMOVE(ctx, link);
 	free(ctx);
@@ -69,34 +97,88 @@ static void destroy_send_context(struct send_context* ctx)
 
 	close(ctx->fd);
 	free(ctx->data);
+	wv_mem_free(WV_MEM_CLIPBOARD, ctx->length);
 	LIST_REMOVE(ctx, link);
 	free(ctx);
 }
 
+static int receive_buffer_grow(struct receive_context* ctx)
+{
+	// One byte beyond the limit is needed to detect oversized transfers
+	size_t limit = ctx->max_size + 1;
+	if (ctx->mem_capacity >= limit)
+		return 0;
+
+	size_t capacity = ctx->mem_capacity ? ctx->mem_capacity * 2 :
+		RECEIVE_INITIAL_CAPACITY;
+	if (capacity > limit)
+		capacity = limit;
+
+	char* data = realloc(ctx->mem_data, capacity);
+	if (!data)
+		return -1;
+
+	wv_mem_resize(WV_MEM_CLIPBOARD, ctx->mem_capacity, capacity);
+	ctx->mem_data = data;
+	ctx->mem_capacity = capacity;
+	return 0;
+}
+
 static void on_receive(void* handler)
 {
 	struct receive_context* ctx = aml_get_userdata(handler);
 	int fd = aml_get_fd(handler);
 	assert(ctx->fd == fd);
 
-	char buf[4096];
+	size_t budget = RECEIVE_BUDGET;
 
-	ssize_t ret = read(fd, &buf, sizeof(buf));
-	if (ret == -1) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
+	while (budget > 0) {
+		if (ctx->mem_size == ctx->mem_capacity &&
+				receive_buffer_grow(ctx) < 0) {
+			nvnc_log(NVNC_LOG_ERROR, "OOM: %m");
+			destroy_receive_context(ctx);
 			return;
-		nvnc_log(NVNC_LOG_ERROR, "Clipboard read failed: %m");
-		destroy_receive_context(ctx);
-	} else if (ret > 0) {
-		fwrite(&buf, 1, ret, ctx->mem_fp);
-		return;
+		}
+
+		size_t space = ctx->mem_capacity - ctx->mem_size;
+		ssize_t ret = read(fd, ctx->mem_data + ctx->mem_size,
+				space < budget ? space : budget);
+		if (ret == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			nvnc_log(NVNC_LOG_ERROR, "Clipboard read failed: %m");
+			destroy_receive_context(ctx);
+			return;
+		}
+
+		if (ret == 0)
+			break;
+
+		ctx->mem_size += ret;
+		budget -= ret;
+
+		if (ctx->mem_size > ctx->max_size) {
+			nvnc_log(NVNC_LOG_WARNING, "Clipboard content exceeds %zu bytes, not sending it to clients",
+					ctx->max_size);
+			destroy_receive_context(ctx);
+			return;
+		}
 	}
 
-	fclose(ctx->mem_fp);
-	ctx->mem_fp = NULL;
+	// Let other events run before reading the rest
+	if (budget == 0)
+		return;
 
-	if (ctx->mem_size)
+	struct data_control* self = ctx->data_control;
+	uint64_t hash;
+	if (ctx->mem_size && !is_known_to_clients(self, ctx->mem_data,
+				ctx->mem_size, &hash)) {
 		nvnc_send_cut_text(ctx->server, ctx->mem_data, ctx->mem_size);
+		self->client_cb_hash = hash;
+		self->client_cb_len = ctx->mem_size;
+	} else if (ctx->mem_size) {
+		nvnc_log(NVNC_LOG_DEBUG, "Clipboard content unchanged, not sending it to clients");
+	}
 
 	destroy_receive_context(ctx);
 }
@@ -129,7 +211,7 @@ static int dont_block(int fd)
 	return fcntl(fd, F_SETFL, ret | O_NONBLOCK);
 }
 
-static void receive_data(void* data,
+static struct receive_context* receive_data(void* data,
 	struct zwlr_data_control_offer_v1* offer)
 {
 	struct data_control* self = data;
@@ -137,14 +219,14 @@ static void receive_data(void* data,
 
 	if (pipe(pipe_fd) == -1) {
 		nvnc_log(NVNC_LOG_ERROR, "pipe() failed: %m");
-		return;
+		return NULL;
 	}
 
 	if (dont_block(pipe_fd[0]) == -1) {
 		nvnc_log(NVNC_LOG_ERROR, "Failed to set O_NONBLOCK on clipbooard receive fd");
 		close(pipe_fd[0]);
 		close(pipe_fd[1]);
-		return;
+		return NULL;
 	}
 
 	struct receive_context* ctx = calloc(1, sizeof(*ctx));
@@ -152,19 +234,21 @@ static void receive_data(void* data,
 		nvnc_log(NVNC_LOG_ERROR, "OOM: %m");
 		close(pipe_fd[0]);
 		close(pipe_fd[1]);
-		return;
+		return NULL;
 	}
 
+#ifdef F_SETPIPE_SZ
+	// Fewer wake-ups for large transfers; the default is only 64 KiB
+	fcntl(pipe_fd[0], F_SETPIPE_SZ, RECEIVE_PIPE_SIZE);
+#endif
+
 	zwlr_data_control_offer_v1_receive(offer, self->mime_type, pipe_fd[1]);
 	close(pipe_fd[1]);
 
 	ctx->fd = pipe_fd[0];
+	ctx->data_control = self;
 	ctx->server = self->server;
-	ctx->mem_fp = open_memstream(&ctx->mem_data, &ctx->mem_size);
-	if (!ctx->mem_fp) {
-		nvnc_log(NVNC_LOG_ERROR, "open_memstream() failed: %m");
-		goto open_memstream_failure;
-	}
+	ctx->max_size = self->max_receive_size;
 
 	ctx->handler = aml_handler_new(ctx->fd, on_receive, ctx, NULL);
 	if (!ctx->handler) {
@@ -175,16 +259,16 @@ static void receive_data(void* data,
 		goto poll_start_failure;
 	}
 
+	wv_mem_alloc(WV_MEM_CLIPBOARD, 0);
 	LIST_INSERT_HEAD(&self->receive_contexts, ctx, link);
-	return;
+	return ctx;
 
 poll_start_failure:
 	aml_unref(ctx->handler);
 handler_failure:
-	fclose(ctx->mem_fp);
-open_memstream_failure:
 	free(ctx);
 	close(pipe_fd[0]);
+	return NULL;
 }
 
 static void data_control_offer(void* data,
@@ -248,12 +332,43 @@ static void data_control_device_finished(void* data,
 	zwlr_data_control_device_v1_destroy(zwlr_data_control_device_v1);
 }
 
+static void cancel_primary_transfer(struct data_control* self)
+{
+	if (self->primary_timer)
+		aml_stop(aml_get_default(), self->primary_timer);
+
+	if (self->pending_primary_offer) {
+		zwlr_data_control_offer_v1_destroy(self->pending_primary_offer);
+		self->pending_primary_offer = NULL;
+	}
+
+	if (self->primary_receive) {
+		nvnc_log(NVNC_LOG_DEBUG, "Primary selection superseded, cancelling transfer");
+		destroy_receive_context(self->primary_receive);
+	}
+}
+
+static void on_primary_timer(void* handler)
+{
+	struct data_control* self = aml_get_userdata(handler);
+
+	struct zwlr_data_control_offer_v1* offer = self->pending_primary_offer;
+	if (!offer)
+		return;
+
+	self->pending_primary_offer = NULL;
+	self->primary_receive = receive_data(self, offer);
+	zwlr_data_control_offer_v1_destroy(offer);
+}
+
 static void data_control_device_primary_selection(void* data,
 	struct zwlr_data_control_device_v1* zwlr_data_control_device_v1,
 	struct zwlr_data_control_offer_v1* id)
 {
 	struct data_control* self = data;
 
+	cancel_primary_transfer(self);
+
 	if (!id) {
 		if (self->offer) {
 			zwlr_data_control_offer_v1_destroy(self->offer);
@@ -263,10 +378,14 @@ static void data_control_device_primary_selection(void* data,
 		return;
 	}
 
-	if (id == self->offer && !self->is_own_offer)
-		receive_data(data, id);
+	if (id == self->offer && !self->is_own_offer &&
+			self->enable_primary_selection) {
+		self->pending_primary_offer = id;
+		aml_start(aml_get_default(), self->primary_timer);
+	} else {
+		zwlr_data_control_offer_v1_destroy(id);
+	}
 
-	zwlr_data_control_offer_v1_destroy(id);
 	self->offer = NULL;
 	self->is_own_offer = false;
 }
@@ -345,6 +464,7 @@ data_control_source_send(void* data,
 	if (aml_start(aml_get_default(), ctx->handler) < 0)
 		goto poll_start_failure;
 
+	wv_mem_alloc(WV_MEM_CLIPBOARD, ctx->length);
 	LIST_INSERT_HEAD(&self->send_contexts, ctx, link);
 	return;
 
@@ -378,13 +498,21 @@ struct zwlr_data_control_source_v1_listener data_control_source_listener = {
 	.cancelled = data_control_source_cancelled
 };
 
+static void clear_cb_data(struct data_control* self)
+{
+	if (self->cb_data)
+		wv_mem_free(WV_MEM_CLIPBOARD, self->cb_len);
+	free(self->cb_data);
+	self->cb_data = NULL;
+	self->cb_len = 0;
+}
+
 static struct zwlr_data_control_source_v1* set_selection(struct data_control* self, bool primary) {
 	struct zwlr_data_control_source_v1* selection;
 	selection = zwlr_data_control_manager_v1_create_data_source(self->manager);
 	if (selection == NULL) {
 		nvnc_log(NVNC_LOG_ERROR, "zwlr_data_control_manager_v1_create_data_source() failed");
-		free(self->cb_data);
-		self->cb_data = NULL;
+		clear_cb_data(self);
 		return NULL;
 	}
 
@@ -400,7 +528,8 @@ static struct zwlr_data_control_source_v1* set_selection(struct data_control* se
 	return selection;
 }
 
-void data_control_init(struct data_control* self, struct nvnc* server, struct wl_seat* seat)
+void data_control_init(struct data_control* self, struct nvnc* server,
+		struct wl_seat* seat, bool enable_primary_selection)
 {
 	self->server = server;
 	LIST_INIT(&self->receive_contexts);
@@ -411,8 +540,20 @@ void data_control_init(struct data_control* self, struct nvnc* server, struct wl
 	self->primary_selection = NULL;
 	self->offer = NULL;
 	self->is_own_offer = false;
+	self->enable_primary_selection = enable_primary_selection;
+	self->pending_primary_offer = NULL;
+	self->primary_receive = NULL;
+	self->primary_timer = aml_timer_new(PRIMARY_SELECTION_DEBOUNCE_US,
+			on_primary_timer, self, NULL);
+	if (!self->primary_timer) {
+		nvnc_log(NVNC_LOG_ERROR, "Failed to create timer, primary selection disabled");
+		self->enable_primary_selection = false;
+	}
 	self->cb_data = NULL;
 	self->cb_len = 0;
+	self->max_receive_size = DATA_CONTROL_DEFAULT_MAX_SIZE;
+	self->client_cb_hash = 0;
+	self->client_cb_len = 0;
 	self->mime_type = "text/plain;charset=utf-8";
 	snprintf(self->custom_mime_type_name,
 			sizeof(self->custom_mime_type_name),
@@ -421,6 +562,11 @@ void data_control_init(struct data_control* self, struct nvnc* server, struct wl
 
 void data_control_destroy(struct data_control* self)
 {
+	cancel_primary_transfer(self);
+	if (self->primary_timer)
+		aml_unref(self->primary_timer);
+	self->primary_timer = NULL;
+
 	while (!LIST_EMPTY(&self->receive_contexts))
 		destroy_receive_context(LIST_FIRST(&self->receive_contexts));
 	while (!LIST_EMPTY(&self->send_contexts)) {
@@ -436,7 +582,7 @@ void data_control_destroy(struct data_control* self)
 		self->primary_selection = NULL;
 	}
 	zwlr_data_control_device_v1_destroy(self->device);
-	free(self->cb_data);
+	clear_cb_data(self);
 }
 
 void data_control_to_clipboard(struct data_control* self, const char* text, size_t len)
@@ -445,7 +591,22 @@ void data_control_to_clipboard(struct data_control* self, const char* text, size
 		nvnc_log(NVNC_LOG_ERROR, "%s called with 0 length", __func__);
 		return;
 	}
-	free(self->cb_data);
+
+	// The sources are only kept for as long as they own the selections
+	bool is_offered = self->selection && (self->primary_selection ||
+			!self->enable_primary_selection);
+	if (is_offered && self->cb_len == len &&
+			memcmp(self->cb_data, text, len) == 0) {
+		nvnc_log(NVNC_LOG_DEBUG, "Clipboard content unchanged, keeping the current selection");
+		return;
+	}
+
+	/* The other clients do not have this yet, so whatever the compositor
+	 * offers next must be sent to them.
+	 */
+	self->client_cb_len = 0;
+
+	clear_cb_data(self);
 
 	self->cb_data = malloc(len);
 	if (!self->cb_data) {
@@ -455,8 +616,10 @@ void data_control_to_clipboard(struct data_control* self, const char* text, size
 
 	memcpy(self->cb_data, text, len);
 	self->cb_len = len;
+	wv_mem_alloc(WV_MEM_CLIPBOARD, len);
 	// Set copy/paste buffer
 	self->selection = set_selection(self, false);
 	// Set highlight/middle_click buffer
-	self->primary_selection = set_selection(self, true);
+	if (self->enable_primary_selection)
+		self->primary_selection = set_selection(self, true);
 }
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/dma-heap.h>
+#include <neatvnc.h>
+
+#include "dma-heap.h"
+#include "strlcpy.h"
+
+#define DMA_HEAP_DIR "/dev/dma_heap/"
+
+static void dma_heap_path(char* dst, size_t len, const char* name)
+{
+	snprintf(dst, len, DMA_HEAP_DIR "%s", name);
+}
+
+bool dma_heap_is_available(const char* name)
+{
+	char path[256];
+	dma_heap_path(path, sizeof(path), name);
+	return access(path, R_OK | W_OK) == 0;
+}
+
+struct dma_heap* dma_heap_open(const char* name)
+{
+	struct dma_heap* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	char path[256];
+	dma_heap_path(path, sizeof(path), name);
+
+	self->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (self->fd < 0) {
+		nvnc_log(NVNC_LOG_ERROR, "Failed to open %s: %m", path);
+		free(self);
+		return NULL;
+	}
+
+	strlcpy(self->name, name, sizeof(self->name));
+
+	nvnc_log(NVNC_LOG_DEBUG, "Using dma-heap: %s", name);
+	return self;
+}
+
+void dma_heap_close(struct dma_heap* self)
+{
+	if (!self)
+		return;
+
+	close(self->fd);
+	free(self);
+}
+
+int dma_heap_alloc(struct dma_heap* self, size_t size)
+{
+	struct dma_heap_allocation_data data = {
+		.len = size,
+		.fd_flags = O_CLOEXEC | O_RDWR,
+	};
+
+	int rc;
+	do {
+		rc = ioctl(self->fd, DMA_HEAP_IOCTL_ALLOC, &data);
+	} while (rc < 0 && errno == EINTR);
+
+	if (rc < 0) {
+		nvnc_log(NVNC_LOG_ERROR, "Failed to allocate %zu bytes from dma-heap %s: %m",
+				size, self->name);
+		return -1;
+	}
+
+	return data.fd;
+}
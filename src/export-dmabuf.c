@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Capturing via wlr-export-dmabuf
+ *
+ * The compositor exports the DMA-BUFs that it rendered the output into and
+ * those are passed on to neatvnc as they are, so no copy is made. The
+ * compositor keeps a frame's buffers locked until the frame object is
+ * destroyed, which happens when neatvnc releases the fb.
+ *
+ * If an exported frame cannot be imported or the compositor cancels capturing
+ * permanently, this falls back to wlr-screencopy for the rest of the session.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <wayland-client.h>
+#include <libdrm/drm_fourcc.h>
+#include <aml.h>
+#include <neatvnc.h>
+
+#include "wlr-export-dmabuf-unstable-v1.h"
+#include "linux-dmabuf-unstable-v1.h"
+#include "buffer.h"
+#include "screencopy-interface.h"
+#include "time-util.h"
+#include "usdt.h"
+#include "pixels.h"
+#include "config.h"
+#include "sys/queue.h"
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+#include <gbm.h>
+#endif
+
+#ifdef HAVE_LINUX_DMA_HEAP
+#include <linux/dma-buf.h>
+#endif
+
+#define EXPORT_DMABUF_MAX_PLANES 4
+
+extern struct zwlr_export_dmabuf_manager_v1* export_dmabuf_manager;
+extern struct screencopy_impl wlr_screencopy_impl;
+
+enum export_dmabuf_status {
+	EXPORT_DMABUF_STOPPED = 0,
+	EXPORT_DMABUF_IN_PROGRESS,
+};
+
+struct export_dmabuf_object {
+	int fd;
+	uint32_t size;
+};
+
+struct export_dmabuf_plane {
+	uint32_t object;
+	uint32_t offset;
+	uint32_t stride;
+};
+
+struct export_dmabuf_frame {
+	struct wv_buffer buffer;
+	LIST_ENTRY(export_dmabuf_frame) link;
+
+	struct zwlr_export_dmabuf_frame_v1* wl_frame;
+
+	uint64_t modifier;
+	int n_objects;
+	struct export_dmabuf_object objects[EXPORT_DMABUF_MAX_PLANES];
+	int n_planes;
+	struct export_dmabuf_plane planes[EXPORT_DMABUF_MAX_PLANES];
+
+	void* map;
+	size_t map_size;
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	struct wv_gbm_device* gbm;
+#endif
+};
+
+LIST_HEAD(export_dmabuf_frame_list, export_dmabuf_frame);
+
+struct export_dmabuf {
+	struct screencopy parent;
+
+	enum export_dmabuf_status status;
+
+	struct wl_output* wl_output;
+	bool overlay_cursor;
+
+	struct export_dmabuf_frame* pending;
+	struct export_dmabuf_frame_list outstanding;
+
+	uint64_t last_time;
+	uint64_t request_time;
+	struct aml_timer* timer;
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	struct wv_gbm_device* gbm;
+#endif
+
+	struct screencopy* fallback;
+};
+
+struct screencopy_impl export_dmabuf_impl;
+
+static struct export_dmabuf_frame* export_dmabuf_frame_create(
+		struct zwlr_export_dmabuf_frame_v1* wl_frame)
+{
+	struct export_dmabuf_frame* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->wl_frame = wl_frame;
+
+	for (int i = 0; i < EXPORT_DMABUF_MAX_PLANES; ++i)
+		self->objects[i].fd = -1;
+
+	pixman_region_init(&self->buffer.frame_damage);
+	pixman_region_init(&self->buffer.buffer_damage);
+
+	return self;
+}
+
+static void export_dmabuf_frame_detach(struct export_dmabuf_frame* self)
+{
+	if (self->wl_frame)
+		zwlr_export_dmabuf_frame_v1_destroy(self->wl_frame);
+	self->wl_frame = NULL;
+}
+
+static void export_dmabuf_frame_destroy(struct export_dmabuf_frame* self)
+{
+	if (self->buffer.nvnc_fb)
+		nvnc_fb_unref(self->buffer.nvnc_fb);
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	if (self->buffer.bo)
+		gbm_bo_destroy(self->buffer.bo);
+	if (self->gbm)
+		wv_gbm_device_unref(self->gbm);
+#endif
+
+	if (self->map) {
+#ifdef HAVE_LINUX_DMA_HEAP
+		struct dma_buf_sync sync = {
+			.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ,
+		};
+		ioctl(self->objects[0].fd, DMA_BUF_IOCTL_SYNC, &sync);
+#endif
+		munmap(self->map, self->map_size);
+	}
+
+	for (int i = 0; i < EXPORT_DMABUF_MAX_PLANES; ++i)
+		if (self->objects[i].fd >= 0)
+			close(self->objects[i].fd);
+
+	export_dmabuf_frame_detach(self);
+
+	pixman_region_fini(&self->buffer.buffer_damage);
+	pixman_region_fini(&self->buffer.frame_damage);
+	free(self);
+}
+
+static void export_dmabuf_frame_release(struct nvnc_fb* fb, void* context)
+{
+	(void)fb;
+	struct export_dmabuf_frame* self = context;
+
+	wv_buffer_record_release(&self->buffer);
+
+	// Detached frames have already been removed from the session
+	if (self->wl_frame)
+		LIST_REMOVE(self, link);
+
+	export_dmabuf_frame_destroy(self);
+}
+
+// Only linear single plane buffers can be read directly by the CPU
+static bool export_dmabuf_frame_map(struct export_dmabuf_frame* self)
+{
+	if (self->modifier != DRM_FORMAT_MOD_LINEAR &&
+			self->modifier != DRM_FORMAT_MOD_INVALID)
+		return false;
+
+	if (self->n_planes != 1 || self->objects[0].fd < 0)
+		return false;
+
+	int bpp = pixel_size_from_fourcc(self->buffer.format);
+	if (bpp <= 0)
+		return false;
+
+	const struct export_dmabuf_plane* plane = &self->planes[0];
+	size_t size = self->objects[0].size;
+	if ((size_t)plane->offset + (size_t)plane->stride *
+			self->buffer.height > size)
+		return false;
+
+	self->map = mmap(NULL, size, PROT_READ, MAP_SHARED,
+			self->objects[0].fd, 0);
+	if (self->map == MAP_FAILED) {
+		self->map = NULL;
+		nvnc_log(NVNC_LOG_DEBUG, "Failed to map exported buffer: %m");
+		return false;
+	}
+	self->map_size = size;
+
+#ifdef HAVE_LINUX_DMA_HEAP
+	// memfd backed buffers don't support this, so errors are ignored
+	struct dma_buf_sync sync = {
+		.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ,
+	};
+	ioctl(self->objects[0].fd, DMA_BUF_IOCTL_SYNC, &sync);
+#endif
+
+	self->buffer.type = WV_BUFFER_SHM;
+	self->buffer.pixels = (uint8_t*)self->map + plane->offset;
+	self->buffer.stride = plane->stride;
+	self->buffer.size = size;
+	self->buffer.nvnc_fb = nvnc_fb_from_buffer(self->buffer.pixels,
+			self->buffer.width, self->buffer.height,
+			self->buffer.format, plane->stride / bpp);
+	return !!self->buffer.nvnc_fb;
+}
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+static bool export_dmabuf_frame_import(struct export_dmabuf_frame* self,
+		struct wv_gbm_device* gbm)
+{
+	struct gbm_import_fd_modifier_data d = {
+		.width = self->buffer.width,
+		.height = self->buffer.height,
+		.format = self->buffer.format,
+		.num_fds = self->n_planes,
+		.modifier = self->modifier,
+	};
+
+	for (int i = 0; i < self->n_planes; ++i) {
+		const struct export_dmabuf_plane* plane = &self->planes[i];
+		if (plane->object >= EXPORT_DMABUF_MAX_PLANES)
+			return false;
+		d.fds[i] = self->objects[plane->object].fd;
+		d.offsets[i] = plane->offset;
+		d.strides[i] = plane->stride;
+	}
+
+	self->buffer.bo = gbm_bo_import(gbm->dev, GBM_BO_IMPORT_FD_MODIFIER,
+			&d, 0);
+	if (!self->buffer.bo) {
+		nvnc_log(NVNC_LOG_DEBUG, "Failed to import exported buffer: %m");
+		return false;
+	}
+
+	self->gbm = gbm;
+	wv_gbm_device_ref(gbm);
+
+	self->buffer.type = WV_BUFFER_DMABUF;
+	self->buffer.stride = self->planes[0].stride;
+	self->buffer.nvnc_fb = nvnc_fb_from_gbm_bo(self->buffer.bo);
+	return !!self->buffer.nvnc_fb;
+}
+#endif
+
+static bool export_dmabuf_import(struct export_dmabuf* self,
+		struct export_dmabuf_frame* frame)
+{
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	if (self->parent.enable_linux_dmabuf) {
+		if (!self->gbm)
+			self->gbm = wv_gbm_device_open(0);
+
+		if (self->gbm && export_dmabuf_frame_import(frame, self->gbm))
+			return true;
+	}
+#endif
+
+	return export_dmabuf_frame_map(frame);
+}
+
+static void export_dmabuf__stop(struct export_dmabuf* self)
+{
+	aml_stop(aml_get_default(), self->timer);
+
+	self->status = EXPORT_DMABUF_STOPPED;
+
+	if (self->pending) {
+		export_dmabuf_frame_destroy(self->pending);
+		self->pending = NULL;
+	}
+}
+
+static void export_dmabuf_sync_fallback(struct export_dmabuf* self)
+{
+	struct screencopy* fallback = self->fallback;
+
+	fallback->rate_limit = self->parent.rate_limit;
+	fallback->enable_linux_dmabuf = self->parent.enable_linux_dmabuf;
+	fallback->n_spare_buffers = self->parent.n_spare_buffers;
+	fallback->on_done = self->parent.on_done;
+	fallback->rate_format = self->parent.rate_format;
+	fallback->userdata = self->parent.userdata;
+}
+
+static int export_dmabuf_fall_back(struct export_dmabuf* self)
+{
+	export_dmabuf__stop(self);
+
+	if (!self->fallback) {
+		nvnc_log(NVNC_LOG_WARNING, "Falling back to wlr-screencopy");
+
+		self->fallback = wlr_screencopy_impl.create(self->wl_output,
+				self->overlay_cursor);
+		if (!self->fallback)
+			return -1;
+	}
+
+	export_dmabuf_sync_fallback(self);
+	return self->fallback->impl->start(self->fallback, true);
+}
+
+static void export_dmabuf_frame_info(void* data,
+		struct zwlr_export_dmabuf_frame_v1* wl_frame,
+		uint32_t width, uint32_t height, uint32_t offset_x,
+		uint32_t offset_y, uint32_t buffer_flags, uint32_t flags,
+		uint32_t format, uint32_t mod_high, uint32_t mod_low,
+		uint32_t num_objects)
+{
+	(void)wl_frame;
+	(void)offset_x;
+	(void)offset_y;
+	(void)flags;
+
+	struct export_dmabuf* self = data;
+	struct export_dmabuf_frame* frame = self->pending;
+
+	frame->buffer.width = width;
+	frame->buffer.height = height;
+	frame->buffer.format = format;
+	frame->buffer.y_inverted = !!(buffer_flags &
+			ZWP_LINUX_BUFFER_PARAMS_V1_FLAGS_Y_INVERT);
+	frame->modifier = (uint64_t)mod_high << 32 | mod_low;
+	frame->n_objects = num_objects;
+}
+
+static void export_dmabuf_object(void* data,
+		struct zwlr_export_dmabuf_frame_v1* wl_frame, uint32_t index,
+		int32_t fd, uint32_t size, uint32_t offset, uint32_t stride,
+		uint32_t plane_index)
+{
+	(void)wl_frame;
+
+	struct export_dmabuf* self = data;
+	struct export_dmabuf_frame* frame = self->pending;
+
+	if (index >= EXPORT_DMABUF_MAX_PLANES ||
+			plane_index >= EXPORT_DMABUF_MAX_PLANES) {
+		close(fd);
+		return;
+	}
+
+	if (frame->objects[index].fd >= 0)
+		close(frame->objects[index].fd);
+
+	frame->objects[index].fd = fd;
+	frame->objects[index].size = size;
+
+	frame->planes[plane_index].object = index;
+	frame->planes[plane_index].offset = offset;
+	frame->planes[plane_index].stride = stride;
+
+	if ((int)plane_index + 1 > frame->n_planes)
+		frame->n_planes = plane_index + 1;
+}
+
+static void export_dmabuf_ready(void* data,
+		struct zwlr_export_dmabuf_frame_v1* wl_frame,
+		uint32_t sec_hi, uint32_t sec_lo, uint32_t nsec)
+{
+	(void)wl_frame;
+
+	struct export_dmabuf* self = data;
+	struct export_dmabuf_frame* frame = self->pending;
+
+	uint64_t sec = (uint64_t)sec_hi << 32 | (uint64_t)sec_lo;
+	uint64_t pts = sec * UINT64_C(1000000) + (uint64_t)nsec / UINT64_C(1000);
+
+	DTRACE_PROBE2(wayvnc, export_dmabuf_ready, self, pts);
+
+	if (!export_dmabuf_import(self, frame)) {
+		nvnc_log(NVNC_LOG_WARNING, "Could not use exported DMA-BUF of format %"PRIu32" with modifier %"PRIx64,
+				frame->buffer.format, frame->modifier);
+		if (export_dmabuf_fall_back(self) < 0) {
+			self->parent.on_done(SCREENCOPY_FATAL, NULL,
+					self->parent.userdata);
+		}
+		return;
+	}
+
+	self->pending = NULL;
+	self->status = EXPORT_DMABUF_STOPPED;
+	self->last_time = gettime_us();
+	frame->buffer.capture_latency_us = self->last_time - self->request_time;
+
+	// The protocol carries no damage information
+	wv_buffer_damage_whole(&frame->buffer);
+
+	LIST_INSERT_HEAD(&self->outstanding, frame, link);
+
+	nvnc_set_userdata(frame->buffer.nvnc_fb, &frame->buffer, NULL);
+	nvnc_fb_set_release_fn(frame->buffer.nvnc_fb,
+			export_dmabuf_frame_release, frame);
+	nvnc_fb_set_pts(frame->buffer.nvnc_fb, pts);
+
+	self->parent.on_done(SCREENCOPY_DONE, &frame->buffer,
+			self->parent.userdata);
+}
+
+static void export_dmabuf_cancel(void* data,
+		struct zwlr_export_dmabuf_frame_v1* wl_frame, uint32_t reason)
+{
+	(void)wl_frame;
+
+	struct export_dmabuf* self = data;
+
+	DTRACE_PROBE1(wayvnc, export_dmabuf_cancel, self);
+
+	if (reason == ZWLR_EXPORT_DMABUF_FRAME_V1_CANCEL_REASON_PERMANENT) {
+		if (export_dmabuf_fall_back(self) < 0) {
+			self->parent.on_done(SCREENCOPY_FATAL, NULL,
+					self->parent.userdata);
+		}
+		return;
+	}
+
+	export_dmabuf__stop(self);
+	self->parent.on_done(SCREENCOPY_FAILED, NULL, self->parent.userdata);
+}
+
+static int export_dmabuf__start_capture(struct export_dmabuf* self)
+{
+	static const struct zwlr_export_dmabuf_frame_v1_listener frame_listener = {
+		.frame = export_dmabuf_frame_info,
+		.object = export_dmabuf_object,
+		.ready = export_dmabuf_ready,
+		.cancel = export_dmabuf_cancel,
+	};
+
+	DTRACE_PROBE1(wayvnc, export_dmabuf_start, self);
+
+	self->request_time = gettime_us();
+
+	struct zwlr_export_dmabuf_frame_v1* wl_frame =
+		zwlr_export_dmabuf_manager_v1_capture_output(
+				export_dmabuf_manager, self->overlay_cursor,
+				self->wl_output);
+	if (!wl_frame)
+		return -1;
+
+	self->pending = export_dmabuf_frame_create(wl_frame);
+	if (!self->pending) {
+		zwlr_export_dmabuf_frame_v1_destroy(wl_frame);
+		return -1;
+	}
+
+	zwlr_export_dmabuf_frame_v1_add_listener(wl_frame, &frame_listener,
+			self);
+
+	return 0;
+}
+
+static void export_dmabuf__poll(void* obj)
+{
+	struct export_dmabuf* self = aml_get_userdata(obj);
+
+	export_dmabuf__start_capture(self);
+}
+
+static int export_dmabuf_start(struct screencopy* ptr, bool immediate)
+{
+	struct export_dmabuf* self = (struct export_dmabuf*)ptr;
+
+	if (self->fallback) {
+		export_dmabuf_sync_fallback(self);
+		return self->fallback->impl->start(self->fallback, immediate);
+	}
+
+	if (self->status == EXPORT_DMABUF_IN_PROGRESS)
+		return -1;
+
+	self->status = EXPORT_DMABUF_IN_PROGRESS;
+
+	uint64_t now = gettime_us();
+	double dt = (now - self->last_time) * 1.0e-6;
+	int32_t time_left = (1.0 / ptr->rate_limit - dt) * 1.0e6;
+
+	if (!immediate && time_left > 0) {
+		aml_set_duration(self->timer, time_left);
+		return aml_start(aml_get_default(), self->timer);
+	}
+
+	return export_dmabuf__start_capture(self);
+}
+
+static void export_dmabuf_stop(struct screencopy* ptr)
+{
+	struct export_dmabuf* self = (struct export_dmabuf*)ptr;
+
+	if (self->fallback)
+		self->fallback->impl->stop(self->fallback);
+
+	export_dmabuf__stop(self);
+}
+
+static struct screencopy* export_dmabuf_create(struct wl_output* output,
+		bool render_cursor)
+{
+	struct export_dmabuf* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->parent.impl = &export_dmabuf_impl;
+	self->parent.rate_limit = 30;
+
+	self->wl_output = output;
+	self->overlay_cursor = render_cursor;
+
+	LIST_INIT(&self->outstanding);
+
+	self->timer = aml_timer_new(0, export_dmabuf__poll, self, NULL);
+	assert(self->timer);
+
+	return (struct screencopy*)self;
+}
+
+static void export_dmabuf_destroy(struct screencopy* ptr)
+{
+	struct export_dmabuf* self = (struct export_dmabuf*)ptr;
+
+	export_dmabuf__stop(self);
+	aml_unref(self->timer);
+
+	// Frames that are still held by neatvnc are freed when released, but
+	// their Wayland objects must not outlive the capture session.
+	while (!LIST_EMPTY(&self->outstanding)) {
+		struct export_dmabuf_frame* frame = LIST_FIRST(&self->outstanding);
+		LIST_REMOVE(frame, link);
+		export_dmabuf_frame_detach(frame);
+	}
+
+	screencopy_destroy(self->fallback);
+
+#ifdef ENABLE_SCREENCOPY_DMABUF
+	if (self->gbm)
+		wv_gbm_device_unref(self->gbm);
+#endif
+
+	free(self);
+}
+
+struct screencopy_impl export_dmabuf_impl = {
+	.caps = 0,
+	.create = export_dmabuf_create,
+	.destroy = export_dmabuf_destroy,
+	.start = export_dmabuf_start,
+	.stop = export_dmabuf_stop,
+};
@@ -36,6 +36,7 @@
 #include "time-util.h"
 #include "usdt.h"
 #include "pixels.h"
+#include "log.h"
 #include "config.h"
 
 extern struct ext_output_image_capture_source_manager_v1* ext_output_image_capture_source_manager;
@@ -78,8 +79,16 @@ struct ext_image_copy_capture {
 
 	struct { int x, y; } hotspot;
 
+	/* Cursor sessions are paused while the cursor is off the output and
+	 * resumed on the next enter event.
+	 */
+	bool cursor_away;
+	bool cursor_paused;
+
 	uint64_t last_time;
+	uint64_t request_time;
 	struct aml_timer* timer;
+	bool timer_armed;
 };
 
 struct screencopy_impl ext_image_copy_capture_impl;
@@ -182,6 +191,7 @@ static void ext_image_copy_capture_schedule_capture(struct ext_image_copy_captur
 	 */
 	config_buffers(self);
 
+	self->pool->spare_target = self->parent.n_spare_buffers;
 	self->buffer = wv_buffer_pool_acquire(self->pool);
 	self->buffer->domain = self->cursor ? WV_BUFFER_DOMAIN_CURSOR :
 		WV_BUFFER_DOMAIN_OUTPUT;
@@ -208,14 +218,18 @@ static void ext_image_copy_capture_schedule_capture(struct ext_image_copy_captur
 				width, height);
 	}
 
+	self->request_time = gettime_us();
 	ext_image_copy_capture_frame_v1_capture(self->frame);
 
 #ifndef NDEBUG
-	float damage_area = calculate_region_area(&self->buffer->buffer_damage);
-	float pixel_area = self->buffer->width * self->buffer->height;
-	nvnc_trace("Committed %sbuffer: %p with %.02f %% damage",
-			self->cursor ? "cursor " : "", self->buffer,
-			100.0 * damage_area / pixel_area);
+	if (wv_log_is_enabled(NVNC_LOG_TRACE)) {
+		float damage_area = calculate_region_area(
+				&self->buffer->buffer_damage);
+		float pixel_area = self->buffer->width * self->buffer->height;
+		nvnc_trace("Committed %sbuffer: %p with %.02f %% damage",
+				self->cursor ? "cursor " : "", self->buffer,
+				100.0 * damage_area / pixel_area);
+	}
 #endif
 }
 
@@ -224,6 +238,7 @@ static void ext_image_copy_capture_schedule_from_timer(void* obj)
 	struct ext_image_copy_capture* self = aml_get_userdata(obj);
 	assert(self);
 
+	self->timer_armed = false;
 	ext_image_copy_capture_schedule_capture(self);
 }
 
@@ -508,10 +523,13 @@ static void frame_handle_ready(void *data,
 	self->frame = NULL;
 
 #ifndef NDEBUG
-	float damage_area = calculate_region_area(&self->buffer->frame_damage);
-	float pixel_area = self->buffer->width * self->buffer->height;
-	nvnc_trace("Frame ready with damage: %.02f %", 100.0 * damage_area /
-			pixel_area);
+	if (wv_log_is_enabled(NVNC_LOG_TRACE)) {
+		float damage_area = calculate_region_area(
+				&self->buffer->frame_damage);
+		float pixel_area = self->buffer->width * self->buffer->height;
+		nvnc_trace("Frame ready with damage: %.02f %%",
+				100.0 * damage_area / pixel_area);
+	}
 #endif
 
 	assert(self->buffer);
@@ -531,6 +549,7 @@ static void frame_handle_ready(void *data,
 
 	// TODO: Use presentation time somehow?
 	self->last_time = gettime_us();
+	buffer->capture_latency_us = self->last_time - self->request_time;
 
 	self->parent.on_done(SCREENCOPY_DONE, buffer, self->parent.userdata);
 }
@@ -599,10 +618,37 @@ static struct ext_image_copy_capture_frame_v1_listener frame_listener = {
 	.failed = frame_handle_failed,
 };
 
+// Capture the next cursor frame now rather than waiting for the rate limiter
+static void cursor_capture_now(struct ext_image_copy_capture* self)
+{
+	if (self->frame)
+		return;
+
+	if (self->timer_armed) {
+		aml_stop(aml_get_default(), self->timer);
+		self->timer_armed = false;
+	} else if (!self->cursor_paused) {
+		return;
+	}
+
+	self->cursor_paused = false;
+
+	if (!self->have_constraints) {
+		self->should_start = true;
+		return;
+	}
+
+	ext_image_copy_capture_schedule_capture(self);
+}
+
 static void cursor_handle_enter(void* data,
 		struct ext_image_copy_capture_cursor_session_v1* cursor)
 {
 	struct ext_image_copy_capture* self = data;
+
+	self->cursor_away = false;
+	cursor_capture_now(self);
+
 	if (self->parent.cursor_enter)
 		self->parent.cursor_enter(self->parent.userdata);
 }
@@ -611,6 +657,9 @@ static void cursor_handle_leave(void* data,
 		struct ext_image_copy_capture_cursor_session_v1* cursor)
 {
 	struct ext_image_copy_capture* self = data;
+
+	self->cursor_away = true;
+
 	if (self->parent.cursor_leave)
 		self->parent.cursor_leave(self->parent.userdata);
 }
@@ -618,7 +667,9 @@ static void cursor_handle_leave(void* data,
 static void cursor_handle_position(void* data,
 		struct ext_image_copy_capture_cursor_session_v1* cursor, int x, int y)
 {
-	// Don't care
+	struct ext_image_copy_capture* self = data;
+	if (self->parent.cursor_position)
+		self->parent.cursor_position(x, y, self->parent.userdata);
 }
 
 static void cursor_handle_hotspot(void* data,
@@ -632,6 +683,9 @@ static void cursor_handle_hotspot(void* data,
 		self->parent.cursor_hotspot(x, y, self->parent.userdata);
 
 	nvnc_trace("Got hotspot at %d, %d", x, y);
+
+	// The hotspot changes with the shape, so don't hold that back
+	cursor_capture_now(self);
 }
 
 static struct ext_image_copy_capture_cursor_session_v1_listener cursor_listener = {
@@ -660,6 +714,14 @@ static int ext_image_copy_capture_start(struct screencopy* ptr, bool immediate)
 		return 0;
 	}
 
+	if (self->cursor && self->cursor_away) {
+		nvnc_trace("Cursor is away; pausing cursor capture");
+		aml_stop(aml_get_default(), self->timer);
+		self->timer_armed = false;
+		self->cursor_paused = true;
+		return 0;
+	}
+
 	uint64_t eps = 4000; // µs
 	uint64_t period = round(1e6 / self->parent.rate_limit);
 	uint64_t next_time = self->last_time + period - eps;
@@ -667,12 +729,14 @@ static int ext_image_copy_capture_start(struct screencopy* ptr, bool immediate)
 
 	if (now >= next_time) {
 		aml_stop(aml_get_default(), self->timer);
+		self->timer_armed = false;
 		ext_image_copy_capture_schedule_capture(self);
 	} else {
 		nvnc_trace("Scheduling %scapture after %"PRIu64" µs",
 				self->cursor ? "cursor " : "", next_time - now);
 		aml_set_duration(self->timer, next_time - now);
 		aml_start(aml_get_default(), self->timer);
+		self->timer_armed = true;
 	}
 
 	return 0;
@@ -683,6 +747,8 @@ static void ext_image_copy_capture_stop(struct screencopy* base)
 	struct ext_image_copy_capture* self = (struct ext_image_copy_capture*)base;
 
 	aml_stop(aml_get_default(), self->timer);
+	self->timer_armed = false;
+	self->cursor_paused = false;
 
 	if (self->frame) {
 		ext_image_copy_capture_frame_v1_destroy(self->frame);
@@ -744,6 +810,8 @@ static struct screencopy* ext_image_copy_capture_create_cursor(struct wl_output*
 	if (!self->pool)
 		goto failure;
 
+	self->pool->domain = WV_BUFFER_DOMAIN_CURSOR;
+
 	if (ext_image_copy_capture_init_cursor_session(self) < 0)
 		goto session_failure;
 
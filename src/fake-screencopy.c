@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/param.h>
+#include <aml.h>
+#include <neatvnc.h>
+#include <pixman.h>
+
+#include "fake-screencopy.h"
+#include "buffer.h"
+#include "time-util.h"
+
+LIST_HEAD(fake_buffer_list, wv_buffer);
+
+struct fake_screencopy {
+	struct screencopy parent;
+	struct fake_screencopy_config config;
+	struct fake_screencopy_step* script;
+	size_t position;
+
+	struct aml_timer* timer;
+	bool is_pending;
+	uint64_t last_time;
+
+	// All buffers, including those held by the consumer
+	struct fake_buffer_list buffers;
+	struct wv_buffer_queue free_buffers;
+
+	struct fake_screencopy_stats stats;
+};
+
+static void fake_buffer_destroy(struct wv_buffer* buffer)
+{
+	pixman_region_fini(&buffer->frame_damage);
+	pixman_region_fini(&buffer->buffer_damage);
+	nvnc_fb_unref(buffer->nvnc_fb);
+	free(buffer->pixels);
+	free(buffer);
+}
+
+static void fake_buffer_on_release(struct nvnc_fb* fb, void* context)
+{
+	struct fake_screencopy* self = context;
+	fake_screencopy_release(&self->parent, nvnc_get_userdata(fb));
+}
+
+// Buffers that are still held when the screencopy is destroyed
+static void fake_buffer_on_orphan_release(struct nvnc_fb* fb, void* context)
+{
+	(void)context;
+	fake_buffer_destroy(nvnc_get_userdata(fb));
+}
+
+static struct wv_buffer* fake_buffer_create(struct fake_screencopy* self)
+{
+	struct wv_buffer* buffer = calloc(1, sizeof(*buffer));
+	if (!buffer)
+		return NULL;
+
+	buffer->type = WV_BUFFER_SHM;
+	buffer->domain = WV_BUFFER_DOMAIN_OUTPUT;
+	buffer->width = self->config.width;
+	buffer->height = self->config.height;
+	buffer->stride = self->config.width * 4;
+	buffer->format = self->config.format;
+	buffer->size = (size_t)buffer->height * buffer->stride;
+
+	buffer->pixels = calloc(1, buffer->size);
+	if (!buffer->pixels)
+		goto pixels_failure;
+
+	buffer->nvnc_fb = nvnc_fb_from_buffer(buffer->pixels, buffer->width,
+			buffer->height, buffer->format, buffer->width);
+	if (!buffer->nvnc_fb)
+		goto fb_failure;
+
+	nvnc_set_userdata(buffer->nvnc_fb, buffer, NULL);
+	nvnc_fb_set_release_fn(buffer->nvnc_fb, fake_buffer_on_release, self);
+
+	pixman_region_init(&buffer->frame_damage);
+	pixman_region_init_rect(&buffer->buffer_damage, 0, 0, buffer->width,
+			buffer->height);
+
+	LIST_INSERT_HEAD(&self->buffers, buffer, registry_link);
+	self->stats.n_buffers++;
+	return buffer;
+
+fb_failure:
+	free(buffer->pixels);
+pixels_failure:
+	free(buffer);
+	return NULL;
+}
+
+static struct wv_buffer* fake_buffer_acquire(struct fake_screencopy* self)
+{
+	struct wv_buffer* buffer = TAILQ_FIRST(&self->free_buffers);
+	if (!buffer)
+		return fake_buffer_create(self);
+
+	TAILQ_REMOVE(&self->free_buffers, buffer, link);
+	self->stats.n_free--;
+	return buffer;
+}
+
+void fake_screencopy_release(struct screencopy* ptr, struct wv_buffer* buffer)
+{
+	struct fake_screencopy* self = (struct fake_screencopy*)ptr;
+	pixman_region_clear(&buffer->frame_damage);
+	TAILQ_INSERT_TAIL(&self->free_buffers, buffer, link);
+	self->stats.n_free++;
+}
+
+static void fake_fill(struct wv_buffer* buffer, int x, int y, int width,
+		int height, uint32_t value)
+{
+	for (int row = y; row < y + height; ++row) {
+		uint32_t* pixels = (uint32_t*)((uint8_t*)buffer->pixels +
+				(size_t)row * buffer->stride);
+		for (int column = x; column < x + width; ++column)
+			pixels[column] = value;
+	}
+}
+
+static void fake_deliver(struct fake_screencopy* self,
+		const struct fake_screencopy_step* step)
+{
+	if (step->result != SCREENCOPY_DONE) {
+		self->stats.n_failed++;
+		self->parent.on_done(step->result, NULL, self->parent.userdata);
+		return;
+	}
+
+	struct wv_buffer* buffer = fake_buffer_acquire(self);
+	if (!buffer) {
+		self->stats.n_failed++;
+		self->parent.on_done(SCREENCOPY_FATAL, NULL,
+				self->parent.userdata);
+		return;
+	}
+
+	pixman_box16_t frame = {
+		.x1 = 0, .y1 = 0,
+		.x2 = buffer->width, .y2 = buffer->height,
+	};
+	pixman_box16_t damage = frame;
+	if (step->width > 0 && step->height > 0) {
+		damage.x1 = MAX(step->x, 0);
+		damage.y1 = MAX(step->y, 0);
+		damage.x2 = MIN(step->x + step->width, frame.x2);
+		damage.y2 = MIN(step->y + step->height, frame.y2);
+	}
+
+	// Each frame gets a distinct colour so that consumers can tell them
+	// apart
+	if (damage.x2 > damage.x1 && damage.y2 > damage.y1) {
+		fake_fill(buffer, damage.x1, damage.y1, damage.x2 - damage.x1,
+				damage.y2 - damage.y1,
+				0xff000000 | (self->stats.n_delivered * 0x010101));
+		pixman_region_union_rect(&buffer->frame_damage,
+				&buffer->frame_damage, damage.x1, damage.y1,
+				damage.x2 - damage.x1, damage.y2 - damage.y1);
+	}
+
+	buffer->capture_latency_us = step->delay_us;
+	buffer->fed_at_us = 0;
+
+	self->stats.n_delivered++;
+	self->parent.on_done(SCREENCOPY_DONE, buffer, self->parent.userdata);
+}
+
+static void fake_on_timer(void* obj)
+{
+	struct fake_screencopy* self = aml_get_userdata(obj);
+
+	const struct fake_screencopy_step* step = &self->script[self->position];
+	if (++self->position >= self->config.script_len &&
+			self->config.repeat)
+		self->position = 0;
+
+	self->is_pending = false;
+	self->last_time = gettime_us();
+
+	fake_deliver(self, step);
+}
+
+static int fake_screencopy_start(struct screencopy* ptr, bool immediate)
+{
+	struct fake_screencopy* self = (struct fake_screencopy*)ptr;
+
+	if (self->is_pending)
+		return 0;
+
+	self->stats.n_started++;
+
+	// The script has run out, so this never completes
+	if (self->position >= self->config.script_len)
+		return 0;
+
+	uint64_t delay = self->script[self->position].delay_us;
+
+	if (!immediate && self->parent.rate_limit > 0) {
+		uint64_t period = round(1e6 / self->parent.rate_limit);
+		uint64_t earliest = self->last_time + period;
+		uint64_t now = gettime_us();
+		if (earliest > now + delay)
+			delay = earliest - now;
+	}
+
+	self->is_pending = true;
+	aml_set_duration(self->timer, delay);
+	aml_start(aml_get_default(), self->timer);
+	return 0;
+}
+
+static void fake_screencopy_stop(struct screencopy* ptr)
+{
+	struct fake_screencopy* self = (struct fake_screencopy*)ptr;
+
+	aml_stop(aml_get_default(), self->timer);
+	self->is_pending = false;
+}
+
+static void fake_screencopy_destroy(struct screencopy* ptr)
+{
+	struct fake_screencopy* self = (struct fake_screencopy*)ptr;
+
+	aml_stop(aml_get_default(), self->timer);
+	aml_unref(self->timer);
+
+	while (!TAILQ_EMPTY(&self->free_buffers)) {
+		struct wv_buffer* buffer = TAILQ_FIRST(&self->free_buffers);
+		TAILQ_REMOVE(&self->free_buffers, buffer, link);
+		LIST_REMOVE(buffer, registry_link);
+		fake_buffer_destroy(buffer);
+	}
+
+	struct wv_buffer* buffer;
+	LIST_FOREACH(buffer, &self->buffers, registry_link)
+		nvnc_fb_set_release_fn(buffer->nvnc_fb,
+				fake_buffer_on_orphan_release, NULL);
+
+	free(self->script);
+	free(self);
+}
+
+void fake_screencopy_get_stats(const struct screencopy* ptr,
+		struct fake_screencopy_stats* stats)
+{
+	const struct fake_screencopy* self =
+		(const struct fake_screencopy*)ptr;
+	*stats = self->stats;
+}
+
+struct screencopy* fake_screencopy_create(
+		const struct fake_screencopy_config* config)
+{
+	struct fake_screencopy* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->parent.impl = &fake_screencopy_impl;
+	self->parent.rate_limit = 30;
+	self->config = *config;
+
+	if (config->script_len > 0) {
+		self->script = calloc(config->script_len,
+				sizeof(*self->script));
+		if (!self->script)
+			goto script_failure;
+		memcpy(self->script, config->script,
+				config->script_len * sizeof(*self->script));
+	}
+	self->config.script = self->script;
+
+	self->timer = aml_timer_new(0, fake_on_timer, self, NULL);
+	if (!self->timer)
+		goto timer_failure;
+
+	LIST_INIT(&self->buffers);
+	TAILQ_INIT(&self->free_buffers);
+
+	return &self->parent;
+
+timer_failure:
+	free(self->script);
+script_failure:
+	free(self);
+	return NULL;
+}
+
+struct screencopy_impl fake_screencopy_impl = {
+	// Frames are generated upright, so there is nothing to transform
+	.caps = SCREENCOPY_CAP_TRANSFORM,
+	// Created with fake_screencopy_create() rather than for an output
+	.create = NULL,
+	.destroy = fake_screencopy_destroy,
+	.start = fake_screencopy_start,
+	.stop = fake_screencopy_stop,
+};
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <neatvnc.h>
+#include <pixman.h>
+
+#include "frame-feed.h"
+#include "buffer.h"
+#include "damage-map.h"
+#include "transform-util.h"
+#include "time-util.h"
+
+static void apply_output_transform(const struct frame_feed* self,
+		struct wv_buffer* buffer, struct pixman_region16* damage)
+{
+	enum wl_output_transform buffer_transform;
+
+	if (buffer->y_inverted) {
+		buffer_transform = wv_output_transform_compose(
+				self->output_transform,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180);
+
+		wv_region_transform(damage, &buffer->frame_damage,
+				WL_OUTPUT_TRANSFORM_FLIPPED_180,
+				buffer->width, buffer->height);
+	} else {
+		buffer_transform = self->output_transform;
+		pixman_region_copy(damage, &buffer->frame_damage);
+	}
+
+	nvnc_fb_set_transform(buffer->nvnc_fb,
+			(enum nvnc_transform)buffer_transform);
+}
+
+void frame_feed_process(struct frame_feed* self, struct wv_buffer* buffer)
+{
+	struct pixman_region16 damage;
+	pixman_region_init(&damage);
+
+	if (self->is_transformed)
+		pixman_region_copy(&damage, &buffer->frame_damage);
+	else
+		apply_output_transform(self, buffer, &damage);
+
+	pixman_region_intersect_rect(&damage, &damage, 0, 0, buffer->width,
+			buffer->height);
+
+	if (self->damage_map && damage_map_resize(self->damage_map,
+				buffer->width, buffer->height) == 0)
+		damage_map_add(self->damage_map, &damage);
+
+	buffer->fed_at_us = gettime_us();
+	self->feed(buffer->nvnc_fb, &damage, self->userdata);
+
+	pixman_region_fini(&damage);
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+
+#include "json-framer.h"
+
+void json_framer_init(struct json_framer* self, size_t initial_size,
+		size_t max_size)
+{
+	memset(self, 0, sizeof(*self));
+	self->size = initial_size < max_size ? initial_size : max_size;
+	self->max_size = max_size;
+}
+
+void json_framer_destroy(struct json_framer* self)
+{
+	free(self->buffer);
+	self->buffer = NULL;
+}
+
+static void json_framer_compact(struct json_framer* self)
+{
+	if (self->head == 0)
+		return;
+
+	size_t len = self->tail - self->head;
+	memmove(self->buffer, self->buffer + self->head, len);
+	self->scan -= self->head;
+	self->tail = len;
+	self->head = 0;
+}
+
+char* json_framer_write_ptr(struct json_framer* self, size_t* space)
+{
+	if (!self->buffer) {
+		self->buffer = malloc(self->size);
+		if (!self->buffer) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	// Everything has been consumed, so start over from the beginning
+	if (self->head == self->tail)
+		self->head = self->tail = self->scan = 0;
+
+	if (self->tail == self->size)
+		json_framer_compact(self);
+
+	if (self->tail == self->size) {
+		if (self->size >= self->max_size) {
+			errno = EMSGSIZE;
+			return NULL;
+		}
+
+		size_t size = self->size * 2;
+		if (size > self->max_size)
+			size = self->max_size;
+
+		char* buffer = realloc(self->buffer, size);
+		if (!buffer) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		self->buffer = buffer;
+		self->size = size;
+	}
+
+	*space = self->size - self->tail;
+	return self->buffer + self->tail;
+}
+
+void json_framer_commit(struct json_framer* self, size_t len)
+{
+	self->tail += len;
+}
+
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static void set_syntax_error(json_error_t* err, const char* text)
+{
+	if (!err)
+		return;
+
+	memset(err, 0, sizeof(*err));
+	snprintf(err->text, sizeof(err->text), "%s", text);
+}
+
+json_t* json_framer_next(struct json_framer* self, json_error_t* err)
+{
+	while (self->scan < self->tail) {
+		char c = self->buffer[self->scan++];
+
+		if (self->in_string) {
+			if (self->escaped)
+				self->escaped = false;
+			else if (c == '\\')
+				self->escaped = true;
+			else if (c == '"')
+				self->in_string = false;
+			continue;
+		}
+
+		if (self->depth == 0) {
+			// Skip whitespace between values
+			if (is_space(c)) {
+				self->head = self->scan;
+				continue;
+			}
+			if (c != '{' && c != '[') {
+				set_syntax_error(err, "Expected an object or array");
+				errno = EINVAL;
+				return NULL;
+			}
+		}
+
+		switch (c) {
+		case '"':
+			self->in_string = true;
+			break;
+		case '{':
+		case '[':
+			self->depth++;
+			break;
+		case '}':
+		case ']':
+			self->depth--;
+			break;
+		}
+
+		if (self->depth > 0)
+			continue;
+
+		const char* start = self->buffer + self->head;
+		size_t len = self->scan - self->head;
+		self->head = self->scan;
+
+		json_t* root = json_loadb(start, len, 0, err);
+		if (!root)
+			errno = EINVAL;
+		return root;
+	}
+
+	errno = EAGAIN;
+	return NULL;
+}
+
+size_t json_framer_pending(const struct json_framer* self)
+{
+	return self->tail - self->head;
+}
+
+size_t json_framer_capacity(const struct json_framer* self)
+{
+	return self->buffer ? self->size : 0;
+}
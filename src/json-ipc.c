@@ -79,7 +79,7 @@ struct jsonipc_request* jsonipc_request_parse_new(json_t* root,
 		char* id = json_dumps(ipc->id, JSON_EMBED | JSON_ENCODE_ANY);
 		jsonipc_error_printf(err, EINVAL,
 				"Invalid ID \"%s\"", id);
-		free(id);
+		jsonipc_free_string(id);
 		goto failure;
 	}
 	return ipc;
@@ -151,7 +151,7 @@ struct jsonipc_response* jsonipc_response_parse_new(json_t* root,
 		char* id = json_dumps(ipc->id, JSON_EMBED | JSON_ENCODE_ANY);
 		jsonipc_error_printf(err, EINVAL,
 				"Invalid ID \"%s\"", id);
-		free(id);
+		jsonipc_free_string(id);
 		goto failure;
 	}
 	return ipc;
@@ -196,6 +196,14 @@ json_t* jsonipc_response_pack(struct jsonipc_response* self, json_error_t* err)
 			jsonipc_data_key, self->data);
 }
 
+void jsonipc_free_string(char* str)
+{
+	json_malloc_t malloc_fn;
+	json_free_t free_fn;
+	json_get_alloc_funcs(&malloc_fn, &free_fn);
+	free_fn(str);
+}
+
 json_t* jprintf(const char* fmt, ...)
 {
 	va_list args;
@@ -33,6 +33,7 @@
 #include "keyboard.h"
 #include "shm.h"
 #include "intset.h"
+#include "mem-stats.h"
 
 #define MAYBE_UNUSED __attribute__((unused))
 
@@ -208,6 +209,10 @@ int keyboard_init(struct keyboard* self, const struct xkb_rule_names* rule_names
 
 	close(keymap_fd);
 
+	self->mem_size = keymap_size +
+		self->lookup_table_size * sizeof(*self->lookup_table);
+	wv_mem_alloc(WV_MEM_KEYMAPS, self->mem_size);
+
 	return 0;
 
 write_failure:
@@ -229,6 +234,9 @@ key_state_failure:
 
 void keyboard_destroy(struct keyboard* self)
 {
+	if (self->mem_size)
+		wv_mem_free(WV_MEM_KEYMAPS, self->mem_size);
+	self->mem_size = 0;
 	free(self->lookup_table);
 	xkb_state_unref(self->state);
 	xkb_keymap_unref(self->keymap);
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <sys/param.h>
+
+#include "load-shedder.h"
+
+// Fewer frames than this in a window says nothing about the load
+#define MIN_FRAMES 2
+#define OVERLOAD_THRESHOLD 1.0
+#define HEALTHY_THRESHOLD 0.5
+#define OVERLOADED_WINDOWS 3
+#define HEALTHY_WINDOWS 5
+// Releases are dispatched from the main loop, so they may trail the next frame
+// a little even when encoding finished in time
+#define BACKLOG_SLACK_US 2000
+
+void load_shedder_init(struct load_shedder* self, int rate)
+{
+	*self = (struct load_shedder){
+		.configured_rate = rate,
+		.rate = rate,
+	};
+}
+
+void load_shedder_set_rate(struct load_shedder* self, int rate)
+{
+	bool is_reduced = self->rate < self->configured_rate;
+	self->configured_rate = rate;
+	self->rate = is_reduced ? MIN(self->rate, rate) : rate;
+}
+
+static double window_cost_us(const struct load_window* window)
+{
+	double cost = (double)window->process_us / window->n_frames;
+	if (window->n_released)
+		cost += (double)window->backlog_us / window->n_released;
+	return cost;
+}
+
+static enum load_action shed(struct load_shedder* self)
+{
+	if (self->rate > LOAD_SHEDDER_MIN_RATE) {
+		self->rate = MAX(self->rate * 3 / 4, LOAD_SHEDDER_MIN_RATE);
+		return LOAD_ACTION_LOWER_RATE;
+	}
+
+	if (!self->is_admission_closed) {
+		self->is_admission_closed = true;
+		return LOAD_ACTION_CLOSE_ADMISSION;
+	}
+
+	return LOAD_ACTION_SHED_CLIENT;
+}
+
+static enum load_action recover(struct load_shedder* self)
+{
+	if (self->is_admission_closed) {
+		self->is_admission_closed = false;
+		return LOAD_ACTION_OPEN_ADMISSION;
+	}
+
+	if (self->rate < self->configured_rate) {
+		self->rate = MIN(self->rate * 4 / 3 + 1, self->configured_rate);
+		return LOAD_ACTION_RAISE_RATE;
+	}
+
+	return LOAD_ACTION_NONE;
+}
+
+enum load_action load_shedder_update(struct load_shedder* self,
+		const struct load_window* window)
+{
+	self->load = 0;
+	if (window->n_frames >= MIN_FRAMES && self->rate > 0)
+		self->load = window_cost_us(window) * self->rate / 1e6;
+
+	if (self->load > OVERLOAD_THRESHOLD) {
+		self->n_healthy = 0;
+		if (++self->n_overloaded < OVERLOADED_WINDOWS)
+			return LOAD_ACTION_NONE;
+		self->n_overloaded = 0;
+		return shed(self);
+	}
+
+	self->n_overloaded = 0;
+
+	if (self->load >= HEALTHY_THRESHOLD) {
+		self->n_healthy = 0;
+		return LOAD_ACTION_NONE;
+	}
+
+	if (++self->n_healthy < HEALTHY_WINDOWS)
+		return LOAD_ACTION_NONE;
+	self->n_healthy = 0;
+	return recover(self);
+}
+
+const char* load_action_name(enum load_action action)
+{
+	switch (action) {
+	case LOAD_ACTION_NONE: return "none";
+	case LOAD_ACTION_LOWER_RATE: return "rate-lowered";
+	case LOAD_ACTION_CLOSE_ADMISSION: return "admission-closed";
+	case LOAD_ACTION_SHED_CLIENT: return "client-disconnected";
+	case LOAD_ACTION_OPEN_ADMISSION: return "admission-opened";
+	case LOAD_ACTION_RAISE_RATE: return "rate-raised";
+	}
+	return "unknown";
+}
+
+uint64_t encode_backlog_feed(struct encode_backlog* self, uint64_t now)
+{
+	uint64_t seq = ++self->n_fed;
+	self->feed_times[seq % ENCODE_BACKLOG_HISTORY] = now;
+	return seq;
+}
+
+uint64_t encode_backlog_release(const struct encode_backlog* self,
+		uint64_t seq, uint64_t fed_at, uint64_t now)
+{
+	// Not replaced yet, so the display is still holding it
+	if (!seq || seq >= self->n_fed)
+		return 0;
+
+	// So far behind that the time it was replaced has been forgotten
+	if (self->n_fed - seq >= ENCODE_BACKLOG_HISTORY)
+		return now - fed_at;
+
+	uint64_t replaced_at =
+		self->feed_times[(seq + 1) % ENCODE_BACKLOG_HISTORY];
+	return now > replaced_at + BACKLOG_SLACK_US ? now - fed_at : 0;
+}
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <neatvnc.h>
+
+#include "log.h"
+#include "strlcpy.h"
+
+#define LOG_RING_SIZE 256 // Must be a power of two
+#define LOG_MESSAGE_MAX 512
+
+int wv__log_level = NVNC_LOG_WARNING;
+
+/*
+ * This is a bounded multi-producer queue as described by Dmitry Vyukov. Each
+ * slot carries a sequence number that tells producers and the consumer whose
+ * turn it is to use the slot, so no locks are needed.
+ */
+struct log_slot {
+	atomic_size_t seq;
+	struct nvnc_log_data meta;
+	char message[LOG_MESSAGE_MAX];
+	// Copy of a record that does not fit into the slot, if any
+	char* long_message;
+};
+
+struct log_ring {
+	struct log_slot slots[LOG_RING_SIZE];
+	atomic_size_t head;
+	size_t tail;
+	atomic_uint dropped;
+	atomic_bool is_running;
+	// Held by whoever is consuming from the ring
+	pthread_mutex_t drain_lock;
+	sem_t wakeup;
+	pthread_t thread;
+};
+
+static struct log_ring* ring = NULL;
+
+void wv_log_set_level(enum nvnc_log_level level)
+{
+	wv__log_level = level;
+	nvnc_set_log_level(level);
+}
+
+static void log_truncate(char* dst, size_t size, const char* message,
+		size_t len)
+{
+	char marker[32];
+	size_t kept = size - 1 - sizeof(marker);
+	snprintf(marker, sizeof(marker), " [truncated %zu bytes]",
+			len - kept);
+	memcpy(dst, message, kept);
+	strlcpy(dst + kept, marker, size - kept);
+}
+
+static bool log_ring_push(struct log_ring* self,
+		const struct nvnc_log_data* meta, const char* message)
+{
+	size_t pos = atomic_load_explicit(&self->head, memory_order_relaxed);
+	struct log_slot* slot;
+
+	for (;;) {
+		slot = &self->slots[pos & (LOG_RING_SIZE - 1)];
+		size_t seq = atomic_load_explicit(&slot->seq,
+				memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&self->head,
+						&pos, pos + 1,
+						memory_order_relaxed,
+						memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = atomic_load_explicit(&self->head,
+					memory_order_relaxed);
+		}
+	}
+
+	slot->meta = *meta;
+	slot->long_message = NULL;
+
+	size_t len = strlen(message);
+	if (len < sizeof(slot->message))
+		strlcpy(slot->message, message, sizeof(slot->message));
+	else if (!(slot->long_message = strdup(message)))
+		log_truncate(slot->message, sizeof(slot->message), message,
+				len);
+
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+	return true;
+}
+
+static struct log_slot* log_ring_peek(struct log_ring* self)
+{
+	struct log_slot* slot = &self->slots[self->tail & (LOG_RING_SIZE - 1)];
+	size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+	return seq == self->tail + 1 ? slot : NULL;
+}
+
+static void log_ring_pop(struct log_ring* self, struct log_slot* slot)
+{
+	atomic_store_explicit(&slot->seq, self->tail + LOG_RING_SIZE,
+			memory_order_release);
+	self->tail++;
+}
+
+static void log_ring_report_dropped(struct log_ring* self)
+{
+	unsigned int dropped = atomic_exchange(&self->dropped, 0);
+	if (dropped == 0)
+		return;
+
+	struct nvnc_log_data meta = {
+		.level = NVNC_LOG_WARNING,
+		.file = __FILE__,
+		.line = __LINE__,
+	};
+	char message[64];
+	snprintf(message, sizeof(message), "Dropped %u log messages", dropped);
+	nvnc_default_logger(&meta, message);
+}
+
+static void log_ring_drain_locked(struct log_ring* self)
+{
+	struct log_slot* slot;
+	while ((slot = log_ring_peek(self))) {
+		nvnc_default_logger(&slot->meta, slot->long_message ?
+				slot->long_message : slot->message);
+		free(slot->long_message);
+		slot->long_message = NULL;
+		log_ring_pop(self, slot);
+	}
+	log_ring_report_dropped(self);
+}
+
+static void log_ring_drain(struct log_ring* self)
+{
+	pthread_mutex_lock(&self->drain_lock);
+	log_ring_drain_locked(self);
+	pthread_mutex_unlock(&self->drain_lock);
+}
+
+/* Writes a record from the calling thread, after everything that was queued
+ * before it, so that ordering is kept.
+ */
+static void log_ring_write_sync(struct log_ring* self,
+		const struct nvnc_log_data* meta, const char* message)
+{
+	pthread_mutex_lock(&self->drain_lock);
+	log_ring_drain_locked(self);
+	nvnc_default_logger(meta, message);
+	pthread_mutex_unlock(&self->drain_lock);
+}
+
+static void* log_thread_main(void* userdata)
+{
+	struct log_ring* self = userdata;
+
+	while (atomic_load(&self->is_running)) {
+		sem_wait(&self->wakeup);
+		log_ring_drain(self);
+	}
+
+	log_ring_drain(self);
+	return NULL;
+}
+
+static void log_async_fn(const struct nvnc_log_data* meta,
+		const char* message)
+{
+	/* Panics are followed by abort(), so the queued messages leading up to
+	 * them must be written first.
+	 */
+	if (meta->level == NVNC_LOG_PANIC) {
+		log_ring_write_sync(ring, meta, message);
+		return;
+	}
+
+	if (!log_ring_push(ring, meta, message)) {
+		atomic_fetch_add_explicit(&ring->dropped, 1,
+				memory_order_relaxed);
+		return;
+	}
+
+	sem_post(&ring->wakeup);
+}
+
+int wv_log_async_start(void)
+{
+	if (ring)
+		return 0;
+
+	struct log_ring* self = calloc(1, sizeof(*self));
+	if (!self)
+		return -1;
+
+	for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+		atomic_init(&self->slots[i].seq, i);
+
+	atomic_init(&self->is_running, true);
+
+	if (pthread_mutex_init(&self->drain_lock, NULL) != 0)
+		goto mutex_failure;
+
+	if (sem_init(&self->wakeup, 0, 0) < 0)
+		goto sem_failure;
+
+	if (pthread_create(&self->thread, NULL, log_thread_main, self) != 0)
+		goto thread_failure;
+
+	ring = self;
+	nvnc_set_log_fn(log_async_fn);
+	return 0;
+
+thread_failure:
+	sem_destroy(&self->wakeup);
+sem_failure:
+	pthread_mutex_destroy(&self->drain_lock);
+mutex_failure:
+	free(self);
+	return -1;
+}
+
+void wv_log_async_stop(void)
+{
+	if (!ring)
+		return;
+
+	nvnc_set_log_fn(nvnc_default_logger);
+
+	atomic_store(&ring->is_running, false);
+	sem_post(&ring->wakeup);
+	pthread_join(ring->thread, NULL);
+
+	sem_destroy(&ring->wakeup);
+	pthread_mutex_destroy(&ring->drain_lock);
+	free(ring);
+	ring = NULL;
+}
@@ -36,6 +36,7 @@
 #include <fcntl.h>
 
 #include "wlr-screencopy-unstable-v1.h"
+#include "wlr-export-dmabuf-unstable-v1.h"
 #include "ext-image-copy-capture-v1.h"
 #include "ext-image-capture-source-v1.h"
 #include "wlr-virtual-pointer-unstable-v1.h"
@@ -54,13 +55,21 @@
 #include "keyboard.h"
 #include "seat.h"
 #include "cfg.h"
-#include "transform-util.h"
+#include "time-util.h"
 #include "usdt.h"
 #include "ctl-server.h"
 #include "util.h"
 #include "option-parser.h"
 #include "pixels.h"
 #include "buffer.h"
+#include "log.h"
+#include "mem-stats.h"
+#include "damage-map.h"
+#include "frame-feed.h"
+#include "perf-stats.h"
+#include "capture-tuner.h"
+#include "realtime.h"
+#include "load-shedder.h"
 
 #ifdef ENABLE_PAM
 #include "pam_auth.h"
@@ -69,6 +78,22 @@
 #define DEFAULT_ADDRESS "127.0.0.1"
 #define DEFAULT_PORT 5900
 
+#define DAMAGE_MAP_TIME_CONSTANT 10.0 // seconds
+#define SPARE_CAPTURE_BUFFERS 1
+#define SPARE_CURSOR_BUFFERS 1
+#define TRANSIENT_SEAT_POOL_SIZE 2
+#define CAPTURE_TUNING_TIMEOUT_US 2000000 // per candidate
+#define PERF_LOG_INTERVAL_MS 1000
+#define LOOP_STALL_THRESHOLD_US 32000 // Two frames at 60 Hz
+#define CAPTURE_RETRY_DELAY_US 100000
+#define CAPTURE_WATCHDOG_MIN_US 1000000
+#define CAPTURE_WATCHDOG_TICK_US 250000
+#define CAPTURE_RECOVERY_MAX_US 10000000
+#define LOAD_WINDOW_US 1000000
+#define UPDATE_LATENCY_SAMPLES 128
+#define UPDATE_RATE_WINDOW_US 1000000
+#define DEFAULT_REALTIME_PRIORITY 10
+
 #define XSTR(x) STR(x)
 #define STR(x) #x
 
@@ -83,6 +108,21 @@ enum socket_type {
 	SOCKET_TYPE_FROM_FD,
 };
 
+// These may be changed at runtime via the control socket
+struct capture_params {
+	int max_rate;
+	int cursor_max_rate;
+	int n_spare_buffers;
+	bool overlay_cursor;
+	bool enable_gpu_features;
+};
+
+struct transient_seat_slot {
+	struct ext_transient_seat_v1* handle;
+	uint32_t global_name;
+	bool is_ready;
+};
+
 struct wayvnc {
 	bool do_exit;
 
@@ -97,6 +137,8 @@ struct wayvnc {
 	struct zwlr_virtual_pointer_manager_v1* pointer_manager;
 	struct zwlr_data_control_manager_v1* data_control_manager;
 	struct ext_transient_seat_manager_v1* transient_seat_manager;
+	struct transient_seat_slot
+		transient_seat_pool[TRANSIENT_SEAT_POOL_SIZE];
 
 	struct output* selected_output;
 	struct seat* selected_seat;
@@ -115,27 +157,77 @@ struct wayvnc {
 	uint32_t damage_area_sum;
 	uint32_t n_frames_captured;
 
+	bool enable_damage_map;
+	struct damage_map damage_map;
+
+	struct frame_feed frame_feed;
+	// Held by the display until the next frame replaces it
+	struct wv_buffer* displayed_buffer;
+
 	bool disable_input;
+	bool disable_primary_selection;
+	size_t clipboard_max_size;
 	bool use_transient_seat;
+	bool high_density;
 
 	int nr_clients;
 	struct aml_ticker* performance_ticker;
+	uint32_t performance_period_ms;
+	bool show_performance;
+	// --show-performance keeps its own window on its own cadence
+	struct aml_ticker* perf_log_ticker;
+	uint32_t log_frames_captured;
+	uint32_t log_damage_area_sum;
+	uint32_t sample_interval_ms;
+	uint64_t perf_window_start;
+	uint64_t perf_last_misses;
+	uint32_t n_loop_stalls;
 
 	struct aml_timer* capture_retry_timer;
 
+	// Zero disables the watchdog
+	uint32_t capture_watchdog_periods;
+	struct aml_ticker* capture_watchdog;
+	uint64_t last_capture_activity_us;
+	// Set while waiting for a forced capture to complete
+	uint64_t capture_probe_start_us;
+	uint64_t capture_recovery_delay_us;
+	uint32_t n_capture_stalls;
+	uint32_t n_capture_stalls_total;
+
+	bool enable_load_shedding;
+	// Zero means unlimited
+	int max_clients;
+	struct load_shedder load_shedder;
+	struct load_window load_window;
+	struct aml_ticker* load_ticker;
+	uint64_t load_last_released;
+	uint64_t load_last_backlog_us;
+	struct aml_timer* admission_timer;
+
 	struct ctl* ctl;
 	bool is_initializing;
 
 	bool start_detached;
-	bool overlay_cursor;
-	int max_rate;
-	bool enable_gpu_features;
+	struct capture_params capture;
+	// As given at startup
+	struct capture_params default_capture;
+	bool zero_copy;
 	bool enable_resizing;
 
 	struct wayvnc_client* master_layout_client;
 
 	struct wayvnc_client* cursor_master;
 	struct screencopy* cursor_sc;
+
+	bool auto_tune;
+	bool is_tuning;
+	bool have_capture_choice;
+	struct capture_choice capture_choice;
+	const char* capture_choice_source;
+	struct capture_tuner tuner;
+	struct aml_timer* tuning_timer;
+	uint64_t compositor_identity;
 };
 
 struct wayvnc_client {
@@ -149,6 +241,26 @@ struct wayvnc_client {
 	struct pointer pointer;
 	struct keyboard keyboard;
 	struct data_control data_control;
+	bool cursor_sc_pending;
+
+	uint64_t connected_at;
+	uint64_t last_input_at;
+	uint32_t n_pointer_events;
+	uint32_t n_key_events;
+	uint64_t clipboard_bytes;
+
+	uint64_t n_update_requests;
+	uint64_t update_window_start;
+	uint32_t update_window_count;
+	double updates_per_second;
+	// When the first frame after the client's last update request was fed
+	uint64_t frame_pending_since;
+	uint64_t n_update_latencies;
+	uint32_t update_latencies[UPDATE_LATENCY_SAMPLES];
+
+	// Turned away on arrival; closed from the main loop, as neatvnc has
+	// already accepted it
+	bool is_refused;
 };
 
 void wayvnc_exit(struct wayvnc* self);
@@ -163,14 +275,27 @@ void switch_to_prev_output(struct wayvnc*);
 static void client_init_seat(struct wayvnc_client* self);
 static void client_init_pointer(struct wayvnc_client* self);
 static void client_init_keyboard(struct wayvnc_client* self);
+static void client_init_keyboard_lazily(struct wayvnc_client* self);
+static void client_start_cursor_capture(struct wayvnc_client* self);
 static void client_init_data_control(struct wayvnc_client* self);
 static void client_detach_wayland(struct wayvnc_client* self);
+static void transient_seat_pool_fill(struct wayvnc* self);
+static void transient_seat_pool_destroy(struct wayvnc* self);
 static int blank_screen(struct wayvnc* self);
 static bool wayland_attach(struct wayvnc* self, const char* display,
 		const char* output);
 static void wayland_detach(struct wayvnc* self);
+static void update_performance_ticker(struct wayvnc* self);
+static void update_capture_watchdog(struct wayvnc* self);
+static void update_load_ticker(struct wayvnc* self);
+static int effective_max_rate(const struct wayvnc* self);
+static void cancel_capture_tuning(struct wayvnc* self);
+static void schedule_tuning_step(struct wayvnc* self, uint64_t timeout_us);
+static void start_capture_tuning(struct wayvnc* self);
 static bool configure_cursor_sc(struct wayvnc* self,
 		struct wayvnc_client* client);
+bool configure_screencopy(struct wayvnc* self);
+int wayvnc_start_capture_immediate(struct wayvnc* self);
 
 struct wl_shm* wl_shm = NULL;
 struct zwp_linux_dmabuf_v1* zwp_linux_dmabuf = NULL;
@@ -180,6 +305,7 @@ struct zwlr_screencopy_manager_v1* screencopy_manager = NULL;
 struct ext_output_image_capture_source_manager_v1*
 		ext_output_image_capture_source_manager = NULL;
 struct ext_image_copy_capture_manager_v1* ext_image_copy_capture_manager = NULL;
+struct zwlr_export_dmabuf_manager_v1* export_dmabuf_manager = NULL;
 
 extern struct screencopy_impl wlr_screencopy_impl, ext_image_copy_capture_impl;
 
@@ -237,12 +363,30 @@ static bool registry_add_input(void* data, struct wl_registry* registry,
 	return false;
 }
 
+// Outputs and seats come and go, so they are not part of the identity
+static uint64_t global_fingerprint(const char* interface, uint32_t version)
+{
+	if (strcmp(interface, wl_output_interface.name) == 0 ||
+			strcmp(interface, wl_seat_interface.name) == 0)
+		return 0;
+
+	// FNV-1a
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	for (const char* c = interface; *c; ++c)
+		hash = (hash ^ (uint8_t)*c) * UINT64_C(0x100000001b3);
+	hash = (hash ^ version) * UINT64_C(0x100000001b3);
+	return hash;
+}
+
 static void registry_add(void* data, struct wl_registry* registry,
 			 uint32_t id, const char* interface,
 			 uint32_t version)
 {
 	struct wayvnc* self = data;
 
+	// Summed so that the order in which globals are announced is irrelevant
+	self->compositor_identity += global_fingerprint(interface, version);
+
 	if (strcmp(interface, wl_output_interface.name) == 0) {
 		nvnc_trace("Registering new output %u", id);
 		struct wl_output* wl_output =
@@ -299,6 +443,14 @@ static void registry_add(void* data, struct wl_registry* registry,
 		return;
 	}
 
+	if (strcmp(interface, zwlr_export_dmabuf_manager_v1_interface.name) == 0) {
+		export_dmabuf_manager =
+			wl_registry_bind(registry, id,
+					 &zwlr_export_dmabuf_manager_v1_interface,
+					 1);
+		return;
+	}
+
 #if 1
 	if (strcmp(interface, ext_image_copy_capture_manager_v1_interface.name) == 0) {
 		ext_image_copy_capture_manager =
@@ -393,6 +545,10 @@ static void wayland_detach(struct wayvnc* self)
 	if (!self->display)
 		return;
 
+	cancel_capture_tuning(self);
+	self->have_capture_choice = false;
+	self->compositor_identity = 0;
+
 	aml_stop(aml_get_default(), self->wl_handler);
 	aml_unref(self->wl_handler);
 	self->wl_handler = NULL;
@@ -453,16 +609,14 @@ static void wayland_detach(struct wayvnc* self)
 		zwlr_data_control_manager_v1_destroy(self->data_control_manager);
 	self->data_control_manager = NULL;
 
-	if (self->performance_ticker) {
-		aml_stop(aml_get_default(), self->performance_ticker);
-		aml_unref(self->performance_ticker);
-	}
-	self->performance_ticker = NULL;
-
 	if (screencopy_manager)
 		zwlr_screencopy_manager_v1_destroy(screencopy_manager);
 	screencopy_manager = NULL;
 
+	if (export_dmabuf_manager)
+		zwlr_export_dmabuf_manager_v1_destroy(export_dmabuf_manager);
+	export_dmabuf_manager = NULL;
+
 	if (ext_output_image_capture_source_manager)
 		ext_output_image_capture_source_manager_v1_destroy(
 				ext_output_image_capture_source_manager);
@@ -476,8 +630,11 @@ static void wayland_detach(struct wayvnc* self)
 		aml_unref(self->capture_retry_timer);
 	self->capture_retry_timer = NULL;
 
+	transient_seat_pool_destroy(self);
+
 	if (self->transient_seat_manager)
 		ext_transient_seat_manager_v1_destroy(self->transient_seat_manager);
+	self->transient_seat_manager = NULL;
 
 	wl_registry_destroy(self->registry);
 	self->registry = NULL;
@@ -485,12 +642,23 @@ static void wayland_detach(struct wayvnc* self)
 	wl_display_disconnect(self->display);
 	self->display = NULL;
 
+	update_performance_ticker(self);
+	update_capture_watchdog(self);
+	update_load_ticker(self);
+
 	if (self->ctl)
 		ctl_server_event_detached(self->ctl);
 }
 
 void wayvnc_destroy(struct wayvnc* self)
 {
+	if (self->admission_timer) {
+		aml_stop(aml_get_default(), self->admission_timer);
+		aml_unref(self->admission_timer);
+		self->admission_timer = NULL;
+	}
+
+	damage_map_destroy(&self->damage_map);
 	cfg_destroy(&self->cfg);
 	wayland_detach(self);
 }
@@ -525,6 +693,7 @@ void on_wayland_event(void* obj)
 static int init_wayland(struct wayvnc* self, const char* display)
 {
 	self->is_initializing = true;
+	self->compositor_identity = 0;
 	static const struct wl_registry_listener registry_listener = {
 		.global = registry_add,
 		.global_remove = registry_remove,
@@ -580,6 +749,9 @@ static int init_wayland(struct wayvnc* self, const char* display)
 		goto failure;
 	}
 
+	if (self->use_transient_seat)
+		transient_seat_pool_fill(self);
+
 	self->wl_handler = aml_handler_new(wl_display_get_fd(self->display),
 	                             on_wayland_event, self, NULL);
 	if (!self->wl_handler)
@@ -645,8 +817,13 @@ static struct ctl_server_client *client_next(struct ctl* ctl,
 	struct wayvnc* self = ctl_server_userdata(ctl);
 	struct nvnc_client* vnc_prev = (struct nvnc_client*)prev;
 
-	return prev ? (struct ctl_server_client*)nvnc_client_next(vnc_prev) :
-		(struct ctl_server_client*)nvnc_client_first(self->nvnc);
+	struct nvnc_client* client = prev ? nvnc_client_next(vnc_prev) :
+		nvnc_client_first(self->nvnc);
+	while (client && ((struct wayvnc_client*)
+				nvnc_get_userdata(client))->is_refused)
+		client = nvnc_client_next(client);
+
+	return (struct ctl_server_client*)client;
 }
 
 static void compose_client_info(const struct wayvnc_client* client,
@@ -658,6 +835,90 @@ static void compose_client_info(const struct wayvnc_client* client,
 			(struct sockaddr*)&info->address_storage, &addrlen);
 	info->username = nvnc_client_get_auth_username(client->nvnc_client);
 	info->seat = client->seat ? client->seat->name : NULL;
+
+	uint64_t now = gettime_us();
+	info->connected_us = now - client->connected_at;
+	info->idle_us = now - client->last_input_at;
+	info->n_pointer_events = client->n_pointer_events;
+	info->n_key_events = client->n_key_events;
+	info->clipboard_bytes = client->clipboard_bytes;
+
+	info->n_update_requests = client->n_update_requests;
+	uint64_t window = now - client->update_window_start;
+	// A client that stopped asking never completes another window
+	info->updates_per_second = window >= UPDATE_RATE_WINDOW_US ?
+		client->update_window_count * 1e6 / window :
+		client->updates_per_second;
+
+	// Both the average and the percentile cover the latest samples
+	if (client->n_update_latencies > 0) {
+		uint32_t samples[UPDATE_LATENCY_SAMPLES];
+		uint32_t n = MIN(client->n_update_latencies,
+				UPDATE_LATENCY_SAMPLES);
+		memcpy(samples, client->update_latencies,
+				n * sizeof(samples[0]));
+
+		uint64_t sum = 0;
+		for (uint32_t i = 0; i < n; ++i)
+			sum += samples[i];
+		info->update_latency_avg_us = sum / n;
+		info->update_latency_p99_us = wv_perf_percentile(samples, n,
+				99);
+	}
+}
+
+/* Clients ask for the next update once they have received the previous one,
+ * so the time from a frame being fed until the next request covers encoding,
+ * transmission and decoding for that client.
+ */
+static void on_fb_update_request(struct nvnc_client* client,
+		bool is_incremental, uint16_t x, uint16_t y, uint16_t width,
+		uint16_t height)
+{
+	struct wayvnc_client* wv_client = nvnc_get_userdata(client);
+	if (!wv_client)
+		return;
+
+	uint64_t now = gettime_us();
+	wv_client->n_update_requests++;
+
+	uint64_t window = now - wv_client->update_window_start;
+	if (window >= UPDATE_RATE_WINDOW_US) {
+		wv_client->updates_per_second =
+			wv_client->update_window_count * 1e6 / window;
+		wv_client->update_window_start = now;
+		wv_client->update_window_count = 0;
+	}
+	wv_client->update_window_count++;
+
+	if (!wv_client->frame_pending_since)
+		return;
+
+	uint64_t latency = now - wv_client->frame_pending_since;
+	wv_client->frame_pending_since = 0;
+
+	wv_client->update_latencies[wv_client->n_update_latencies %
+		UPDATE_LATENCY_SAMPLES] = MIN(latency, UINT32_MAX);
+	wv_client->n_update_latencies++;
+}
+
+static void mark_frame_pending(struct wayvnc* self, uint64_t now)
+{
+	struct nvnc_client* client;
+	for (client = nvnc_client_first(self->nvnc); client;
+			client = nvnc_client_next(client)) {
+		struct wayvnc_client* wv_client = nvnc_get_userdata(client);
+		if (wv_client && !wv_client->frame_pending_since)
+			wv_client->frame_pending_since = now;
+	}
+}
+
+static void feed_display(struct nvnc_fb* fb, struct pixman_region16* damage,
+		void* userdata)
+{
+	struct wayvnc* self = userdata;
+	mark_frame_pending(self, gettime_us());
+	nvnc_display_feed_buffer(self->nvnc_display, fb, damage);
 }
 
 static void client_info(const struct ctl_server_client* client_handle,
@@ -718,6 +979,133 @@ static struct cmd_response* on_disconnect_client(struct ctl* ctl,
 	return cmd_failed("No such client with ID \"%s\"", id_string);
 }
 
+static const struct damage_map* get_damage_map(struct ctl* ctl)
+{
+	struct wayvnc* self = ctl_server_userdata(ctl);
+	return self->enable_damage_map ? &self->damage_map : NULL;
+}
+
+static void get_capture_info(struct ctl* ctl,
+		struct ctl_server_capture_info* info)
+{
+	struct wayvnc* self = ctl_server_userdata(ctl);
+
+	if (self->screencopy) {
+		info->backend = screencopy_backend_name(
+				screencopy_get_backend(self->screencopy));
+		info->buffer_type = self->screencopy->enable_linux_dmabuf ?
+			"dmabuf" : "shm";
+	}
+
+	if (self->is_tuning)
+		info->selection = "tuning";
+	else if (self->have_capture_choice)
+		info->selection = self->capture_choice_source;
+	else
+		info->selection = "default";
+
+	info->compositor_identity = self->compositor_identity;
+	info->n_stalls = self->n_capture_stalls_total;
+
+	const struct capture_tuner* tuner = &self->tuner;
+	int n = MIN(tuner->current, tuner->n_candidates);
+	n = MIN(n, (int)(sizeof(info->results) / sizeof(info->results[0])));
+	for (int i = 0; i < n; ++i) {
+		const struct capture_tuner_result* result = &tuner->results[i];
+		info->results[i].backend =
+			screencopy_backend_name(result->choice.backend);
+		info->results[i].buffer_type = result->choice.linux_dmabuf ?
+			"dmabuf" : "shm";
+		info->results[i].n_frames = result->n_frames;
+		info->results[i].latency_us = result->latency_us;
+		info->results[i].cpu_us = result->cpu_us;
+	}
+	info->n_results = n;
+
+	info->params.max_fps = self->capture.max_rate;
+	info->params.cursor_max_fps = self->capture.cursor_max_rate;
+	info->params.spare_buffers = self->capture.n_spare_buffers;
+	info->params.render_cursor = self->capture.overlay_cursor;
+	info->params.gpu = self->capture.enable_gpu_features;
+}
+
+static struct cmd_response* on_capture_set(struct ctl* ctl,
+		const struct ctl_server_capture_params* params, bool reset)
+{
+	struct wayvnc* self = ctl_server_userdata(ctl);
+	struct capture_params old = self->capture;
+
+	if (reset)
+		self->capture = self->default_capture;
+
+	if (params->max_fps >= 0)
+		self->capture.max_rate = params->max_fps;
+	if (params->cursor_max_fps >= 0)
+		self->capture.cursor_max_rate = params->cursor_max_fps;
+	if (params->spare_buffers >= 0)
+		self->capture.n_spare_buffers = params->spare_buffers;
+	if (params->render_cursor >= 0)
+		self->capture.overlay_cursor = params->render_cursor;
+	if (params->gpu >= 0)
+		self->capture.enable_gpu_features = params->gpu;
+
+	load_shedder_set_rate(&self->load_shedder, self->capture.max_rate);
+
+	nvnc_log(NVNC_LOG_INFO, "Capture parameters: max-fps=%d cursor-max-fps=%d spare-buffers=%d render-cursor=%s gpu=%s",
+			self->capture.max_rate, self->capture.cursor_max_rate,
+			self->capture.n_spare_buffers,
+			self->capture.overlay_cursor ? "true" : "false",
+			self->capture.enable_gpu_features ? "true" : "false");
+
+	if (self->cursor_sc)
+		self->cursor_sc->rate_limit = self->capture.cursor_max_rate;
+
+	bool needs_new_session =
+		old.overlay_cursor != self->capture.overlay_cursor ||
+		old.enable_gpu_features != self->capture.enable_gpu_features;
+
+	if (old.enable_gpu_features != self->capture.enable_gpu_features) {
+		// A tuned choice of buffer type no longer applies
+		cancel_capture_tuning(self);
+		self->have_capture_choice = false;
+	}
+
+	if (!self->screencopy)
+		return cmd_ok();
+
+	if (!needs_new_session) {
+		// Both are read whenever the next frame is scheduled
+		self->screencopy->rate_limit = effective_max_rate(self);
+		self->screencopy->n_spare_buffers =
+			self->capture.n_spare_buffers;
+		return cmd_ok();
+	}
+
+	// Viewers keep the last complete frame until the new session
+	// delivers one.
+	if (!configure_screencopy(self)) {
+		// Fall back to the session that was working before
+		self->capture = old;
+		load_shedder_set_rate(&self->load_shedder,
+				self->capture.max_rate);
+		if (self->cursor_sc)
+			self->cursor_sc->rate_limit =
+				self->capture.cursor_max_rate;
+
+		if (!configure_screencopy(self))
+			nvnc_log(NVNC_LOG_ERROR, "Failed to restore previous capture parameters");
+		else if (self->nr_clients > 0)
+			wayvnc_start_capture_immediate(self);
+
+		return cmd_failed("Failed to reconfigure capturing");
+	}
+
+	if (self->nr_clients > 0)
+		wayvnc_start_capture_immediate(self);
+
+	return cmd_ok();
+}
+
 static struct cmd_response* on_wayvnc_exit(struct ctl* ctl)
 {
 	struct wayvnc* self = ctl_server_userdata(ctl);
@@ -749,6 +1137,15 @@ static void on_pointer_event(struct nvnc_client* client, uint16_t x, uint16_t y,
 	struct wayvnc_client* wv_client = nvnc_get_userdata(client);
 	struct wayvnc* wayvnc = wv_client->server;
 
+	if (wv_client->is_refused)
+		return;
+
+	wv_client->n_pointer_events++;
+	wv_client->last_input_at = gettime_us();
+
+	if (wv_client->cursor_sc_pending)
+		client_start_cursor_capture(wv_client);
+
 	if (!wv_client->pointer.pointer) {
 		return;
 	}
@@ -763,6 +1160,16 @@ static void on_key_event(struct nvnc_client* client, uint32_t symbol,
                          bool is_pressed)
 {
 	struct wayvnc_client* wv_client = nvnc_get_userdata(client);
+
+	if (wv_client->is_refused)
+		return;
+
+	wv_client->n_key_events++;
+	wv_client->last_input_at = gettime_us();
+
+	if (!wv_client->keyboard.virtual_keyboard)
+		client_init_keyboard_lazily(wv_client);
+
 	if (!wv_client->keyboard.virtual_keyboard) {
 		return;
 	}
@@ -777,6 +1184,16 @@ static void on_key_code_event(struct nvnc_client* client, uint32_t code,
 		bool is_pressed)
 {
 	struct wayvnc_client* wv_client = nvnc_get_userdata(client);
+
+	if (wv_client->is_refused)
+		return;
+
+	wv_client->n_key_events++;
+	wv_client->last_input_at = gettime_us();
+
+	if (!wv_client->keyboard.virtual_keyboard)
+		client_init_keyboard_lazily(wv_client);
+
 	if (!wv_client->keyboard.virtual_keyboard) {
 		return;
 	}
@@ -792,6 +1209,11 @@ static void on_client_cut_text(struct nvnc_client* nvnc_client,
 {
 	struct wayvnc_client* client = nvnc_get_userdata(nvnc_client);
 
+	if (client->is_refused)
+		return;
+
+	client->clipboard_bytes += len;
+
 	if (client->data_control.manager) {
 		data_control_to_clipboard(&client->data_control, text, len);
 	}
@@ -803,6 +1225,9 @@ static bool on_client_resize(struct nvnc_client* nvnc_client,
 	struct wayvnc_client* client = nvnc_get_userdata(nvnc_client);
 	struct wayvnc* self = client->server;
 
+	if (client->is_refused)
+		return false;
+
 	uint16_t width = nvnc_desktop_layout_get_width(layout);
 	uint16_t height = nvnc_desktop_layout_get_height(layout);
 	struct output* output = client->server->selected_output;
@@ -876,6 +1301,7 @@ static int blank_screen(struct wayvnc* self)
 			nvnc_fb_get_height(placeholder_fb));
 
 	nvnc_display_feed_buffer(self->nvnc_display, placeholder_fb, &damage);
+	self->displayed_buffer = NULL;
 	pixman_region_fini(&damage);
 	nvnc_fb_unref(placeholder_fb);
 	return 0;
@@ -931,6 +1357,9 @@ static int init_nvnc(struct wayvnc* self, const char* addr, uint16_t port,
 
 	nvnc_add_display(self->nvnc, self->nvnc_display);
 
+	self->frame_feed.feed = feed_display;
+	self->frame_feed.userdata = self;
+
 	nvnc_set_userdata(self->nvnc, self, NULL);
 
 	nvnc_set_name(self->nvnc, "WayVNC");
@@ -986,6 +1415,7 @@ static int init_nvnc(struct wayvnc* self, const char* addr, uint16_t port,
 
 	nvnc_set_new_client_fn(self->nvnc, on_nvnc_client_new);
 	nvnc_set_cut_text_fn(self->nvnc, on_client_cut_text);
+	nvnc_set_fb_req_fn(self->nvnc, on_fb_update_request);
 
 	if (blank_screen(self) != 0)
 		goto blank_screen_failure;
@@ -1009,7 +1439,11 @@ static void wayvnc_start_cursor_capture(struct wayvnc* self, bool immediate)
 
 int wayvnc_start_capture(struct wayvnc* self)
 {
-	int rc = screencopy_start(self->screencopy, false);
+	if (!self->screencopy)
+		return 0;
+
+	// Frames are measured back to back while tuning, damaged or not
+	int rc = screencopy_start(self->screencopy, self->is_tuning);
 	if (rc < 0) {
 		nvnc_log(NVNC_LOG_ERROR, "Failed to start capture. Exiting...");
 		wayvnc_exit(self);
@@ -1034,6 +1468,9 @@ int wayvnc_start_capture_immediate(struct wayvnc* self)
 		nvnc_log(NVNC_LOG_WARNING, "Failed to acquire power state control. Capturing may fail.");
 	}
 
+	if (!self->screencopy)
+		return 0;
+
 	rc = screencopy_start(self->screencopy, true);
 	if (rc < 0) {
 		nvnc_log(NVNC_LOG_ERROR, "Failed to start capture. Exiting...");
@@ -1050,17 +1487,122 @@ static void on_capture_restart_timer(void* obj)
 	wayvnc_start_capture_immediate(self);
 }
 
-static void wayvnc_restart_capture(struct wayvnc* self)
+static void wayvnc_restart_capture_after(struct wayvnc* self,
+		uint64_t timeout_us)
 {
 	if (self->capture_retry_timer)
 		return;
 
-	int timeout = 100000;
-	self->capture_retry_timer = aml_timer_new(timeout,
+	self->capture_retry_timer = aml_timer_new(timeout_us,
 			on_capture_restart_timer, self, NULL);
 	aml_start(aml_get_default(), self->capture_retry_timer);
 }
 
+static void wayvnc_restart_capture(struct wayvnc* self)
+{
+	wayvnc_restart_capture_after(self, CAPTURE_RETRY_DELAY_US);
+}
+
+static uint64_t capture_watchdog_threshold_us(const struct wayvnc* self)
+{
+	int rate = MAX(self->capture.max_rate, 1);
+	uint64_t threshold = self->capture_watchdog_periods *
+		UINT64_C(1000000) / rate;
+	return MAX(threshold, CAPTURE_WATCHDOG_MIN_US);
+}
+
+static bool is_capture_expected(const struct wayvnc* self)
+{
+	return self->nr_clients > 0 && self->display && self->screencopy &&
+		!self->capture_retry_timer && !self->is_tuning &&
+		self->selected_output &&
+		self->selected_output->power != OUTPUT_POWER_OFF;
+}
+
+static void handle_capture_stall(struct wayvnc* self)
+{
+	uint64_t delay = self->capture_recovery_delay_us;
+	self->capture_recovery_delay_us = MIN(delay * 2,
+			CAPTURE_RECOVERY_MAX_US);
+	self->capture_probe_start_us = 0;
+	self->n_capture_stalls++;
+	self->n_capture_stalls_total++;
+
+	nvnc_log(NVNC_LOG_WARNING, "Compositor stopped delivering frames. Re-establishing capture session in %"PRIu64" ms",
+			delay / 1000);
+
+	if (self->ctl)
+		ctl_server_event_capture_stalled(self->ctl,
+				self->n_capture_stalls_total, delay / 1000);
+
+	// The old session cannot be trusted to recover on its own
+	if (!configure_screencopy(self)) {
+		wayvnc_exit(self);
+		return;
+	}
+
+	wayvnc_restart_capture_after(self, delay);
+}
+
+static void on_capture_watchdog_tick(void* obj)
+{
+	struct wayvnc* self = aml_get_userdata(obj);
+	uint64_t now = gettime_us();
+
+	if (!is_capture_expected(self)) {
+		self->last_capture_activity_us = now;
+		self->capture_probe_start_us = 0;
+		return;
+	}
+
+	uint64_t threshold = capture_watchdog_threshold_us(self);
+
+	if (self->capture_probe_start_us) {
+		if (now - self->capture_probe_start_us >= threshold)
+			handle_capture_stall(self);
+		return;
+	}
+
+	if (now - self->last_capture_activity_us < threshold)
+		return;
+
+	/* Capturing waits for damage, so a still screen looks the same as a
+	 * stalled compositor until a capture is forced.
+	 */
+	nvnc_log(NVNC_LOG_DEBUG, "No frames for %"PRIu64" ms. Forcing a capture",
+			(now - self->last_capture_activity_us) / 1000);
+	self->capture_probe_start_us = now;
+	screencopy_stop(self->screencopy);
+	wayvnc_start_capture_immediate(self);
+}
+
+static void update_capture_watchdog(struct wayvnc* self)
+{
+	bool enable = self->capture_watchdog_periods > 0 &&
+		self->nr_clients > 0 && self->display;
+	if (enable == !!self->capture_watchdog)
+		return;
+
+	if (!enable) {
+		aml_stop(aml_get_default(), self->capture_watchdog);
+		aml_unref(self->capture_watchdog);
+		self->capture_watchdog = NULL;
+		return;
+	}
+
+	self->capture_watchdog = aml_ticker_new(CAPTURE_WATCHDOG_TICK_US,
+			on_capture_watchdog_tick, self, NULL);
+	if (!self->capture_watchdog) {
+		nvnc_log(NVNC_LOG_WARNING, "Failed to start capture watchdog");
+		return;
+	}
+
+	self->last_capture_activity_us = gettime_us();
+	self->capture_probe_start_us = 0;
+	self->capture_recovery_delay_us = CAPTURE_RETRY_DELAY_US;
+	aml_start(aml_get_default(), self->capture_watchdog);
+}
+
 // TODO: Handle transform change too
 void on_output_dimension_change(struct output* output)
 {
@@ -1101,54 +1643,50 @@ static void on_output_power_change(struct output* output)
 	}
 }
 
-static void apply_output_transform(const struct wayvnc* self,
-		struct wv_buffer* buffer, struct pixman_region16* damage)
-{
-	enum wl_output_transform output_transform, buffer_transform;
-	output_transform = self->selected_output->transform;
-
-	if (buffer->y_inverted) {
-		buffer_transform = wv_output_transform_compose(output_transform,
-				WL_OUTPUT_TRANSFORM_FLIPPED_180);
-
-		wv_region_transform(damage, &buffer->frame_damage,
-				WL_OUTPUT_TRANSFORM_FLIPPED_180,
-				buffer->width, buffer->height);
-	} else {
-		buffer_transform = output_transform;
-		pixman_region_copy(damage, &buffer->frame_damage);
-	}
-
-	nvnc_fb_set_transform(buffer->nvnc_fb,
-			(enum nvnc_transform)buffer_transform);
-}
-
 void wayvnc_process_frame(struct wayvnc* self, struct wv_buffer* buffer)
 {
 	nvnc_trace("Passing on buffer: %p", buffer);
 
-	self->n_frames_captured++;
-	self->damage_area_sum +=
-		calculate_region_area(&buffer->frame_damage);
+	uint64_t process_start = gettime_us();
 
-	struct pixman_region16 damage;
-	pixman_region_init(&damage);
-
-	if (self->screencopy->impl->caps & SCREENCOPY_CAP_TRANSFORM) {
-		pixman_region_copy(&damage, &buffer->frame_damage);
-	} else {
-		apply_output_transform(self, buffer, &damage);
-	}
+	// The encoders read the pixels from here until the fb is released
+	wv_buffer_begin_cpu_access(buffer);
 
-	pixman_region_intersect_rect(&damage, &damage, 0, 0, buffer->width,
-			buffer->height);
+	uint32_t damage_area = calculate_region_area(&buffer->frame_damage);
+	self->n_frames_captured++;
+	self->damage_area_sum += damage_area;
+	self->log_frames_captured++;
+	self->log_damage_area_sum += damage_area;
+	wv_perf_add_latency(WV_PERF_CAPTURE_LATENCY,
+			buffer->capture_latency_us);
+
+	struct frame_feed* feed = &self->frame_feed;
+	feed->output_transform = self->selected_output->transform;
+	feed->is_transformed =
+		self->screencopy->impl->caps & SCREENCOPY_CAP_TRANSFORM;
+	feed->damage_map = self->enable_damage_map ? &self->damage_map : NULL;
+	frame_feed_process(feed, buffer);
+	wv_buffer_record_feed(buffer);
+	self->displayed_buffer = buffer;
+
+	self->load_window.n_frames++;
+	self->load_window.process_us += gettime_us() - process_start;
 
-	nvnc_display_feed_buffer(self->nvnc_display, buffer->nvnc_fb,
-			&damage);
+	wayvnc_start_capture(self);
+}
 
-	pixman_region_fini(&damage);
+/* A forced capture reports the whole frame as damaged. Whatever really
+ * changed while it was being forced is found by comparing it with the frame
+ * that viewers already have. If they cannot be compared, the reported damage
+ * is kept.
+ */
+static void limit_probe_damage(struct wayvnc* self, struct wv_buffer* buffer)
+{
+	if (!self->displayed_buffer)
+		return;
 
-	wayvnc_start_capture(self);
+	wv_buffer_begin_cpu_access(buffer);
+	wv_buffer_damage_from_diff(buffer, self->displayed_buffer);
 }
 
 void on_capture_done(enum screencopy_result result, struct wv_buffer* buffer,
@@ -1156,8 +1694,18 @@ void on_capture_done(enum screencopy_result result, struct wv_buffer* buffer,
 {
 	struct wayvnc* self = userdata;
 
+	// Any answer from the compositor means that it is not stuck
+	bool is_probe = self->capture_probe_start_us != 0;
+	self->last_capture_activity_us = gettime_us();
+	self->capture_probe_start_us = 0;
+
 	switch (result) {
 	case SCREENCOPY_FATAL:
+		if (self->is_tuning) {
+			nvnc_log(NVNC_LOG_WARNING, "Capture configuration failed while tuning");
+			schedule_tuning_step(self, 0);
+			break;
+		}
 		nvnc_log(NVNC_LOG_ERROR, "Fatal error while capturing. Exiting...");
 		wayvnc_exit(self);
 		break;
@@ -1165,7 +1713,13 @@ void on_capture_done(enum screencopy_result result, struct wv_buffer* buffer,
 		wayvnc_restart_capture(self);
 		break;
 	case SCREENCOPY_DONE:
+		self->capture_recovery_delay_us = CAPTURE_RETRY_DELAY_US;
+		if (is_probe)
+			limit_probe_damage(self, buffer);
 		wayvnc_process_frame(self, buffer);
+		if (self->is_tuning && capture_tuner_add_frame(&self->tuner,
+					buffer->capture_latency_us))
+			schedule_tuning_step(self, 0);
 		break;
 	}
 }
@@ -1219,49 +1773,183 @@ int check_cfg_sanity(struct cfg* cfg)
 	return 0;
 }
 
-static void on_perf_tick(void* obj)
+static double average_damage(const struct wayvnc* self, uint32_t n_frames,
+		uint32_t area_sum)
 {
-	struct wayvnc* self = aml_get_userdata(obj);
+	if (!self->selected_output || n_frames == 0)
+		return 0;
 
-	double total_area = self->selected_output->width * self->selected_output->height;
-	double area_avg = (double)self->damage_area_sum / (double)self->n_frames_captured;
-	double relative_area_avg = 100.0 * area_avg / total_area;
+	double total_area = self->selected_output->width *
+		self->selected_output->height;
+	return (double)area_sum / n_frames / total_area;
+}
 
+static void log_performance(struct wayvnc* self)
+{
+	double damage = average_damage(self, self->log_frames_captured,
+			self->log_damage_area_sum);
 	nvnc_log(NVNC_LOG_INFO, "Frames captured: %"PRIu32", average reported frame damage: %.1f %%",
-			self->n_frames_captured, relative_area_avg);
+			self->log_frames_captured, 100.0 * damage);
+
+	struct wv_mem_usage mem;
+	wv_mem_get_total(&mem);
+	nvnc_log(NVNC_LOG_INFO, "Memory usage: %zu bytes in %zu objects",
+			mem.bytes, mem.objects);
+
+	struct wv_buffer_pool_stats pool_stats;
+	wv_buffer_pool_get_stats(&pool_stats);
+	nvnc_log(NVNC_LOG_INFO, "Buffer pool: %"PRIu64" acquired, %"PRIu64" misses, %"PRIu64" pre-warmed",
+			pool_stats.acquired, pool_stats.misses,
+			pool_stats.prewarmed);
+}
+
+static void send_performance_sample(struct wayvnc* self, uint64_t now,
+		double damage)
+{
+	struct ctl_server_perf_sample sample = {
+		.interval_ms = (now - self->perf_window_start) / 1000,
+		.damage = damage,
+		.loop_stalls = self->n_loop_stalls,
+		.capture_stalls = self->n_capture_stalls,
+		.n_clients = self->nr_clients,
+	};
+
+	if (sample.interval_ms > 0)
+		sample.fps = 1000.0 * self->n_frames_captured /
+			sample.interval_ms;
 
+	wv_perf_get_percentiles(WV_PERF_CAPTURE_LATENCY,
+			&sample.capture_latency);
+	wv_perf_get_percentiles(WV_PERF_FB_HOLD_TIME,
+			&sample.fb_hold_time);
+
+	struct wv_buffer_pool_stats pool_stats;
+	wv_buffer_pool_get_stats(&pool_stats);
+	sample.n_buffers = pool_stats.n_buffers;
+	sample.n_free_buffers = pool_stats.n_free;
+	sample.buffer_misses = pool_stats.misses - self->perf_last_misses;
+	self->perf_last_misses = pool_stats.misses;
+
+	ctl_server_event_performance_sample(self->ctl, &sample);
+}
+
+static void reset_performance_window(struct wayvnc* self, uint64_t now)
+{
 	self->n_frames_captured = 0;
 	self->damage_area_sum = 0;
+	self->n_loop_stalls = 0;
+	self->n_capture_stalls = 0;
+	self->perf_window_start = now;
+	wv_perf_reset();
+}
+
+static void on_perf_tick(void* obj)
+{
+	struct wayvnc* self = aml_get_userdata(obj);
+	uint64_t now = gettime_us();
+
+	send_performance_sample(self, now, average_damage(self,
+				self->n_frames_captured, self->damage_area_sum));
+	reset_performance_window(self, now);
 }
 
-static void start_performance_ticker(struct wayvnc* self)
+static void on_perf_log_tick(void* obj)
 {
-	if (!self->performance_ticker)
+	struct wayvnc* self = aml_get_userdata(obj);
+
+	log_performance(self);
+	self->log_frames_captured = 0;
+	self->log_damage_area_sum = 0;
+}
+
+static void update_performance_log_ticker(struct wayvnc* self)
+{
+	bool enable = self->show_performance && self->nr_clients > 0 &&
+		self->display;
+	if (enable == !!self->perf_log_ticker)
 		return;
 
-	aml_start(aml_get_default(), self->performance_ticker);
+	if (!enable) {
+		aml_stop(aml_get_default(), self->perf_log_ticker);
+		aml_unref(self->perf_log_ticker);
+		self->perf_log_ticker = NULL;
+		return;
+	}
+
+	self->perf_log_ticker = aml_ticker_new(
+			PERF_LOG_INTERVAL_MS * UINT64_C(1000),
+			on_perf_log_tick, self, NULL);
+	if (!self->perf_log_ticker)
+		return;
+
+	self->log_frames_captured = 0;
+	self->log_damage_area_sum = 0;
+	aml_start(aml_get_default(), self->perf_log_ticker);
 }
 
-static void stop_performance_ticker(struct wayvnc* self)
+/* Samples are taken at the shortest interval wanted by any control client.
+ * Clients that asked for a longer one are sent fewer of them.
+ */
+static void update_performance_ticker(struct wayvnc* self)
 {
-	if (!self->performance_ticker)
+	update_performance_log_ticker(self);
+
+	uint32_t period_ms = self->sample_interval_ms;
+	if (period_ms == self->performance_period_ms)
 		return;
 
-	aml_stop(aml_get_default(), self->performance_ticker);
+	if (self->performance_ticker) {
+		aml_stop(aml_get_default(), self->performance_ticker);
+		aml_unref(self->performance_ticker);
+		self->performance_ticker = NULL;
+	}
+
+	self->performance_period_ms = period_ms;
+	if (!period_ms)
+		return;
+
+	self->performance_ticker = aml_ticker_new(period_ms * UINT64_C(1000),
+			on_perf_tick, self, NULL);
+	if (!self->performance_ticker) {
+		self->performance_period_ms = 0;
+		return;
+	}
+
+	reset_performance_window(self, gettime_us());
+	aml_start(aml_get_default(), self->performance_ticker);
+}
+
+static void on_sample_interval(struct ctl* ctl, uint32_t interval_ms)
+{
+	struct wayvnc* self = ctl_server_userdata(ctl);
+	self->sample_interval_ms = interval_ms;
+	update_performance_ticker(self);
 }
 
 static void client_init_wayland(struct wayvnc_client* self)
 {
 	client_init_seat(self);
-	client_init_keyboard(self);
+	if (!self->seat)
+		return;
+
+	if (!self->server->high_density)
+		client_init_keyboard(self);
 	client_init_pointer(self);
 	client_init_data_control(self);
 }
 
 static void client_detach_wayland(struct wayvnc_client* self)
 {
+	if (self->seat)
+		self->seat->occupancy--;
 	self->seat = NULL;
 
+	if (self->transient_seat)
+		ext_transient_seat_v1_destroy(self->transient_seat);
+	self->transient_seat = NULL;
+
+	self->cursor_sc_pending = false;
+
 	if (self->keyboard.virtual_keyboard) {
 		zwp_virtual_keyboard_v1_destroy(
 				self->keyboard.virtual_keyboard);
@@ -1291,6 +1979,9 @@ static struct wayvnc_client* client_create(struct wayvnc* wayvnc,
 	self->nvnc_client = nvnc_client;
 
 	self->id = next_client_id++;
+	self->connected_at = gettime_us();
+	self->last_input_at = self->connected_at;
+	self->update_window_start = self->connected_at;
 
 	if (!wayvnc->cursor_master)
 		wayvnc->cursor_master = self;
@@ -1308,6 +1999,12 @@ static void client_destroy(void* obj)
 	struct nvnc* nvnc = nvnc_client_get_server(self->nvnc_client);
 	struct wayvnc* wayvnc = nvnc_get_userdata(nvnc);
 
+	// Never counted as connected, so there is nothing to undo
+	if (self->is_refused) {
+		free(self);
+		return;
+	}
+
 	if (self == wayvnc->master_layout_client)
 		wayvnc->master_layout_client = NULL;
 
@@ -1339,9 +2036,18 @@ static void client_destroy(void* obj)
 
 	if (wayvnc->nr_clients == 0 && wayvnc->display) {
 		nvnc_log(NVNC_LOG_INFO, "Stopping screen capture");
+		cancel_capture_tuning(wayvnc);
 		screencopy_stop(wayvnc->screencopy);
 		output_release_power_on(wayvnc->selected_output);
-		stop_performance_ticker(wayvnc);
+		update_performance_ticker(wayvnc);
+		update_capture_watchdog(wayvnc);
+		update_load_ticker(wayvnc);
+
+		if (wayvnc->high_density) {
+			// Drop the capture session along with its buffer pool
+			screencopy_destroy(wayvnc->screencopy);
+			wayvnc->screencopy = NULL;
+		}
 	}
 
 	if (self->keyboard.virtual_keyboard) {
@@ -1359,10 +2065,203 @@ static void client_destroy(void* obj)
 	free(self);
 }
 
+static int effective_max_rate(const struct wayvnc* self)
+{
+	if (!self->enable_load_shedding)
+		return self->capture.max_rate;
+	return MIN(self->capture.max_rate, self->load_shedder.rate);
+}
+
+static void report_load_action(struct wayvnc* self, const char* action,
+		int client_id)
+{
+	if (self->ctl)
+		ctl_server_event_load_shedding(self->ctl, action,
+				self->load_shedder.load, effective_max_rate(self),
+				client_id);
+}
+
+static void on_admission_timer(void* obj)
+{
+	struct wayvnc* self = aml_get_userdata(obj);
+
+	struct nvnc_client* client = nvnc_client_first(self->nvnc);
+	while (client) {
+		struct nvnc_client* next = nvnc_client_next(client);
+		struct wayvnc_client* wv_client = nvnc_get_userdata(client);
+		if (wv_client->is_refused)
+			nvnc_client_close(client);
+		client = next;
+	}
+}
+
+// Checked before the new client is counted
+static bool should_refuse_client(const struct wayvnc* self)
+{
+	if (self->max_clients > 0 && self->nr_clients >= self->max_clients)
+		return true;
+
+	return self->enable_load_shedding && self->nr_clients > 0 &&
+		self->load_shedder.is_admission_closed;
+}
+
+/* neatvnc has no way to turn a client away from within the new client
+ * callback, so it is closed from the main loop instead. Until then, it only
+ * gets enough state to be told apart from the admitted clients.
+ */
+static void refuse_client(struct wayvnc* self, struct nvnc_client* nvnc_client)
+{
+	struct wayvnc_client* client = calloc(1, sizeof(*client));
+	assert(client);
+
+	client->server = self;
+	client->nvnc_client = nvnc_client;
+	client->id = next_client_id++;
+	client->connected_at = gettime_us();
+	client->is_refused = true;
+	nvnc_set_userdata(nvnc_client, client, client_destroy);
+
+	nvnc_log(NVNC_LOG_WARNING, "Refusing client %u: %s", client->id,
+			self->load_shedder.is_admission_closed ?
+			"overloaded" : "too many clients");
+
+	report_load_action(self, "client-refused", client->id);
+
+	if (!self->admission_timer)
+		self->admission_timer = aml_timer_new(0, on_admission_timer,
+				self, NULL);
+	if (self->admission_timer)
+		aml_start(aml_get_default(), self->admission_timer);
+}
+
+static bool is_view_only(const struct wayvnc* self,
+		const struct wayvnc_client* client)
+{
+	return self->disable_input || !client->seat ||
+		(client->n_pointer_events == 0 && client->n_key_events == 0);
+}
+
+// Picks the most recently connected client that has never sent any input
+static struct wayvnc_client* find_client_to_shed(struct wayvnc* self)
+{
+	struct wayvnc_client* result = NULL;
+
+	struct nvnc_client* client;
+	for (client = nvnc_client_first(self->nvnc); client;
+			client = nvnc_client_next(client)) {
+		struct wayvnc_client* wv_client = nvnc_get_userdata(client);
+		if (wv_client->is_refused || !is_view_only(self, wv_client))
+			continue;
+		if (!result || wv_client->connected_at > result->connected_at)
+			result = wv_client;
+	}
+
+	return result;
+}
+
+static void shed_client(struct wayvnc* self)
+{
+	// Keep at least one viewer so that there is something to serve
+	if (self->nr_clients <= 1)
+		return;
+
+	struct wayvnc_client* client = find_client_to_shed(self);
+	if (!client) {
+		nvnc_log(NVNC_LOG_WARNING, "Overloaded, but there is no view-only client to disconnect");
+		return;
+	}
+
+	unsigned id = client->id;
+	nvnc_log(NVNC_LOG_WARNING, "Overloaded. Disconnecting view-only client %u",
+			id);
+	report_load_action(self, "client-disconnected", id);
+	nvnc_client_close(client->nvnc_client);
+}
+
+static void on_load_tick(void* obj)
+{
+	struct wayvnc* self = aml_get_userdata(obj);
+
+	struct wv_buffer_pool_stats pool_stats;
+	wv_buffer_pool_get_stats(&pool_stats);
+	self->load_window.n_released =
+		pool_stats.released - self->load_last_released;
+	self->load_window.backlog_us =
+		pool_stats.backlog_us - self->load_last_backlog_us;
+	self->load_last_released = pool_stats.released;
+	self->load_last_backlog_us = pool_stats.backlog_us;
+
+	// Frames are captured back to back while tuning
+	enum load_action action = self->is_tuning ? LOAD_ACTION_NONE :
+		load_shedder_update(&self->load_shedder, &self->load_window);
+	memset(&self->load_window, 0, sizeof(self->load_window));
+
+	switch (action) {
+	case LOAD_ACTION_NONE:
+		return;
+	case LOAD_ACTION_SHED_CLIENT:
+		shed_client(self);
+		return;
+	case LOAD_ACTION_LOWER_RATE:
+	case LOAD_ACTION_RAISE_RATE:
+		if (self->screencopy)
+			self->screencopy->rate_limit =
+				effective_max_rate(self);
+		break;
+	case LOAD_ACTION_CLOSE_ADMISSION:
+	case LOAD_ACTION_OPEN_ADMISSION:
+		break;
+	}
+
+	nvnc_log(NVNC_LOG_WARNING, "Load is %.2f of the frame budget: %s, max FPS is %d",
+			self->load_shedder.load, load_action_name(action),
+			effective_max_rate(self));
+	report_load_action(self, load_action_name(action), -1);
+}
+
+static void update_load_ticker(struct wayvnc* self)
+{
+	bool enable = self->enable_load_shedding && self->nr_clients > 0 &&
+		self->display;
+	if (enable == !!self->load_ticker)
+		return;
+
+	if (!enable) {
+		aml_stop(aml_get_default(), self->load_ticker);
+		aml_unref(self->load_ticker);
+		self->load_ticker = NULL;
+		return;
+	}
+
+	self->load_ticker = aml_ticker_new(LOAD_WINDOW_US, on_load_tick, self,
+			NULL);
+	if (!self->load_ticker) {
+		nvnc_log(NVNC_LOG_WARNING, "Failed to start load monitoring");
+		return;
+	}
+
+	struct wv_buffer_pool_stats pool_stats;
+	wv_buffer_pool_get_stats(&pool_stats);
+	self->load_last_released = pool_stats.released;
+	self->load_last_backlog_us = pool_stats.backlog_us;
+	memset(&self->load_window, 0, sizeof(self->load_window));
+	aml_start(aml_get_default(), self->load_ticker);
+}
+
 static void handle_first_client(struct wayvnc* self)
 {
+	if (self->auto_tune && !self->have_capture_choice && !self->is_tuning)
+		start_capture_tuning(self);
+
+	if (!self->screencopy && !configure_screencopy(self)) {
+		wayvnc_exit(self);
+		return;
+	}
+
 	nvnc_log(NVNC_LOG_INFO, "Starting screen capture");
-	start_performance_ticker(self);
+	update_performance_ticker(self);
+	update_capture_watchdog(self);
+	update_load_ticker(self);
 	wayvnc_start_capture_immediate(self);
 }
 
@@ -1371,6 +2270,11 @@ static void on_nvnc_client_new(struct nvnc_client* client)
 	struct nvnc* nvnc = nvnc_client_get_server(client);
 	struct wayvnc* self = nvnc_get_userdata(nvnc);
 
+	if (should_refuse_client(self)) {
+		refuse_client(self, client);
+		return;
+	}
+
 	struct wayvnc_client* wayvnc_client = client_create(self, client);
 	assert(wayvnc_client);
 	nvnc_set_userdata(client, wayvnc_client, client_destroy);
@@ -1403,7 +2307,7 @@ static void client_init_pointer(struct wayvnc_client* self)
 {
 	struct wayvnc* wayvnc = self->server;
 
-	if (!wayvnc->pointer_manager)
+	if (!wayvnc->pointer_manager || !self->seat)
 		return;
 
 	self->pointer.vnc = self->server->nvnc;
@@ -1426,16 +2330,32 @@ static void client_init_pointer(struct wayvnc_client* self)
 		nvnc_log(NVNC_LOG_ERROR, "Failed to initialise pointer");
 	}
 
-	if (self == wayvnc->cursor_master) {
-		// Get seat capability update
-		// TODO: Make this asynchronous
-		wl_display_roundtrip(wayvnc->display);
-		wl_display_dispatch_pending(wayvnc->display);
+	if (self != wayvnc->cursor_master)
+		return;
 
-		configure_cursor_sc(wayvnc, self);
-		if (wayvnc->cursor_sc)
-			screencopy_start(wayvnc->cursor_sc, true);
+	if (wayvnc->high_density) {
+		// Wait until the client actually moves the pointer
+		self->cursor_sc_pending = true;
+		return;
 	}
+
+	client_start_cursor_capture(self);
+}
+
+static void client_start_cursor_capture(struct wayvnc_client* self)
+{
+	struct wayvnc* wayvnc = self->server;
+
+	self->cursor_sc_pending = false;
+
+	// Get seat capability update
+	// TODO: Make this asynchronous
+	wl_display_roundtrip(wayvnc->display);
+	wl_display_dispatch_pending(wayvnc->display);
+
+	configure_cursor_sc(wayvnc, self);
+	if (wayvnc->cursor_sc)
+		screencopy_start(wayvnc->cursor_sc, true);
 }
 
 static void handle_transient_seat_ready(void* data,
@@ -1444,43 +2364,113 @@ static void handle_transient_seat_ready(void* data,
 {
 	(void)transient_seat;
 
-	struct wayvnc_client* client = data;
-	struct wayvnc* wayvnc = client->server;
-
-	struct seat* seat = seat_find_by_id(&wayvnc->seats, global_name);
-	assert(seat);
-
-	client->seat = seat;
+	struct transient_seat_slot* slot = data;
+	slot->global_name = global_name;
+	slot->is_ready = true;
 }
 
 static void handle_transient_seat_denied(void* data,
 		struct ext_transient_seat_v1* transient_seat)
 {
-	(void)data;
-	(void)transient_seat;
+	struct transient_seat_slot* slot = data;
+
+	nvnc_log(NVNC_LOG_ERROR, "Transient seat denied by compositor");
 
-	// TODO: Something more graceful perhaps?
-	nvnc_log(NVNC_LOG_PANIC, "Transient seat denied");
+	ext_transient_seat_v1_destroy(transient_seat);
+	slot->handle = NULL;
+	slot->is_ready = false;
 }
 
-static void client_init_transient_seat(struct wayvnc_client* self)
+static void transient_seat_pool_fill(struct wayvnc* self)
 {
-	struct wayvnc* wayvnc = self->server;
-
-	self->transient_seat =
-		ext_transient_seat_manager_v1_create(wayvnc->transient_seat_manager);
-
 	static const struct ext_transient_seat_v1_listener listener = {
 		.ready = handle_transient_seat_ready,
 		.denied = handle_transient_seat_denied,
 	};
-	ext_transient_seat_v1_add_listener(self->transient_seat, &listener,
-			self);
 
-	// TODO: Make this asynchronous
-	wl_display_roundtrip(wayvnc->display);
+	if (!self->transient_seat_manager)
+		return;
+
+	for (int i = 0; i < TRANSIENT_SEAT_POOL_SIZE; ++i) {
+		struct transient_seat_slot* slot = &self->transient_seat_pool[i];
+		if (slot->handle)
+			continue;
+
+		slot->is_ready = false;
+		slot->handle = ext_transient_seat_manager_v1_create(
+				self->transient_seat_manager);
+		if (!slot->handle)
+			continue;
+
+		ext_transient_seat_v1_add_listener(slot->handle, &listener,
+				slot);
+	}
+
+	// The replies are picked up by the main loop
+	wl_display_flush(self->display);
+}
+
+static void transient_seat_pool_destroy(struct wayvnc* self)
+{
+	for (int i = 0; i < TRANSIENT_SEAT_POOL_SIZE; ++i) {
+		struct transient_seat_slot* slot = &self->transient_seat_pool[i];
+		if (slot->handle)
+			ext_transient_seat_v1_destroy(slot->handle);
+		slot->handle = NULL;
+		slot->is_ready = false;
+	}
+}
+
+static struct transient_seat_slot* transient_seat_pool_find_ready(
+		struct wayvnc* self)
+{
+	for (int i = 0; i < TRANSIENT_SEAT_POOL_SIZE; ++i) {
+		struct transient_seat_slot* slot = &self->transient_seat_pool[i];
+		if (slot->handle && slot->is_ready)
+			return slot;
+	}
+	return NULL;
+}
 
-	assert(self->seat);
+static bool transient_seat_pool_has_pending(struct wayvnc* self)
+{
+	for (int i = 0; i < TRANSIENT_SEAT_POOL_SIZE; ++i) {
+		struct transient_seat_slot* slot = &self->transient_seat_pool[i];
+		if (slot->handle && !slot->is_ready)
+			return true;
+	}
+	return false;
+}
+
+static void client_init_transient_seat(struct wayvnc_client* self)
+{
+	struct wayvnc* wayvnc = self->server;
+
+	struct transient_seat_slot* slot =
+		transient_seat_pool_find_ready(wayvnc);
+	if (!slot) {
+		// The pool is exhausted or still waiting for the compositor, so
+		// we have no choice but to wait.
+		transient_seat_pool_fill(wayvnc);
+		while (!slot && transient_seat_pool_has_pending(wayvnc)) {
+			if (wl_display_roundtrip(wayvnc->display) < 0)
+				break;
+			slot = transient_seat_pool_find_ready(wayvnc);
+		}
+	}
+
+	if (slot) {
+		self->transient_seat = slot->handle;
+		self->seat = seat_find_by_id(&wayvnc->seats, slot->global_name);
+		slot->handle = NULL;
+		slot->is_ready = false;
+	}
+
+	if (!self->seat)
+		nvnc_log(NVNC_LOG_WARNING, "No transient seat available for client %u. Input will be ignored.",
+				self->id);
+
+	transient_seat_pool_fill(wayvnc);
 }
 
 static void client_init_seat(struct wayvnc_client* self)
@@ -1532,12 +2522,22 @@ static void client_init_keyboard(struct wayvnc_client* self)
 	}
 }
 
+static void client_init_keyboard_lazily(struct wayvnc_client* self)
+{
+	// In high density mode, the keymap is only compiled on first key press
+	if (!self->server->high_density || !self->seat)
+		return;
+
+	client_init_keyboard(self);
+}
+
 static void reinitialise_pointers(struct wayvnc* self)
 {
 	struct nvnc_client* c;
 	for (c = nvnc_client_first(self->nvnc); c; c = nvnc_client_next(c)) {
 		struct wayvnc_client* client = nvnc_get_userdata(c);
-		client_init_pointer(client);
+		if (!client->is_refused)
+			client_init_pointer(client);
 	}
 }
 
@@ -1550,7 +2550,8 @@ static void client_init_data_control(struct wayvnc_client* self)
 
 	self->data_control.manager = wayvnc->data_control_manager;
 	data_control_init(&self->data_control, wayvnc->nvnc,
-			self->seat->wl_seat);
+			self->seat->wl_seat, !wayvnc->disable_primary_selection);
+	self->data_control.max_receive_size = wayvnc->clipboard_max_size;
 }
 
 void log_selected_output(struct wayvnc* self)
@@ -1579,6 +2580,20 @@ static void wayvnc_process_cursor(struct wayvnc* self, struct wv_buffer* buffer)
 	wayvnc_start_cursor_capture(self, false);
 }
 
+static void on_cursor_position(int x, int y, void* userdata)
+{
+	struct wayvnc* self = userdata;
+
+	if (!self->selected_output)
+		return;
+
+	uint32_t fb_x = 0, fb_y = 0;
+	output_untransform_coord(self->selected_output, MAX(x, 0), MAX(y, 0),
+			&fb_x, &fb_y);
+
+	nvnc_move_cursor(self->nvnc, fb_x, fb_y);
+}
+
 static void on_cursor_capture_done(enum screencopy_result result,
 		struct wv_buffer* buffer, void* userdata)
 {
@@ -1656,23 +2671,168 @@ static bool configure_cursor_sc(struct wayvnc* self,
 	}
 
 	self->cursor_sc->on_done = on_cursor_capture_done;
+	self->cursor_sc->cursor_position = on_cursor_position;
 	self->cursor_sc->rate_format = rate_format;
 	self->cursor_sc->userdata = self;
 
-	self->cursor_sc->rate_limit = self->max_rate;
+	self->cursor_sc->rate_limit = self->capture.cursor_max_rate;
 	self->cursor_sc->enable_linux_dmabuf = false;
+	self->cursor_sc->n_spare_buffers = self->high_density ? 0 :
+		SPARE_CURSOR_BUFFERS;
 
 	nvnc_log(NVNC_LOG_DEBUG, "Configured cursor capturing");
 	return true;
 }
 
+static const struct capture_choice* get_capture_choice(
+		const struct wayvnc* self)
+{
+	if (self->is_tuning)
+		return capture_tuner_candidate(&self->tuner);
+	return self->have_capture_choice ? &self->capture_choice : NULL;
+}
+
+static uint64_t capture_tuning_cache_key(const struct wayvnc* self)
+{
+	// The candidates depend on these, so the outcome does too
+	return self->compositor_identity ^
+		((uint64_t)self->capture.enable_gpu_features << 63) ^
+		((uint64_t)self->zero_copy << 62);
+}
+
+static void restart_capture_for_tuning(struct wayvnc* self)
+{
+	configure_screencopy(self);
+	if (self->nr_clients > 0)
+		wayvnc_start_capture_immediate(self);
+}
+
+static void finish_capture_tuning(struct wayvnc* self)
+{
+	self->is_tuning = false;
+
+	if (capture_tuner_best(&self->tuner, &self->capture_choice) < 0) {
+		nvnc_log(NVNC_LOG_WARNING, "No capture configuration delivered any frames while tuning. Using defaults.");
+		self->capture_choice_source = NULL;
+		restart_capture_for_tuning(self);
+		return;
+	}
+
+	self->have_capture_choice = true;
+	self->capture_choice_source = "measured";
+
+	nvnc_log(NVNC_LOG_INFO, "Selected capture configuration: %s/%s",
+			screencopy_backend_name(self->capture_choice.backend),
+			self->capture_choice.linux_dmabuf ? "dmabuf" : "shm");
+
+	if (capture_tuner_cache_store(capture_tuning_cache_key(self),
+				&self->capture_choice) < 0)
+		nvnc_log(NVNC_LOG_WARNING, "Failed to cache capture configuration: %m");
+
+	restart_capture_for_tuning(self);
+}
+
+static void on_tuning_step(void* obj)
+{
+	struct wayvnc* self = aml_get_userdata(obj);
+	aml_unref(self->tuning_timer);
+	self->tuning_timer = NULL;
+
+	if (!self->is_tuning)
+		return;
+
+	if (!capture_tuner_next(&self->tuner)) {
+		finish_capture_tuning(self);
+		return;
+	}
+
+	capture_tuner_begin(&self->tuner);
+	restart_capture_for_tuning(self);
+	schedule_tuning_step(self, CAPTURE_TUNING_TIMEOUT_US);
+}
+
+static void schedule_tuning_step(struct wayvnc* self, uint64_t timeout_us)
+{
+	if (self->tuning_timer) {
+		aml_stop(aml_get_default(), self->tuning_timer);
+		aml_unref(self->tuning_timer);
+	}
+
+	self->tuning_timer = aml_timer_new(timeout_us, on_tuning_step, self,
+			NULL);
+	aml_start(aml_get_default(), self->tuning_timer);
+}
+
+static void cancel_capture_tuning(struct wayvnc* self)
+{
+	if (self->tuning_timer) {
+		aml_stop(aml_get_default(), self->tuning_timer);
+		aml_unref(self->tuning_timer);
+	}
+	self->tuning_timer = NULL;
+	self->is_tuning = false;
+}
+
+static void start_capture_tuning(struct wayvnc* self)
+{
+	uint64_t key = capture_tuning_cache_key(self);
+	if (capture_tuner_cache_load(key, &self->capture_choice) == 0) {
+		self->have_capture_choice = true;
+		self->capture_choice_source = "cached";
+		nvnc_log(NVNC_LOG_INFO, "Using cached capture configuration: %s/%s",
+				screencopy_backend_name(
+					self->capture_choice.backend),
+				self->capture_choice.linux_dmabuf ?
+					"dmabuf" : "shm");
+		configure_screencopy(self);
+		return;
+	}
+
+	capture_tuner_init(&self->tuner, self->capture.enable_gpu_features,
+			self->zero_copy);
+	if (self->tuner.n_candidates < 2) {
+		nvnc_log(NVNC_LOG_DEBUG, "Only one capture configuration is available. Nothing to tune.");
+		return;
+	}
+
+	nvnc_log(NVNC_LOG_INFO, "Measuring %d capture configurations",
+			self->tuner.n_candidates);
+
+	self->is_tuning = true;
+	capture_tuner_begin(&self->tuner);
+	configure_screencopy(self);
+	schedule_tuning_step(self, CAPTURE_TUNING_TIMEOUT_US);
+}
+
 bool configure_screencopy(struct wayvnc* self)
 {
 	screencopy_stop(self->screencopy);
 	screencopy_destroy(self->screencopy);
+	self->screencopy = NULL;
+
+	if (self->high_density && self->nr_clients == 0) {
+		// The capture session is created when the first client arrives
+		if (screencopy_manager || (ext_image_copy_capture_manager &&
+				ext_output_image_capture_source_manager))
+			return true;
 
-	self->screencopy = screencopy_create(self->selected_output->wl_output,
-			self->overlay_cursor);
+		nvnc_log(NVNC_LOG_ERROR, "screencopy is not supported by compositor");
+		return false;
+	}
+
+	const struct capture_choice* choice = get_capture_choice(self);
+	if (choice)
+		self->screencopy = screencopy_create_with_backend(
+				choice->backend,
+				self->selected_output->wl_output,
+				self->capture.overlay_cursor);
+	else
+		self->screencopy = self->zero_copy ?
+			screencopy_create_zero_copy(
+					self->selected_output->wl_output,
+					self->capture.overlay_cursor) :
+			screencopy_create(self->selected_output->wl_output,
+					self->capture.overlay_cursor);
 	if (!self->screencopy) {
 		nvnc_log(NVNC_LOG_ERROR, "screencopy is not supported by compositor");
 		return false;
@@ -1682,8 +2842,10 @@ bool configure_screencopy(struct wayvnc* self)
 	self->screencopy->rate_format = rate_format;
 	self->screencopy->userdata = self;
 
-	self->screencopy->rate_limit = self->max_rate;
-	self->screencopy->enable_linux_dmabuf = self->enable_gpu_features;
+	self->screencopy->rate_limit = effective_max_rate(self);
+	self->screencopy->enable_linux_dmabuf = choice ? choice->linux_dmabuf :
+		self->capture.enable_gpu_features;
+	self->screencopy->n_spare_buffers = self->capture.n_spare_buffers;
 
 	return true;
 }
@@ -1819,7 +2981,8 @@ static bool wayland_attach(struct wayvnc* self, const char* display,
 	for (nvnc_client = nvnc_client_first(self->nvnc); nvnc_client;
 			nvnc_client = nvnc_client_next(nvnc_client)) {
 		struct wayvnc_client* client = nvnc_get_userdata(nvnc_client);
-		client_init_wayland(client);
+		if (!client->is_refused)
+			client_init_wayland(client);
 	}
 
 	nvnc_log(NVNC_LOG_INFO, "Attached to %s", display);
@@ -1856,6 +3019,16 @@ static int log_level_from_string(const char* str)
 	return -1;
 }
 
+static void log_scheduling_status(void)
+{
+	struct realtime_status status;
+	realtime_get_status(&status);
+
+	nvnc_log(NVNC_LOG_INFO, "Scheduling: %s, priority %d, nice %d, CPUs %s, %zu kB locked",
+			status.policy, status.priority, status.nice,
+			status.cpus, status.locked_bytes / 1024);
+}
+
 int show_version(void)
 {
 	printf("wayvnc: %s\n", wayvnc_version);
@@ -1907,6 +3080,9 @@ int main(int argc, char* argv[])
 		{ 'f', "max-fps", "<fps>",
 		  "Set rate limit.",
 		  .default_ = "30" },
+		{ 0, "cursor-max-fps", "<fps>",
+		  "Set rate limit for cursor shape updates.",
+		  .default_ = "60" },
 		{ 'g', "gpu", NULL,
 		  "Enable features that need GPU." },
 		{ 'h', "help", NULL,
@@ -1940,6 +3116,39 @@ int main(int argc, char* argv[])
 		  "Create a websocket." },
 		{ 'x', "external-listener-fd", NULL,
 		  "The address is a pre-bound file descriptor.", },
+		{ 0, "damage-map", "<tile-size>",
+		  "Accumulate a damage heat map with tiles of the given size in pixels." },
+		{ 0, "high-density", NULL,
+		  "Defer capture and input resources until they are needed." },
+		{ 0, "zero-copy", NULL,
+		  "Pass the compositor's own frame buffers on without copying." },
+		{ 0, "auto-tune", NULL,
+		  "Measure the available capture backends and buffer types on first capture and use the fastest." },
+		{ 0, "dma-heap", "<name>",
+		  "Allocate GPU buffers from the named dma-heap, e.g. system or linux,cma." },
+		{ 0, "disable-primary-selection", NULL,
+		  "Do not synchronise the primary selection." },
+		{ 0, "clipboard-max-size", "<bytes>",
+		  "Largest clipboard content that is sent to clients.",
+		  .default_ = XSTR(DATA_CONTROL_DEFAULT_MAX_SIZE) },
+		{ 0, "capture-watchdog", "<periods>",
+		  "Re-establish capturing if no frame arrives within this many frame periods. 0 disables.",
+		  .default_ = "0" },
+		{ 0, "max-clients", "<count>",
+		  "Refuse clients beyond this many. 0 means no limit.",
+		  .default_ = "0" },
+		{ 0, "load-shedding", NULL,
+		  "Lower the frame rate and then turn clients away when overloaded." },
+		{ 0, "realtime", NULL,
+		  "Run with a real-time scheduling policy and locked memory." },
+		{ 0, "realtime-priority", "<1-99>",
+		  "Real-time scheduling priority.",
+		  .default_ = XSTR(DEFAULT_REALTIME_PRIORITY) },
+		{ 0, "realtime-cpus", "<list>",
+		  "Pin wayvnc to a list of CPUs, e.g. 2,3 or 2-3." },
+		{ 0, "ctl-max-message-size", "<bytes>",
+		  "Largest message accepted on the control socket.",
+		  .default_ = XSTR(CTL_SERVER_DEFAULT_MAX_MESSAGE_SIZE) },
 		{}
 	};
 
@@ -1981,17 +3190,53 @@ int main(int argc, char* argv[])
 	start_detached = !!option_parser_get_value(&option_parser, "detached");
 	self.enable_resizing = !option_parser_get_value(&option_parser,
 			"disable-resizing");
+	const char* damage_map_tile_size = option_parser_get_value(
+			&option_parser, "damage-map");
+	self.high_density = !!option_parser_get_value(&option_parser,
+			"high-density");
+	self.zero_copy = !!option_parser_get_value(&option_parser,
+			"zero-copy");
+	self.auto_tune = !!option_parser_get_value(&option_parser,
+			"auto-tune");
+	self.disable_primary_selection = !!option_parser_get_value(
+			&option_parser, "disable-primary-selection");
+	self.enable_load_shedding = !!option_parser_get_value(&option_parser,
+			"load-shedding");
+	int max_clients = atoi(option_parser_get_value(&option_parser,
+				"max-clients"));
+	long capture_watchdog_periods = atol(option_parser_get_value(
+				&option_parser, "capture-watchdog"));
+	long clipboard_max_size = atol(option_parser_get_value(&option_parser,
+				"clipboard-max-size"));
+	wv_buffer_set_dma_heap(option_parser_get_value(&option_parser,
+				"dma-heap"));
+	bool use_realtime = !!option_parser_get_value(&option_parser,
+			"realtime");
+	struct realtime_config realtime_config = {
+		.priority = atoi(option_parser_get_value(&option_parser,
+					"realtime-priority")),
+		.cpus = option_parser_get_value(&option_parser,
+				"realtime-cpus"),
+	};
+	long ctl_max_message_size = atol(option_parser_get_value(
+				&option_parser, "ctl-max-message-size"));
 
 	self.start_detached = start_detached;
-	self.overlay_cursor = overlay_cursor;
-	self.max_rate = max_rate;
-	self.enable_gpu_features = enable_gpu_features;
+	self.capture.overlay_cursor = overlay_cursor;
+	self.capture.max_rate = max_rate;
+	self.capture.cursor_max_rate = atoi(option_parser_get_value(
+				&option_parser, "cursor-max-fps"));
+	self.capture.enable_gpu_features = enable_gpu_features;
+	self.capture.n_spare_buffers = self.high_density ? 0 :
+		SPARE_CAPTURE_BUFFERS;
+	self.default_capture = self.capture;
+	load_shedder_init(&self.load_shedder, self.capture.max_rate);
 
 	keyboard_options = option_parser_get_value(&option_parser, "keyboard");
 	if (keyboard_options)
 		parse_keyboard_option(&self, keyboard_options);
 
-	nvnc_set_log_level(log_level);
+	wv_log_set_level(log_level);
 
 	// Only check for explicitly-set values here (defaults applied below)
 	address = option_parser_get_value_no_default(&option_parser, "address");
@@ -2038,6 +3283,16 @@ int main(int argc, char* argv[])
 	if (check_cfg_sanity(&self.cfg) < 0)
 		return 1;
 
+	if (damage_map_tile_size) {
+		if (damage_map_init(&self.damage_map,
+					atoi(damage_map_tile_size),
+					DAMAGE_MAP_TIME_CONSTANT) < 0) {
+			nvnc_log(NVNC_LOG_ERROR, "Invalid damage map tile size");
+			return 1;
+		}
+		self.enable_damage_map = true;
+	}
+
 	if (cfg_rc == 0) {
 		if (!address) address = self.cfg.address;
 		if (!port) port = self.cfg.port;
@@ -2049,10 +3304,42 @@ int main(int argc, char* argv[])
 	self.disable_input = disable_input;
 	self.use_transient_seat = use_transient_seat;
 
+	wv_mem_track_json();
+
 	srand(time(NULL));
 
 	signal(SIGPIPE, SIG_IGN);
 
+	if (max_clients < 0) {
+		nvnc_log(NVNC_LOG_ERROR, "Invalid client limit");
+		return 1;
+	}
+	self.max_clients = max_clients;
+
+	if (capture_watchdog_periods < 0) {
+		nvnc_log(NVNC_LOG_ERROR, "Invalid capture watchdog period count");
+		return 1;
+	}
+	self.capture_watchdog_periods = capture_watchdog_periods;
+
+	if (clipboard_max_size <= 0) {
+		nvnc_log(NVNC_LOG_ERROR, "Invalid clipboard size limit");
+		return 1;
+	}
+	self.clipboard_max_size = clipboard_max_size;
+
+	if (use_realtime) {
+		if (realtime_enable(&realtime_config) < 0)
+			return 1;
+		wv_buffer_set_lock_memory(true);
+	} else if (realtime_config.cpus) {
+		nvnc_log(NVNC_LOG_ERROR, "--realtime-cpus requires --realtime");
+		return 1;
+	}
+
+	if (wv_log_async_start() < 0)
+		nvnc_log(NVNC_LOG_WARNING, "Failed to start async logging");
+
 	struct aml* aml = aml_new();
 	if (!aml)
 		goto failure;
@@ -2110,9 +3397,7 @@ int main(int argc, char* argv[])
 	if (!start_detached && !configure_screencopy(&self))
 		goto screencopy_failure;
 
-	if (show_performance)
-		self.performance_ticker = aml_ticker_new(1000000, on_perf_tick,
-				&self, NULL);
+	self.show_performance = show_performance;
 
 	const struct ctl_server_actions ctl_actions = {
 		.userdata = &self,
@@ -2125,23 +3410,38 @@ int main(int argc, char* argv[])
 		.get_output_list = get_output_list,
 		.on_disconnect_client = on_disconnect_client,
 		.on_wayvnc_exit = on_wayvnc_exit,
+		.get_damage_map = get_damage_map,
+		.get_capture_info = get_capture_info,
+		.on_capture_set = on_capture_set,
+		.on_sample_interval = on_sample_interval,
 	};
 	self.ctl = ctl_server_new(socket_path, &ctl_actions);
 	if (!self.ctl)
 		goto ctl_server_failure;
 
+	if (ctl_max_message_size > 0)
+		ctl_server_set_max_message_size(self.ctl, ctl_max_message_size);
+
 	if (init_nvnc(&self, address, port, socket_type) < 0)
 		goto nvnc_failure;
 
 	if (self.display)
 		wl_display_dispatch_pending(self.display);
 
+	if (use_realtime)
+		realtime_lock_memory();
+	log_scheduling_status();
+
 	while (!self.do_exit) {
 		if (self.display)
 			wl_display_flush(self.display);
 
 		aml_poll(aml, -1);
+
+		uint64_t dispatch_start = gettime_us();
 		aml_dispatch(aml);
+		if (gettime_us() - dispatch_start > LOOP_STALL_THRESHOLD_US)
+			self.n_loop_stalls++;
 	}
 
 	nvnc_log(NVNC_LOG_INFO, "Exiting...");
@@ -2162,6 +3462,7 @@ int main(int argc, char* argv[])
 		screencopy_destroy(self.screencopy);
 	aml_unref(aml);
 
+	wv_log_async_stop();
 	return 0;
 
 nvnc_failure:
@@ -2173,5 +3474,6 @@ wayland_failure:
 failure:
 	self.nvnc = NULL;
 	wayvnc_destroy(&self);
+	wv_log_async_stop();
 	return 1;
 }
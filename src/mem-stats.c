@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <jansson.h>
+
+#include "mem-stats.h"
+#include "config.h"
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+#include <malloc.h>
+#endif
+
+struct mem_counter {
+	atomic_size_t bytes;
+	atomic_size_t objects;
+};
+
+static struct mem_counter counters[WV_MEM_CATEGORY_COUNT];
+
+static const char* category_names[WV_MEM_CATEGORY_COUNT] = {
+#define X(id, name) [WV_MEM_##id] = name,
+	X_MEM_CATEGORY_LIST
+#undef X
+};
+
+void wv_mem_alloc(enum wv_mem_category category, size_t size)
+{
+	assert(category < WV_MEM_CATEGORY_COUNT);
+	atomic_fetch_add_explicit(&counters[category].bytes, size,
+			memory_order_relaxed);
+	atomic_fetch_add_explicit(&counters[category].objects, 1,
+			memory_order_relaxed);
+}
+
+void wv_mem_free(enum wv_mem_category category, size_t size)
+{
+	assert(category < WV_MEM_CATEGORY_COUNT);
+	atomic_fetch_sub_explicit(&counters[category].bytes, size,
+			memory_order_relaxed);
+	atomic_fetch_sub_explicit(&counters[category].objects, 1,
+			memory_order_relaxed);
+}
+
+void wv_mem_resize(enum wv_mem_category category, size_t old_size,
+		size_t new_size)
+{
+	assert(category < WV_MEM_CATEGORY_COUNT);
+	if (new_size > old_size)
+		atomic_fetch_add_explicit(&counters[category].bytes,
+				new_size - old_size, memory_order_relaxed);
+	else
+		atomic_fetch_sub_explicit(&counters[category].bytes,
+				old_size - new_size, memory_order_relaxed);
+}
+
+void wv_mem_get_usage(enum wv_mem_category category,
+		struct wv_mem_usage* usage)
+{
+	assert(category < WV_MEM_CATEGORY_COUNT);
+	usage->bytes = atomic_load_explicit(&counters[category].bytes,
+			memory_order_relaxed);
+	usage->objects = atomic_load_explicit(&counters[category].objects,
+			memory_order_relaxed);
+}
+
+void wv_mem_get_total(struct wv_mem_usage* usage)
+{
+	usage->bytes = 0;
+	usage->objects = 0;
+
+	for (int i = 0; i < WV_MEM_CATEGORY_COUNT; ++i) {
+		struct wv_mem_usage part;
+		wv_mem_get_usage(i, &part);
+		usage->bytes += part.bytes;
+		usage->objects += part.objects;
+	}
+}
+
+const char* wv_mem_category_name(enum wv_mem_category category)
+{
+	assert(category < WV_MEM_CATEGORY_COUNT);
+	return category_names[category];
+}
+
+#ifdef HAVE_MALLOC_USABLE_SIZE
+/*
+ * The allocation functions hand out pointers that came straight from
+ * malloc(), because the size is recovered with malloc_usable_size() rather
+ * than being stored in a header. Strings from json_dumps() must still be
+ * released through jansson's free function, i.e. with jsonipc_free_string(),
+ * or the counters will drift.
+ */
+static void* json_tracked_malloc(size_t size)
+{
+	void* ptr = malloc(size);
+	if (ptr)
+		wv_mem_alloc(WV_MEM_JSON, malloc_usable_size(ptr));
+	return ptr;
+}
+
+static void json_tracked_free(void* ptr)
+{
+	if (!ptr)
+		return;
+
+	wv_mem_free(WV_MEM_JSON, malloc_usable_size(ptr));
+	free(ptr);
+}
+
+void wv_mem_track_json(void)
+{
+	json_set_alloc_funcs(json_tracked_malloc, json_tracked_free);
+}
+#else
+void wv_mem_track_json(void)
+{
+}
+#endif
@@ -77,6 +77,47 @@ void output_transform_coord(const struct output* self,
 	}
 }
 
+// Inverse of output_transform_coord()
+void output_untransform_coord(const struct output* self,
+                              uint32_t src_x, uint32_t src_y,
+                              uint32_t* dst_x, uint32_t* dst_y)
+{
+	switch (self->transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+		*dst_x = src_x;
+		*dst_y = src_y;
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+		*dst_x = self->height - src_y;
+		*dst_y = src_x;
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+		*dst_x = self->width - src_x;
+		*dst_y = self->height - src_y;
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+		*dst_x = src_y;
+		*dst_y = self->width - src_x;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		*dst_x = self->width - src_x;
+		*dst_y = src_y;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		*dst_x = src_y;
+		*dst_y = src_x;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		*dst_x = src_x;
+		*dst_y = self->height - src_y;
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		*dst_x = self->height - src_y;
+		*dst_y = self->width - src_x;
+		break;
+	}
+}
+
 void output_transform_box_coord(const struct output* self,
                                 uint32_t src_x0, uint32_t src_y0,
                                 uint32_t src_x1, uint32_t src_y1,
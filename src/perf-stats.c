@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "perf-stats.h"
+
+#define MAX_SAMPLES 1024
+
+struct latency_window {
+	uint32_t samples[MAX_SAMPLES];
+	uint32_t n;
+	uint32_t max;
+};
+
+static struct latency_window windows[WV_PERF_LATENCY_COUNT];
+
+void wv_perf_add_latency(enum wv_perf_latency which, uint64_t us)
+{
+	assert(which < WV_PERF_LATENCY_COUNT);
+	struct latency_window* window = &windows[which];
+
+	uint32_t value = us > UINT32_MAX ? UINT32_MAX : us;
+
+	if (window->n < MAX_SAMPLES)
+		window->samples[window->n] = value;
+	if (window->n < UINT32_MAX)
+		window->n++;
+	if (value > window->max)
+		window->max = value;
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static uint32_t nearest_rank(const uint32_t* sorted, uint32_t n,
+		uint32_t percentile)
+{
+	uint32_t rank = ((uint64_t)percentile * n + 99) / 100;
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void wv_perf_get_percentiles(enum wv_perf_latency which,
+		struct wv_perf_percentiles* result)
+{
+	assert(which < WV_PERF_LATENCY_COUNT);
+	struct latency_window* window = &windows[which];
+
+	memset(result, 0, sizeof(*result));
+	result->n = window->n;
+	result->max = window->max;
+
+	uint32_t n = window->n < MAX_SAMPLES ? window->n : MAX_SAMPLES;
+	if (n == 0)
+		return;
+
+	// Sample order doesn't matter, so sort in place
+	qsort(window->samples, n, sizeof(window->samples[0]), compare_u32);
+
+	result->p50 = nearest_rank(window->samples, n, 50);
+	result->p90 = nearest_rank(window->samples, n, 90);
+	result->p99 = nearest_rank(window->samples, n, 99);
+}
+
+uint32_t wv_perf_percentile(uint32_t* samples, uint32_t n,
+		uint32_t percentile)
+{
+	if (n == 0)
+		return 0;
+
+	qsort(samples, n, sizeof(samples[0]), compare_u32);
+	return nearest_rank(samples, n, percentile);
+}
+
+void wv_perf_reset(void)
+{
+	for (int i = 0; i < WV_PERF_LATENCY_COUNT; ++i) {
+		windows[i].n = 0;
+		windows[i].max = 0;
+	}
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2024 Andri Yngvason
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <neatvnc.h>
+
+#include "realtime.h"
+
+#define FALLBACK_NICE -10
+
+static bool is_memory_locked = false;
+
+static int parse_cpu_list(const char* list, cpu_set_t* set)
+{
+	CPU_ZERO(set);
+
+	while (*list) {
+		char* end = NULL;
+		long first = strtol(list, &end, 10);
+		long last = first;
+		if (end == list)
+			return -1;
+
+		if (*end == '-') {
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list)
+				return -1;
+		}
+
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return -1;
+
+		for (long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, set);
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		list = end;
+	}
+
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+static void format_cpu_list(const cpu_set_t* set, char* dst, size_t size)
+{
+	size_t len = 0;
+	dst[0] = '\0';
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, set))
+			continue;
+
+		int last = cpu;
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+			last++;
+
+		int n = last == cpu ?
+			snprintf(dst + len, size - len, "%s%d",
+					len ? "," : "", cpu) :
+			snprintf(dst + len, size - len, "%s%d-%d",
+					len ? "," : "", cpu, last);
+		if (n < 0 || (size_t)n >= size - len)
+			break;
+		len += n;
+		cpu = last;
+	}
+}
+
+static const char* policy_name(int policy)
+{
+	switch (policy) {
+	case SCHED_OTHER: return "SCHED_OTHER";
+	case SCHED_FIFO: return "SCHED_FIFO";
+	case SCHED_RR: return "SCHED_RR";
+#ifdef SCHED_BATCH
+	case SCHED_BATCH: return "SCHED_BATCH";
+#endif
+#ifdef SCHED_IDLE
+	case SCHED_IDLE: return "SCHED_IDLE";
+#endif
+	}
+	return "unknown";
+}
+
+int realtime_enable(const struct realtime_config* config)
+{
+	int min = sched_get_priority_min(SCHED_RR);
+	int max = sched_get_priority_max(SCHED_RR);
+	if (config->priority < min || config->priority > max) {
+		nvnc_log(NVNC_LOG_ERROR, "Real-time priority must be from %d to %d",
+				min, max);
+		return -1;
+	}
+
+	if (config->cpus) {
+		cpu_set_t set;
+		if (parse_cpu_list(config->cpus, &set) < 0) {
+			nvnc_log(NVNC_LOG_ERROR, "Invalid CPU list: %s",
+					config->cpus);
+			return -1;
+		}
+
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			nvnc_log(NVNC_LOG_WARNING, "Failed to pin to CPUs %s: %m",
+					config->cpus);
+	}
+
+	struct sched_param param = { .sched_priority = config->priority };
+	if (sched_setscheduler(0, SCHED_RR, &param) == 0)
+		return 0;
+
+	nvnc_log(NVNC_LOG_WARNING, "Failed to set real-time scheduling policy: %m. Trying a higher nice level instead.");
+
+	if (setpriority(PRIO_PROCESS, 0, FALLBACK_NICE) < 0)
+		nvnc_log(NVNC_LOG_WARNING, "Failed to set nice level: %m");
+
+	return 0;
+}
+
+void realtime_lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT) < 0) {
+		nvnc_log(NVNC_LOG_WARNING, "Failed to lock memory: %m");
+		return;
+	}
+	is_memory_locked = true;
+}
+
+static size_t get_locked_bytes(void)
+{
+	FILE* stream = fopen("/proc/self/status", "r");
+	if (!stream)
+		return 0;
+
+	size_t result = 0;
+	char line[128];
+	while (fgets(line, sizeof(line), stream)) {
+		unsigned long kib;
+		if (sscanf(line, "VmLck: %lu kB", &kib) == 1) {
+			result = kib * 1024;
+			break;
+		}
+	}
+
+	fclose(stream);
+	return result;
+}
+
+void realtime_get_status(struct realtime_status* status)
+{
+	memset(status, 0, sizeof(*status));
+
+	int policy = sched_getscheduler(0);
+	status->policy = policy_name(policy);
+
+	struct sched_param param = {};
+	if (sched_getparam(0, &param) == 0)
+		status->priority = param.sched_priority;
+
+	errno = 0;
+	status->nice = getpriority(PRIO_PROCESS, 0);
+
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		format_cpu_list(&set, status->cpus, sizeof(status->cpus));
+
+	status->memory_locked = is_memory_locked;
+	status->locked_bytes = get_locked_bytes();
+}
@@ -17,14 +17,17 @@
 #include "screencopy-interface.h"
 
 #include <unistd.h>
+#include <string.h>
 
 extern struct zwlr_screencopy_manager_v1* screencopy_manager;
 extern struct ext_output_image_capture_source_manager_v1*
 		ext_output_image_capture_source_manager;
 extern struct ext_image_copy_capture_manager_v1* ext_image_copy_capture_manager;
+extern struct zwlr_export_dmabuf_manager_v1* export_dmabuf_manager;
 
 extern struct screencopy_impl wlr_screencopy_impl;
 extern struct screencopy_impl ext_image_copy_capture_impl;
+extern struct screencopy_impl export_dmabuf_impl;
 
 struct screencopy* screencopy_create(struct wl_output* output,
 		bool render_cursor)
@@ -36,6 +39,15 @@ struct screencopy* screencopy_create(struct wl_output* output,
 	return NULL;
 }
 
+struct screencopy* screencopy_create_zero_copy(struct wl_output* output,
+		bool render_cursor)
+{
+	// wlr-screencopy is needed to fall back on
+	if (export_dmabuf_manager && screencopy_manager)
+		return export_dmabuf_impl.create(output, render_cursor);
+	return screencopy_create(output, render_cursor);
+}
+
 struct screencopy* screencopy_create_cursor(struct wl_output* output,
 		struct wl_seat* seat)
 {
@@ -44,6 +56,72 @@ struct screencopy* screencopy_create_cursor(struct wl_output* output,
 	return NULL;
 }
 
+static const char* backend_names[SCREENCOPY_BACKEND_COUNT] = {
+	[SCREENCOPY_BACKEND_EXT_IMAGE_COPY_CAPTURE] = "ext-image-copy-capture",
+	[SCREENCOPY_BACKEND_WLR_SCREENCOPY] = "wlr-screencopy",
+	[SCREENCOPY_BACKEND_EXPORT_DMABUF] = "wlr-export-dmabuf",
+};
+
+bool screencopy_backend_is_available(enum screencopy_backend backend)
+{
+	switch (backend) {
+	case SCREENCOPY_BACKEND_EXT_IMAGE_COPY_CAPTURE:
+		return ext_image_copy_capture_manager &&
+			ext_output_image_capture_source_manager;
+	case SCREENCOPY_BACKEND_WLR_SCREENCOPY:
+		return screencopy_manager;
+	case SCREENCOPY_BACKEND_EXPORT_DMABUF:
+		// wlr-screencopy is needed to fall back on
+		return export_dmabuf_manager && screencopy_manager;
+	case SCREENCOPY_BACKEND_COUNT:
+		break;
+	}
+	return false;
+}
+
+struct screencopy* screencopy_create_with_backend(
+		enum screencopy_backend backend, struct wl_output* output,
+		bool render_cursor)
+{
+	if (!screencopy_backend_is_available(backend))
+		return NULL;
+
+	switch (backend) {
+	case SCREENCOPY_BACKEND_EXT_IMAGE_COPY_CAPTURE:
+		return ext_image_copy_capture_impl.create(output, render_cursor);
+	case SCREENCOPY_BACKEND_WLR_SCREENCOPY:
+		return wlr_screencopy_impl.create(output, render_cursor);
+	case SCREENCOPY_BACKEND_EXPORT_DMABUF:
+		return export_dmabuf_impl.create(output, render_cursor);
+	case SCREENCOPY_BACKEND_COUNT:
+		break;
+	}
+	return NULL;
+}
+
+enum screencopy_backend screencopy_get_backend(const struct screencopy* self)
+{
+	if (self->impl == &export_dmabuf_impl)
+		return SCREENCOPY_BACKEND_EXPORT_DMABUF;
+	if (self->impl == &wlr_screencopy_impl)
+		return SCREENCOPY_BACKEND_WLR_SCREENCOPY;
+	return SCREENCOPY_BACKEND_EXT_IMAGE_COPY_CAPTURE;
+}
+
+const char* screencopy_backend_name(enum screencopy_backend backend)
+{
+	return backend < SCREENCOPY_BACKEND_COUNT ? backend_names[backend]
+		: "unknown";
+}
+
+int screencopy_backend_from_name(const char* name)
+{
+	for (int i = 0; i < SCREENCOPY_BACKEND_COUNT; ++i)
+		if (strcmp(backend_names[i], name) == 0)
+			return i;
+	return -1;
+}
+
 void screencopy_destroy(struct screencopy* self)
 {
 	if (self)
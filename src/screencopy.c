@@ -142,6 +142,7 @@ static void screencopy_buffer_done(void* data,
 
 	wv_buffer_pool_reconfig(self->pool, &config);
 
+	self->pool->spare_target = self->parent.n_spare_buffers;
 	struct wv_buffer* buffer = wv_buffer_pool_acquire(self->pool);
 	if (!buffer) {
 		screencopy__stop(self);
@@ -222,6 +223,8 @@ static void screencopy_ready(void* data,
 	self->back = self->front;
 	self->front = NULL;
 
+	self->back->capture_latency_us = self->last_time - self->start_time;
+
 	nvnc_fb_set_pts(self->back->nvnc_fb, pts);
 
 	self->status = WLR_SCREENCOPY_DONE;
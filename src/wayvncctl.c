@@ -80,6 +80,8 @@ int main(int argc, char* argv[])
 		  "If disconnected while waiting for events, wait for wayvnc to restart." },
 		{ 'j', "json", NULL,
 		  "Output json on stdout." },
+		{ 'b', "batch", NULL,
+		  "Read commands from stdin, one per line, and run them over a single connection." },
 		{ 'V', "version", NULL,
 		  "Show version info." },
 		{ 'v', "verbose", NULL,
@@ -109,18 +111,25 @@ int main(int argc, char* argv[])
 	flags |= option_parser_get_value(&option_parser, "json")
 		? CTL_CLIENT_PRINT_JSON : 0;
 	verbose = !!option_parser_get_value(&option_parser, "verbose");
+	bool batch = !!option_parser_get_value(&option_parser, "batch");
 
 	// No command; nothing to do...
-	if (!option_parser_get_value(&option_parser, "command"))
+	if (!batch && !option_parser_get_value(&option_parser, "command"))
 		return wayvncctl_usage(stdout, &option_parser, 1);
 
+	if (batch && option_parser_get_value(&option_parser, "command")) {
+		fprintf(stderr, "A command can not be given in batch mode\n");
+		return 1;
+	}
+
 	ctl_client_debug_log(verbose);
 
 	self.ctl = ctl_client_new(socket_path, &self);
 	if (!self.ctl)
 		goto ctl_client_failure;
 
-	int result = ctl_client_run_command(self.ctl, &option_parser, flags);
+	int result = batch ? ctl_client_run_batch(self.ctl, flags) :
+		ctl_client_run_command(self.ctl, &option_parser, flags);
 
 	ctl_client_destroy(self.ctl);
 
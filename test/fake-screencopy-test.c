@@ -0,0 +1,221 @@
+#include "tst.h"
+#include "fake-screencopy.h"
+#include "time-util.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <aml.h>
+#include <pixman.h>
+#include <libdrm/drm_fourcc.h>
+
+#define WIDTH 64
+#define HEIGHT 48
+#define TIMEOUT_US 1000000
+#define MAX_EVENTS 16
+
+struct event {
+	enum screencopy_result result;
+	pixman_box16_t extents;
+	uint64_t time;
+};
+
+// Stands in for the nvnc_display that frames are normally fed to
+struct sink {
+	struct screencopy* screencopy;
+	struct event events[MAX_EVENTS];
+	int n_events;
+	bool hold_buffers;
+	struct wv_buffer* held[MAX_EVENTS];
+	int n_held;
+};
+
+static void sink_on_done(enum screencopy_result result,
+		struct wv_buffer* buffer, void* userdata)
+{
+	struct sink* self = userdata;
+
+	if (self->n_events < MAX_EVENTS) {
+		struct event* event = &self->events[self->n_events++];
+		event->result = result;
+		event->time = gettime_us();
+		if (buffer)
+			event->extents = *pixman_region_extents(
+					&buffer->frame_damage);
+	}
+
+	if (buffer && self->hold_buffers)
+		self->held[self->n_held++] = buffer;
+	else if (buffer)
+		fake_screencopy_release(self->screencopy, buffer);
+
+	// Same as wayvnc: wait for the next frame after a success and retry
+	// straight away after a failure
+	if (result != SCREENCOPY_FATAL && self->n_events < MAX_EVENTS)
+		screencopy_start(self->screencopy,
+				result == SCREENCOPY_FAILED);
+}
+
+static int sink_init(struct sink* self,
+		const struct fake_screencopy_step* script, size_t len,
+		bool repeat)
+{
+	memset(self, 0, sizeof(*self));
+
+	struct fake_screencopy_config config = {
+		.width = WIDTH,
+		.height = HEIGHT,
+		.format = DRM_FORMAT_XRGB8888,
+		.script = script,
+		.script_len = len,
+		.repeat = repeat,
+	};
+	self->screencopy = fake_screencopy_create(&config);
+	if (!self->screencopy)
+		return -1;
+
+	self->screencopy->on_done = sink_on_done;
+	self->screencopy->userdata = self;
+	return 0;
+}
+
+static void sink_destroy(struct sink* self)
+{
+	screencopy_destroy(self->screencopy);
+}
+
+static void run_loop(struct sink* sink, int n_events, uint64_t timeout_us)
+{
+	uint64_t deadline = gettime_us() + timeout_us;
+	while (sink->n_events < n_events) {
+		uint64_t now = gettime_us();
+		if (now >= deadline)
+			break;
+		aml_poll(aml_get_default(), (deadline - now + 999) / 1000);
+		aml_dispatch(aml_get_default());
+	}
+}
+
+static int test_script(void)
+{
+	static const struct fake_screencopy_step script[] = {
+		{ SCREENCOPY_DONE, 1000, 8, 4, 16, 8 },
+		{ SCREENCOPY_FAILED, 0 },
+		{ SCREENCOPY_DONE, 0 },
+	};
+
+	struct sink sink;
+	ASSERT_INT_EQ(0, sink_init(&sink, script, 3, false));
+	screencopy_start(sink.screencopy, true);
+	run_loop(&sink, 3, TIMEOUT_US);
+
+	ASSERT_INT_EQ(3, sink.n_events);
+	ASSERT_INT_EQ(SCREENCOPY_DONE, sink.events[0].result);
+	ASSERT_INT_EQ(8, sink.events[0].extents.x1);
+	ASSERT_INT_EQ(4, sink.events[0].extents.y1);
+	ASSERT_INT_EQ(24, sink.events[0].extents.x2);
+	ASSERT_INT_EQ(12, sink.events[0].extents.y2);
+	ASSERT_INT_EQ(SCREENCOPY_FAILED, sink.events[1].result);
+	ASSERT_INT_EQ(SCREENCOPY_DONE, sink.events[2].result);
+	ASSERT_INT_EQ(WIDTH, sink.events[2].extents.x2);
+	ASSERT_INT_EQ(HEIGHT, sink.events[2].extents.y2);
+
+	struct fake_screencopy_stats stats;
+	fake_screencopy_get_stats(sink.screencopy, &stats);
+	ASSERT_UINT32_EQ(2, stats.n_delivered);
+	ASSERT_UINT32_EQ(1, stats.n_failed);
+	// The released buffer is reused
+	ASSERT_UINT32_EQ(1, stats.n_buffers);
+
+	sink_destroy(&sink);
+	return 0;
+}
+
+static int test_rate_limit(void)
+{
+	static const struct fake_screencopy_step script[] = {
+		{ SCREENCOPY_DONE, 0 },
+	};
+
+	struct sink sink;
+	ASSERT_INT_EQ(0, sink_init(&sink, script, 1, true));
+	sink.screencopy->rate_limit = 100;
+	screencopy_start(sink.screencopy, true);
+	run_loop(&sink, 5, TIMEOUT_US);
+
+	ASSERT_INT_EQ(5, sink.n_events);
+	// Four periods of 10 ms between the first and the last frame
+	ASSERT_UINT32_GE(40000, (uint32_t)(sink.events[4].time -
+				sink.events[0].time));
+
+	sink_destroy(&sink);
+	return 0;
+}
+
+static int test_stall(void)
+{
+	static const struct fake_screencopy_step script[] = {
+		{ SCREENCOPY_DONE, 0 },
+	};
+
+	struct sink sink;
+	ASSERT_INT_EQ(0, sink_init(&sink, script, 1, false));
+	screencopy_start(sink.screencopy, true);
+	run_loop(&sink, 2, 50000);
+
+	// The second capture is started, but never completes
+	ASSERT_INT_EQ(1, sink.n_events);
+	struct fake_screencopy_stats stats;
+	fake_screencopy_get_stats(sink.screencopy, &stats);
+	ASSERT_UINT32_EQ(2, stats.n_started);
+
+	sink_destroy(&sink);
+	return 0;
+}
+
+static int test_held_buffers(void)
+{
+	static const struct fake_screencopy_step script[] = {
+		{ SCREENCOPY_DONE, 0 },
+		{ SCREENCOPY_DONE, 0 },
+		{ SCREENCOPY_DONE, 0 },
+	};
+
+	struct sink sink;
+	ASSERT_INT_EQ(0, sink_init(&sink, script, 3, false));
+	sink.hold_buffers = true;
+	sink.screencopy->rate_limit = 1000;
+	screencopy_start(sink.screencopy, true);
+	run_loop(&sink, 3, TIMEOUT_US);
+
+	ASSERT_INT_EQ(3, sink.n_events);
+	struct fake_screencopy_stats stats;
+	fake_screencopy_get_stats(sink.screencopy, &stats);
+	ASSERT_UINT32_EQ(3, stats.n_buffers);
+	ASSERT_UINT32_EQ(0, stats.n_free);
+
+	for (int i = 0; i < sink.n_held; ++i)
+		fake_screencopy_release(sink.screencopy, sink.held[i]);
+
+	fake_screencopy_get_stats(sink.screencopy, &stats);
+	ASSERT_UINT32_EQ(3, stats.n_free);
+
+	sink_destroy(&sink);
+	return 0;
+}
+
+int main()
+{
+	struct aml* aml = aml_new();
+	if (!aml)
+		return 1;
+	aml_set_default(aml);
+
+	int r = 0;
+	RUN_TEST(test_script);
+	RUN_TEST(test_rate_limit);
+	RUN_TEST(test_stall);
+	RUN_TEST(test_held_buffers);
+
+	aml_unref(aml);
+	return r;
+}
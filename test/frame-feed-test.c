@@ -0,0 +1,237 @@
+#include "tst.h"
+#include "frame-feed.h"
+#include "fake-screencopy.h"
+#include "buffer.h"
+#include "damage-map.h"
+#include "time-util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <aml.h>
+#include <neatvnc.h>
+#include <pixman.h>
+#include <libdrm/drm_fourcc.h>
+
+#define WIDTH 64
+#define HEIGHT 48
+#define TILE_SIZE 16
+#define TIMEOUT_US 1000000
+#define MAX_FRAMES 16
+
+/*
+ * Feeds frames from the fake capture backend through frame_feed_process(),
+ * the same way as wayvnc does with the real backends, into a stand-in for the
+ * nvnc_display. Like the display, it holds on to the latest frame until the
+ * next one replaces it.
+ */
+struct pipeline {
+	struct screencopy* screencopy;
+	struct frame_feed feed;
+	bool y_inverted;
+
+	struct wv_buffer* current;
+	pixman_box16_t damage[MAX_FRAMES];
+	bool is_fed_at_set[MAX_FRAMES];
+	int n_frames;
+};
+
+static void display_feed(struct nvnc_fb* fb, struct pixman_region16* damage,
+		void* userdata)
+{
+	struct pipeline* self = userdata;
+	struct wv_buffer* buffer = nvnc_get_userdata(fb);
+
+	if (self->n_frames < MAX_FRAMES) {
+		self->damage[self->n_frames] = *pixman_region_extents(damage);
+		self->is_fed_at_set[self->n_frames] = buffer->fed_at_us != 0;
+		self->n_frames++;
+	}
+
+	if (self->current)
+		fake_screencopy_release(self->screencopy, self->current);
+	self->current = buffer;
+}
+
+static void pipeline_on_done(enum screencopy_result result,
+		struct wv_buffer* buffer, void* userdata)
+{
+	struct pipeline* self = userdata;
+
+	if (result == SCREENCOPY_DONE) {
+		buffer->y_inverted = self->y_inverted;
+		frame_feed_process(&self->feed, buffer);
+	}
+
+	if (result != SCREENCOPY_FATAL && self->n_frames < MAX_FRAMES)
+		screencopy_start(self->screencopy,
+				result == SCREENCOPY_FAILED);
+}
+
+static int pipeline_init(struct pipeline* self,
+		const struct fake_screencopy_step* script, size_t len,
+		bool repeat)
+{
+	memset(self, 0, sizeof(*self));
+
+	struct fake_screencopy_config config = {
+		.width = WIDTH,
+		.height = HEIGHT,
+		.format = DRM_FORMAT_XRGB8888,
+		.script = script,
+		.script_len = len,
+		.repeat = repeat,
+	};
+	self->screencopy = fake_screencopy_create(&config);
+	if (!self->screencopy)
+		return -1;
+
+	self->screencopy->on_done = pipeline_on_done;
+	self->screencopy->userdata = self;
+	self->screencopy->rate_limit = 1000;
+
+	self->feed.output_transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	self->feed.is_transformed = fake_screencopy_impl.caps &
+		SCREENCOPY_CAP_TRANSFORM;
+	self->feed.feed = display_feed;
+	self->feed.userdata = self;
+	return 0;
+}
+
+static void pipeline_destroy(struct pipeline* self)
+{
+	if (self->current)
+		fake_screencopy_release(self->screencopy, self->current);
+	screencopy_destroy(self->screencopy);
+}
+
+static void run_loop(struct pipeline* pipeline, int n_frames,
+		uint64_t timeout_us)
+{
+	uint64_t deadline = gettime_us() + timeout_us;
+	while (pipeline->n_frames < n_frames) {
+		uint64_t now = gettime_us();
+		if (now >= deadline)
+			break;
+		aml_poll(aml_get_default(), (deadline - now + 999) / 1000);
+		aml_dispatch(aml_get_default());
+	}
+}
+
+static int test_damage(void)
+{
+	static const struct fake_screencopy_step script[] = {
+		{ SCREENCOPY_DONE, 0, 8, 4, 16, 8 },
+		{ SCREENCOPY_FAILED, 0 },
+		{ SCREENCOPY_DONE, 0 },
+	};
+
+	struct pipeline pipeline;
+	ASSERT_INT_EQ(0, pipeline_init(&pipeline, script, 3, false));
+	screencopy_start(pipeline.screencopy, true);
+	run_loop(&pipeline, 2, TIMEOUT_US);
+
+	ASSERT_INT_EQ(2, pipeline.n_frames);
+	ASSERT_INT_EQ(8, pipeline.damage[0].x1);
+	ASSERT_INT_EQ(4, pipeline.damage[0].y1);
+	ASSERT_INT_EQ(24, pipeline.damage[0].x2);
+	ASSERT_INT_EQ(12, pipeline.damage[0].y2);
+	ASSERT_TRUE(pipeline.is_fed_at_set[0]);
+	ASSERT_INT_EQ(WIDTH, pipeline.damage[1].x2);
+	ASSERT_INT_EQ(HEIGHT, pipeline.damage[1].y2);
+
+	pipeline_destroy(&pipeline);
+	return 0;
+}
+
+static int test_y_inverted(void)
+{
+	static const struct fake_screencopy_step script[] = {
+		{ SCREENCOPY_DONE, 0, 8, 4, 16, 8 },
+	};
+
+	struct pipeline pipeline;
+	ASSERT_INT_EQ(0, pipeline_init(&pipeline, script, 1, false));
+	pipeline.feed.is_transformed = false;
+	pipeline.y_inverted = true;
+	screencopy_start(pipeline.screencopy, true);
+	run_loop(&pipeline, 1, TIMEOUT_US);
+
+	// The damage is flipped to match the upright frame
+	ASSERT_INT_EQ(1, pipeline.n_frames);
+	ASSERT_INT_EQ(8, pipeline.damage[0].x1);
+	ASSERT_INT_EQ(HEIGHT - 12, pipeline.damage[0].y1);
+	ASSERT_INT_EQ(24, pipeline.damage[0].x2);
+	ASSERT_INT_EQ(HEIGHT - 4, pipeline.damage[0].y2);
+
+	pipeline_destroy(&pipeline);
+	return 0;
+}
+
+static int test_damage_map(void)
+{
+	static const struct fake_screencopy_step script[] = {
+		{ SCREENCOPY_DONE, 0, 0, 0, TILE_SIZE, TILE_SIZE },
+	};
+
+	struct damage_map map;
+	ASSERT_INT_EQ(0, damage_map_init(&map, TILE_SIZE, 10.0));
+
+	struct pipeline pipeline;
+	ASSERT_INT_EQ(0, pipeline_init(&pipeline, script, 1, false));
+	pipeline.feed.damage_map = &map;
+	screencopy_start(pipeline.screencopy, true);
+	run_loop(&pipeline, 1, TIMEOUT_US);
+	ASSERT_INT_EQ(1, pipeline.n_frames);
+
+	// Sized from the captured buffer
+	ASSERT_INT_EQ(WIDTH / TILE_SIZE, map.columns);
+	ASSERT_INT_EQ(HEIGHT / TILE_SIZE, map.rows);
+
+	double values[(WIDTH / TILE_SIZE) * (HEIGHT / TILE_SIZE)];
+	damage_map_snapshot(&map, values);
+	ASSERT_DOUBLE_GT(0.0, values[0]);
+	ASSERT_DOUBLE_EQ(0.0, values[1]);
+
+	pipeline_destroy(&pipeline);
+	damage_map_destroy(&map);
+	return 0;
+}
+
+static int test_buffer_reuse(void)
+{
+	static const struct fake_screencopy_step script[] = {
+		{ SCREENCOPY_DONE, 0 },
+	};
+
+	struct pipeline pipeline;
+	ASSERT_INT_EQ(0, pipeline_init(&pipeline, script, 1, true));
+	screencopy_start(pipeline.screencopy, true);
+	run_loop(&pipeline, 8, TIMEOUT_US);
+	ASSERT_INT_EQ(8, pipeline.n_frames);
+
+	// One buffer is held by the display while the next one is captured
+	struct fake_screencopy_stats stats;
+	fake_screencopy_get_stats(pipeline.screencopy, &stats);
+	ASSERT_UINT32_EQ(2, stats.n_buffers);
+
+	pipeline_destroy(&pipeline);
+	return 0;
+}
+
+int main()
+{
+	struct aml* aml = aml_new();
+	if (!aml)
+		return 1;
+	aml_set_default(aml);
+
+	int r = 0;
+	RUN_TEST(test_damage);
+	RUN_TEST(test_y_inverted);
+	RUN_TEST(test_damage_map);
+	RUN_TEST(test_buffer_reuse);
+
+	aml_unref(aml);
+	return r;
+}
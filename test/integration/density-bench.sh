@@ -0,0 +1,143 @@
+#!/usr/bin/env bash
+#
+# This is free and unencumbered software released into the public domain.
+#
+# Anyone is free to copy, modify, publish, use, compile, sell, or
+# distribute this software, either in source code form or as a compiled
+# binary, for any purpose, commercial or non-commercial, and by any
+# means.
+#
+# In jurisdictions that recognize copyright laws, the author or authors
+# of this software dedicate any and all copyright interest in the
+# software to the public domain. We make this dedication for the benefit
+# of the public at large and to the detriment of our heirs and
+# successors. We intend this dedication to be an overt act of
+# relinquishment in perpetuity of all present and future rights to this
+# software under copyright law.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+# EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+# MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+# IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+# OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+# ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+# OTHER DEALINGS IN THE SOFTWARE.
+#
+# For more information, please refer to <http://unlicense.org/>
+
+# Footprint benchmark for wayvnc
+#
+# Starts N headless sway instances, each with its own wayvnc, and reports the
+# resident (RSS) and proportional (PSS) memory and the number of open file
+# descriptors per wayvnc instance while idle.
+#
+# Usage: density-bench.sh [instances] [extra wayvnc arguments...]
+#
+# e.g. ./density-bench.sh 50 --high-density
+#
+# Prerequisites:
+# - wayvnc is built in ../build/, or in the $PATH
+#   - Override by setting $WAYVNC or $WAYVNC_BUILD_DIR
+# - sway is in the $PATH
+#   - Override by setting $SWAY
+
+set -e
+
+INTEGRATION_ROOT=$(realpath "$(dirname "$0")")
+REPO_ROOT=$(realpath "$INTEGRATION_ROOT/../..")
+WAYVNC_BUILD_DIR=${WAYVNC_BUILD_DIR:-$(realpath "$REPO_ROOT/build")}
+if [[ -d $WAYVNC_BUILD_DIR ]]; then
+	export PATH=$WAYVNC_BUILD_DIR:$PATH
+fi
+WAYVNC=${WAYVNC:-$(which wayvnc)}
+SWAY=${SWAY:-$(which sway)}
+
+INSTANCES=${1:-10}
+shift || true
+
+BENCH_ROOT=/tmp/wayvnc-density-$$
+BASE_PORT=${BASE_PORT:-15900}
+SETTLE_TIME=${SETTLE_TIME:-2}
+
+export XDG_CONFIG_HOME=$INTEGRATION_ROOT/xdg_config
+
+SWAY_PIDS=()
+WAYVNC_PIDS=()
+
+cleanup() {
+	set +e
+	for pid in "${WAYVNC_PIDS[@]}" "${SWAY_PIDS[@]}"; do
+		kill "$pid" 2>/dev/null
+	done
+	wait 2>/dev/null
+	rm -rf "$BENCH_ROOT"
+}
+trap cleanup EXIT
+
+wait_for_file() {
+	local i
+	for i in $(seq 50); do
+		[[ -e $1 ]] && return 0
+		sleep 0.1
+	done
+	echo "Timeout waiting for $1" >&2
+	return 1
+}
+
+start_instance() {
+	local i=$1
+	local runtime_dir=$BENCH_ROOT/$i
+	mkdir -p "$runtime_dir"
+
+	XDG_RUNTIME_DIR=$runtime_dir \
+	WLR_BACKENDS=headless \
+	WLR_LIBINPUT_NO_DEVICES=1 \
+	$SWAY &>"$runtime_dir/sway.log" &
+	SWAY_PIDS+=($!)
+
+	wait_for_file "$runtime_dir/sway.env"
+	local display
+	display=$(grep ^WAYLAND_DISPLAY= "$runtime_dir/sway.env" | cut -d= -f2-)
+
+	XDG_RUNTIME_DIR=$runtime_dir \
+	WAYLAND_DISPLAY=$display \
+	$WAYVNC "$@" 127.0.0.1 $((BASE_PORT + i)) &>"$runtime_dir/wayvnc.log" &
+	WAYVNC_PIDS+=($!)
+
+	wait_for_file "$runtime_dir/wayvncctl"
+}
+
+smaps_field() {
+	awk -v field="$2:" '$1 == field { print $2 }' "/proc/$1/smaps_rollup"
+}
+
+echo "Starting $INSTANCES instances: wayvnc $*"
+for i in $(seq 0 $((INSTANCES - 1))); do
+	start_instance "$i" "$@"
+done
+sleep "$SETTLE_TIME"
+
+total_rss=0
+total_pss=0
+total_fds=0
+printf "%8s %10s %10s %6s\n" PID "RSS (KiB)" "PSS (KiB)" FDS
+for pid in "${WAYVNC_PIDS[@]}"; do
+	if ! kill -0 "$pid" 2>/dev/null; then
+		echo "wayvnc ($pid) exited prematurely" >&2
+		exit 1
+	fi
+	rss=$(smaps_field "$pid" Rss)
+	pss=$(smaps_field "$pid" Pss)
+	fds=$(find "/proc/$pid/fd" -mindepth 1 | wc -l)
+	printf "%8d %10d %10d %6d\n" "$pid" "$rss" "$pss" "$fds"
+	total_rss=$((total_rss + rss))
+	total_pss=$((total_pss + pss))
+	total_fds=$((total_fds + fds))
+done
+
+echo
+printf "Total:        RSS %d KiB, PSS %d KiB, %d fds\n" \
+	$total_rss $total_pss $total_fds
+printf "Per instance: RSS %d KiB, PSS %d KiB, %d fds\n" \
+	$((total_rss / INSTANCES)) $((total_pss / INSTANCES)) \
+	$((total_fds / INSTANCES))
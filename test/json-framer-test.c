@@ -0,0 +1,154 @@
+#include "tst.h"
+
+#include "json-framer.h"
+
+#include <errno.h>
+
+static void feed(struct json_framer* framer, const char* data)
+{
+	size_t len = strlen(data);
+	while (len > 0) {
+		size_t space = 0;
+		char* dst = json_framer_write_ptr(framer, &space);
+		if (!dst)
+			return;
+		size_t n = len < space ? len : space;
+		memcpy(dst, data, n);
+		json_framer_commit(framer, n);
+		data += n;
+		len -= n;
+	}
+}
+
+static int test_single_object(void)
+{
+	struct json_framer framer;
+	json_framer_init(&framer, 64, 1024);
+
+	feed(&framer, "{\"method\": \"version\"}");
+	json_t* root = json_framer_next(&framer, NULL);
+	ASSERT_TRUE(root);
+	ASSERT_STR_EQ("version",
+			json_string_value(json_object_get(root, "method")));
+	json_decref(root);
+
+	ASSERT_FALSE(json_framer_next(&framer, NULL));
+	ASSERT_INT_EQ(EAGAIN, errno);
+	ASSERT_INT_EQ(0, json_framer_pending(&framer));
+
+	json_framer_destroy(&framer);
+	return 0;
+}
+
+static int test_split_object(void)
+{
+	struct json_framer framer;
+	json_framer_init(&framer, 64, 1024);
+
+	feed(&framer, "{\"a\": \"}{\\\"");
+	ASSERT_FALSE(json_framer_next(&framer, NULL));
+	ASSERT_INT_EQ(EAGAIN, errno);
+
+	feed(&framer, "\", \"b\": [1, {}]");
+	ASSERT_FALSE(json_framer_next(&framer, NULL));
+	ASSERT_INT_EQ(EAGAIN, errno);
+
+	feed(&framer, "}");
+	json_t* root = json_framer_next(&framer, NULL);
+	ASSERT_TRUE(root);
+	ASSERT_STR_EQ("}{\"", json_string_value(json_object_get(root, "a")));
+	json_decref(root);
+
+	json_framer_destroy(&framer);
+	return 0;
+}
+
+static int test_multiple_objects(void)
+{
+	struct json_framer framer;
+	json_framer_init(&framer, 64, 1024);
+
+	feed(&framer, " {\"id\": 1}\n{\"id\": 2}{\"id\"");
+
+	json_t* root = json_framer_next(&framer, NULL);
+	ASSERT_TRUE(root);
+	ASSERT_INT_EQ(1, json_integer_value(json_object_get(root, "id")));
+	json_decref(root);
+
+	root = json_framer_next(&framer, NULL);
+	ASSERT_TRUE(root);
+	ASSERT_INT_EQ(2, json_integer_value(json_object_get(root, "id")));
+	json_decref(root);
+
+	ASSERT_FALSE(json_framer_next(&framer, NULL));
+	ASSERT_INT_EQ(EAGAIN, errno);
+	ASSERT_INT_EQ(5, json_framer_pending(&framer));
+
+	json_framer_destroy(&framer);
+	return 0;
+}
+
+static int test_growth(void)
+{
+	struct json_framer framer;
+	json_framer_init(&framer, 16, 4096);
+	ASSERT_INT_EQ(0, json_framer_capacity(&framer));
+
+	char message[1024];
+	snprintf(message, sizeof(message), "{\"data\": \"%0900d\"}", 0);
+	feed(&framer, message);
+	ASSERT_INT_EQ(1024, json_framer_capacity(&framer));
+
+	json_t* root = json_framer_next(&framer, NULL);
+	ASSERT_TRUE(root);
+	ASSERT_INT_EQ(900, strlen(json_string_value(
+					json_object_get(root, "data"))));
+	json_decref(root);
+
+	json_framer_destroy(&framer);
+	return 0;
+}
+
+static int test_size_limit(void)
+{
+	struct json_framer framer;
+	json_framer_init(&framer, 16, 64);
+
+	feed(&framer, "{\"data\": \"");
+	for (int i = 0; i < 8; ++i)
+		feed(&framer, "0123456789");
+
+	size_t space = 0;
+	ASSERT_FALSE(json_framer_write_ptr(&framer, &space));
+	ASSERT_INT_EQ(EMSGSIZE, errno);
+	ASSERT_INT_EQ(64, json_framer_capacity(&framer));
+
+	json_framer_destroy(&framer);
+	return 0;
+}
+
+static int test_invalid(void)
+{
+	struct json_framer framer;
+	json_framer_init(&framer, 64, 1024);
+
+	feed(&framer, "nope");
+	json_error_t err;
+	ASSERT_FALSE(json_framer_next(&framer, &err));
+	ASSERT_INT_EQ(EINVAL, errno);
+
+	json_framer_destroy(&framer);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_single_object);
+	RUN_TEST(test_split_object);
+	RUN_TEST(test_multiple_objects);
+	RUN_TEST(test_growth);
+	RUN_TEST(test_size_limit);
+	RUN_TEST(test_invalid);
+	return r;
+}
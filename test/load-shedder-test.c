@@ -0,0 +1,222 @@
+#include "tst.h"
+
+#include "load-shedder.h"
+
+#include <string.h>
+
+// 30 frames per second at the given cost per frame
+static struct load_window window_at(uint64_t cost_us)
+{
+	return (struct load_window){
+		.n_frames = 30,
+		.process_us = 30 * cost_us / 2,
+		.n_released = 30,
+		.backlog_us = 30 * cost_us / 2,
+	};
+}
+
+static enum load_action update_n(struct load_shedder* shedder,
+		const struct load_window* window, int n)
+{
+	enum load_action action = LOAD_ACTION_NONE;
+	for (int i = 0; i < n; ++i)
+		action = load_shedder_update(shedder, window);
+	return action;
+}
+
+/*
+ * Runs a stream of frames at 30 FPS for the given number of seconds through
+ * the same accounting as wayvnc, with one encoder that takes encode_us for
+ * each frame and picks up the newest frame whenever it is free. Returns the
+ * first action that is taken, if any.
+ */
+static enum load_action run_stream(struct load_shedder* shedder,
+		uint64_t encode_us, int seconds)
+{
+	const uint64_t period = 1000000 / 30;
+	const uint64_t process_us = 2000;
+
+	struct encode_backlog backlog = { 0 };
+	struct load_window window = { 0 };
+
+	struct frame {
+		uint64_t seq, fed_at, done_at;
+	} current = { 0 }, late = { 0 };
+	uint64_t encoder_free = 0;
+
+	for (int i = 0; i < seconds * 30; ++i) {
+		uint64_t now = i * period;
+
+		if (late.seq && late.done_at <= now) {
+			window.n_released++;
+			window.backlog_us += encode_backlog_release(&backlog,
+					late.seq, late.fed_at, late.done_at);
+			late.seq = 0;
+		}
+
+		// The display lets go of the previous frame when it is replaced
+		if (current.seq && current.done_at > now) {
+			late = current;
+		} else if (current.seq) {
+			window.n_released++;
+			window.backlog_us += encode_backlog_release(&backlog,
+					current.seq, current.fed_at, now);
+		}
+
+		current.fed_at = now;
+		current.seq = encode_backlog_feed(&backlog, now);
+		current.done_at = 0;
+		if (encoder_free < now + period) {
+			uint64_t start = encoder_free > now ? encoder_free : now;
+			current.done_at = start + encode_us;
+			encoder_free = current.done_at;
+		}
+
+		window.n_frames++;
+		window.process_us += process_us;
+
+		if (window.n_frames == 30) {
+			enum load_action action =
+				load_shedder_update(shedder, &window);
+			if (action != LOAD_ACTION_NONE)
+				return action;
+			memset(&window, 0, sizeof(window));
+		}
+	}
+
+	return LOAD_ACTION_NONE;
+}
+
+static int test_steady_stream(void)
+{
+	struct load_shedder shedder;
+	load_shedder_init(&shedder, 30);
+
+	// Frames are held for a whole frame period, but encoded in 10 ms
+	ASSERT_INT_EQ(LOAD_ACTION_NONE, run_stream(&shedder, 10000, 10));
+	ASSERT_INT_EQ(30, shedder.rate);
+	ASSERT_FALSE(shedder.is_admission_closed);
+	ASSERT_DOUBLE_LT(0.5, shedder.load);
+	return 0;
+}
+
+static int test_encoder_backlog(void)
+{
+	struct load_shedder shedder;
+	load_shedder_init(&shedder, 30);
+
+	ASSERT_INT_EQ(LOAD_ACTION_LOWER_RATE, run_stream(&shedder, 50000, 10));
+	ASSERT_INT_EQ(22, shedder.rate);
+	return 0;
+}
+
+static int test_within_budget(void)
+{
+	struct load_shedder shedder;
+	load_shedder_init(&shedder, 30);
+
+	struct load_window window = window_at(20000);
+	ASSERT_INT_EQ(LOAD_ACTION_NONE, update_n(&shedder, &window, 10));
+	ASSERT_INT_EQ(30, shedder.rate);
+	ASSERT_FALSE(shedder.is_admission_closed);
+	return 0;
+}
+
+static int test_idle(void)
+{
+	struct load_shedder shedder;
+	load_shedder_init(&shedder, 30);
+
+	// A single slow frame on a still screen is not overload
+	struct load_window window = {
+		.n_frames = 1,
+		.process_us = 100000,
+	};
+	ASSERT_INT_EQ(LOAD_ACTION_NONE, update_n(&shedder, &window, 10));
+	ASSERT_INT_EQ(30, shedder.rate);
+	return 0;
+}
+
+static int test_escalation(void)
+{
+	struct load_shedder shedder;
+	load_shedder_init(&shedder, 30);
+
+	struct load_window window = window_at(500000);
+
+	ASSERT_INT_EQ(LOAD_ACTION_NONE, update_n(&shedder, &window, 2));
+	ASSERT_INT_EQ(LOAD_ACTION_LOWER_RATE, load_shedder_update(&shedder,
+				&window));
+	ASSERT_INT_EQ(22, shedder.rate);
+
+	enum load_action action;
+	do
+		action = update_n(&shedder, &window, 3);
+	while (action == LOAD_ACTION_LOWER_RATE);
+
+	ASSERT_INT_EQ(LOAD_SHEDDER_MIN_RATE, shedder.rate);
+	ASSERT_INT_EQ(LOAD_ACTION_CLOSE_ADMISSION, action);
+	ASSERT_TRUE(shedder.is_admission_closed);
+
+	ASSERT_INT_EQ(LOAD_ACTION_SHED_CLIENT, update_n(&shedder, &window, 3));
+	ASSERT_INT_EQ(LOAD_ACTION_SHED_CLIENT, update_n(&shedder, &window, 3));
+	return 0;
+}
+
+static int test_recovery(void)
+{
+	struct load_shedder shedder;
+	load_shedder_init(&shedder, 30);
+
+	struct load_window busy = window_at(500000);
+	while (!shedder.is_admission_closed)
+		load_shedder_update(&shedder, &busy);
+
+	struct load_window quiet = window_at(1000);
+	ASSERT_INT_EQ(LOAD_ACTION_NONE, update_n(&shedder, &quiet, 4));
+	ASSERT_INT_EQ(LOAD_ACTION_OPEN_ADMISSION, load_shedder_update(&shedder,
+				&quiet));
+	ASSERT_FALSE(shedder.is_admission_closed);
+
+	enum load_action action;
+	do
+		action = update_n(&shedder, &quiet, 5);
+	while (action == LOAD_ACTION_RAISE_RATE);
+
+	ASSERT_INT_EQ(LOAD_ACTION_NONE, action);
+	ASSERT_INT_EQ(30, shedder.rate);
+	return 0;
+}
+
+static int test_set_rate(void)
+{
+	struct load_shedder shedder;
+	load_shedder_init(&shedder, 30);
+
+	load_shedder_set_rate(&shedder, 60);
+	ASSERT_INT_EQ(60, shedder.rate);
+
+	struct load_window busy = window_at(500000);
+	update_n(&shedder, &busy, 3);
+	ASSERT_INT_EQ(45, shedder.rate);
+
+	// A reduced rate stays reduced until the load drops
+	load_shedder_set_rate(&shedder, 50);
+	ASSERT_INT_EQ(45, shedder.rate);
+	load_shedder_set_rate(&shedder, 20);
+	ASSERT_INT_EQ(20, shedder.rate);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_within_budget);
+	RUN_TEST(test_idle);
+	RUN_TEST(test_escalation);
+	RUN_TEST(test_recovery);
+	RUN_TEST(test_set_rate);
+	RUN_TEST(test_steady_stream);
+	RUN_TEST(test_encoder_backlog);
+	return r;
+}